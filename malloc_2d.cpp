@@ -1,8 +1,15 @@
 
 #include "malloc_2d.h"
+#include <algorithm>
 
 static malloc_2d_t _malloc_2d;
 static malloc_2d_t *malloc_2d = NULL;
+// Number of times the allocator has been initialized, which invalidates sc cached in handles
+static uint64_t malloc_2d_epoch = 0UL;
+
+#ifdef MALLOC_2D_THREAD_SAFE
+static void malloc_2d_tcache_destroy(void *arg);
+#endif
 
 //
 //* malloc_2d_debug
@@ -28,29 +35,907 @@ void *malloc_2d_debug_alloc(size_t sz) {
   return ret;
 }
 
+//
+//* malloc_2d_slab_t
+//
+
+// Offset of the arena headers from the region object (MALLOC_2D_ARENA_SIDE_TABLE only)
+#define MALLOC_2D_SLAB_ARENA_TABLE_OFFSET ((sizeof(malloc_2d_slab_region_t) + 63UL) & ~63UL)
+
+// Pages of the region object, including the arena headers that follow it with MALLOC_2D_ARENA_SIDE_TABLE
+static int malloc_2d_slab_region_get_page_count() {
+#ifdef MALLOC_2D_ARENA_SIDE_TABLE
+  uint64_t size = MALLOC_2D_SLAB_ARENA_TABLE_OFFSET + sizeof(malloc_2d_arena_t) * MALLOC_2D_SLAB_CHUNK_COUNT;
+#else
+  uint64_t size = sizeof(malloc_2d_slab_region_t);
+#endif
+  return (int)((size + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE);
+}
+
+// Reserve a region aligned to the region size. The excess of the reservation is returned right away
+static malloc_2d_slab_region_t *malloc_2d_slab_region_init() {
+  int page_count = (int)(MALLOC_2D_SLAB_REGION_SIZE / MALLOC_2D_PAGE_SIZE);
+  uint8_t *ptr = (uint8_t *)malloc_2d_alloc_os_page_unaligned(page_count * 2);
+  uint8_t *base = (uint8_t *)(((uint64_t)ptr + MALLOC_2D_SLAB_REGION_SIZE - 1) & ~(MALLOC_2D_SLAB_REGION_SIZE - 1));
+  int head_page_count = (int)((base - ptr) / MALLOC_2D_PAGE_SIZE);
+  if(head_page_count != 0) {
+    malloc_2d_free_os_page(ptr, head_page_count);
+  }
+  if(head_page_count != page_count) {
+    malloc_2d_free_os_page(base + MALLOC_2D_SLAB_REGION_SIZE, page_count - head_page_count);
+  }
+  if((uint64_t)base / MALLOC_2D_SLAB_REGION_SIZE >= MALLOC_2D_SLAB_TABLE_SIZE) {
+    error_exit("[malloc_2d] Region 0x%lX is beyond %d bits of address\n", (uint64_t)base, MALLOC_2D_SLAB_VA_BITS);
+  }
+  // Memory from the OS is zero-initialized, i.e., no chunk is dirty
+  malloc_2d_slab_region_t *region = \
+    (malloc_2d_slab_region_t *)malloc_2d_alloc_os_page_unaligned(malloc_2d_slab_region_get_page_count());
+  region->base = base;
+#ifdef MALLOC_2D_ARENA_SIDE_TABLE
+  region->arenas = (malloc_2d_arena_t *)MALLOC_2D_PTR_ADD(region, (int)MALLOC_2D_SLAB_ARENA_TABLE_OFFSET);
+#endif
+  region->free_count = MALLOC_2D_SLAB_CHUNK_COUNT;
+  region->hint = 0;
+  memset(region->free_map, 0xFF, sizeof(region->free_map));
+  malloc_2d->slab_region_table[(uint64_t)base / MALLOC_2D_SLAB_REGION_SIZE] = region;
+  return region;
+}
+
+// Returns the index of the first chunk of the first run of "count" free chunks; -1 if not found
+static int malloc_2d_slab_region_find(malloc_2d_slab_region_t *region, int count) {
+  if(count == 1) {
+    for(int i = region->hint;i < MALLOC_2D_SLAB_WORD_COUNT;i++) {
+      if(region->free_map[i] != 0UL) {
+        region->hint = i;
+        return i * 64 + __builtin_ctzl(region->free_map[i]);
+      }
+    }
+    return -1;
+  }
+  int run = 0;
+  for(int i = region->hint * 64;i < MALLOC_2D_SLAB_CHUNK_COUNT;i++) {
+    uint64_t word = region->free_map[i / 64];
+    if((i % 64) == 0 && word == 0UL) {
+      run = 0;
+      i += 63;
+    } else if((word >> (i % 64)) & 0x1UL) {
+      if(++run == count) {
+        return i - count + 1;
+      }
+    } else {
+      run = 0;
+    }
+  }
+  return -1;
+}
+
+// Called on every arena allocation and free with the slab lock held
+static void malloc_2d_slab_tick() {
+  if(++malloc_2d->slab_op_count >= MALLOC_2D_SLAB_DECAY_OPS || 
+     malloc_2d_get_time() - malloc_2d->slab_decay_time >= MALLOC_2D_SLAB_DECAY_NS) {
+    malloc_2d_slab_decay();
+  }
+  return;
+}
+
+void *malloc_2d_slab_alloc(int count, int *is_zero) {
+  malloc_2d_lock(&malloc_2d->slab_lock);
+  malloc_2d_slab_region_t *region = NULL;
+  int index = -1;
+  for(int i = 0;i < malloc_2d->slab_region_count && index == -1;i++) {
+    region = malloc_2d->slab_regions[i];
+    if(region->free_count >= count) {
+      index = malloc_2d_slab_region_find(region, count);
+    }
+  }
+  if(index == -1) {
+    if(malloc_2d->slab_region_count == MALLOC_2D_SLAB_REGION_MAX) {
+      error_exit("[malloc_2d] Out of slab regions (%d regions of %lu bytes)\n", 
+        MALLOC_2D_SLAB_REGION_MAX, MALLOC_2D_SLAB_REGION_SIZE);
+    }
+    region = malloc_2d_slab_region_init();
+    malloc_2d->slab_regions[malloc_2d->slab_region_count++] = region;
+    index = malloc_2d_slab_region_find(region, count);
+    assert(index == 0);
+  }
+  *is_zero = 1;
+  for(int i = index;i < index + count;i++) {
+    uint64_t bit = 1UL << (i % 64);
+    assert(region->free_map[i / 64] & bit);
+    region->free_map[i / 64] &= ~bit;
+    if((region->dirty_map[i / 64] | region->aged_map[i / 64]) & bit) {
+      region->dirty_map[i / 64] &= ~bit;
+      region->aged_map[i / 64] &= ~bit;
+      malloc_2d->slab_dirty_count--;
+      *is_zero = 0;
+    }
+  }
+  region->free_count -= count;
+  if(*is_zero == 0) {
+    malloc_2d_stat_inc(&malloc_2d->stat->slab_reuse_count, 1UL);
+  }
+  malloc_2d_slab_tick();
+  malloc_2d_unlock(&malloc_2d->slab_lock);
+  return MALLOC_2D_PTR_ADD(region->base, (int)(index * MALLOC_2D_SLAB_CHUNK_SIZE));
+}
+
+void malloc_2d_slab_free(void *ptr, int count) {
+  malloc_2d_lock(&malloc_2d->slab_lock);
+  malloc_2d_slab_region_t *region = malloc_2d->slab_region_table[(uint64_t)ptr / MALLOC_2D_SLAB_REGION_SIZE];
+  if(region == NULL) {
+    error_exit("[malloc_2d] Pointer 0x%lX is not in any slab region\n", (uint64_t)ptr);
+  }
+  int index = (int)(((uint64_t)ptr - (uint64_t)region->base) / MALLOC_2D_SLAB_CHUNK_SIZE);
+  for(int i = index;i < index + count;i++) {
+    uint64_t bit = 1UL << (i % 64);
+    assert((region->free_map[i / 64] & bit) == 0UL);
+    region->free_map[i / 64] |= bit;
+    region->dirty_map[i / 64] |= bit;
+  }
+  region->free_count += count;
+  if(index / 64 < region->hint) {
+    region->hint = index / 64;
+  }
+  malloc_2d->slab_dirty_count += count;
+  if(malloc_2d->slab_dirty_count > MALLOC_2D_SLAB_DIRTY_MAX) {
+    malloc_2d_slab_purge();
+  }
+  malloc_2d_slab_tick();
+  malloc_2d_unlock(&malloc_2d->slab_lock);
+  return;
+}
+
+// One madvise() per run of chunks whose bit is set in the map. The addresses stay reserved. 
+// Returns the number of chunks
+static int malloc_2d_slab_region_advise(malloc_2d_slab_region_t *region, uint64_t *map, int advice) {
+  int count = 0;
+  int begin = -1;
+  for(int i = 0;i <= MALLOC_2D_SLAB_CHUNK_COUNT;i++) {
+    if(i < MALLOC_2D_SLAB_CHUNK_COUNT && (i % 64) == 0 && map[i / 64] == 0UL && begin == -1) {
+      i += 63;
+      continue;
+    }
+    int is_set = (i < MALLOC_2D_SLAB_CHUNK_COUNT) && ((map[i / 64] >> (i % 64)) & 0x1UL);
+    if(is_set == 1 && begin == -1) {
+      begin = i;
+    } else if(is_set == 0 && begin != -1) {
+      void *ptr = MALLOC_2D_PTR_ADD(region->base, (int)(begin * MALLOC_2D_SLAB_CHUNK_SIZE));
+      uint64_t size = (uint64_t)(i - begin) * MALLOC_2D_SLAB_CHUNK_SIZE;
+      int ret = madvise(ptr, size, advice);
+      // MADV_FREE is not supported before Linux 4.5
+      if(ret != 0 && advice != MADV_DONTNEED) {
+        ret = madvise(ptr, size, MADV_DONTNEED);
+      }
+      SYSEXPECT(ret == 0);
+      malloc_2d_stat_inc(&malloc_2d->stat->madvise_count, 1UL);
+      malloc_2d_stat_inc(&malloc_2d->stat->madvise_page_count, (uint64_t)(i - begin) * MALLOC_2D_ARENA_SIZE);
+      count += i - begin;
+      begin = -1;
+    }
+  }
+  return count;
+}
+
+void malloc_2d_slab_purge() {
+  for(int i = 0;i < malloc_2d->slab_region_count;i++) {
+    malloc_2d_slab_region_t *region = malloc_2d->slab_regions[i];
+    for(int j = 0;j < MALLOC_2D_SLAB_WORD_COUNT;j++) {
+      region->dirty_map[j] |= region->aged_map[j];
+      region->aged_map[j] = 0UL;
+    }
+    malloc_2d_slab_region_advise(region, region->dirty_map, MADV_DONTNEED);
+    memset(region->dirty_map, 0x00, sizeof(region->dirty_map));
+  }
+  malloc_2d->slab_dirty_count = 0;
+  return;
+}
+
+void malloc_2d_slab_decay() {
+  int i = 0;
+  while(i < malloc_2d->slab_region_count) {
+    malloc_2d_slab_region_t *region = malloc_2d->slab_regions[i];
+    malloc_2d->slab_dirty_count -= malloc_2d_slab_region_advise(region, region->aged_map, MADV_DONTNEED);
+    malloc_2d_slab_region_advise(region, region->dirty_map, MADV_FREE);
+    memcpy(region->aged_map, region->dirty_map, sizeof(region->aged_map));
+    memset(region->dirty_map, 0x00, sizeof(region->dirty_map));
+    // The region is entirely free and none of its chunks is cached
+    int is_empty = (region->free_count == MALLOC_2D_SLAB_CHUNK_COUNT);
+    for(int j = 0;j < MALLOC_2D_SLAB_WORD_COUNT && is_empty == 1;j++) {
+      is_empty = (region->aged_map[j] == 0UL);
+    }
+    if(i != 0 && is_empty == 1) {
+      malloc_2d->slab_region_table[(uint64_t)region->base / MALLOC_2D_SLAB_REGION_SIZE] = NULL;
+      malloc_2d_free_os_page(region->base, (int)(MALLOC_2D_SLAB_REGION_SIZE / MALLOC_2D_PAGE_SIZE));
+      malloc_2d_free_os_page(region, malloc_2d_slab_region_get_page_count());
+      malloc_2d->slab_region_count--;
+      memmove(&malloc_2d->slab_regions[i], &malloc_2d->slab_regions[i + 1], 
+        sizeof(malloc_2d_slab_region_t *) * (malloc_2d->slab_region_count - i));
+    } else {
+      i++;
+    }
+  }
+  malloc_2d->slab_op_count = 0;
+  malloc_2d->slab_decay_time = malloc_2d_get_time();
+  malloc_2d_stat_inc(&malloc_2d->stat->slab_decay_count, 1UL);
+  return;
+}
+
+//
+//* malloc_2d_huge_t
+//
+
+// Remove the cached mapping at the given index and return it. The caller must hold the huge lock
+static malloc_2d_huge_cache_t malloc_2d_huge_cache_remove(int index) {
+  malloc_2d_huge_cache_t entry = malloc_2d->huge_cache[index];
+  malloc_2d->huge_cache[index] = malloc_2d->huge_cache[--malloc_2d->huge_cache_count];
+  malloc_2d->huge_cache_page_count -= entry.page_count;
+  return entry;
+}
+
+// Unmap cached mappings older than MALLOC_2D_SLAB_DECAY_NS. The caller must hold the huge lock
+static void malloc_2d_huge_cache_expire(uint64_t now) {
+  int i = 0;
+  while(i < malloc_2d->huge_cache_count) {
+    if(now - malloc_2d->huge_cache[i].time >= MALLOC_2D_SLAB_DECAY_NS) {
+      malloc_2d_huge_cache_t entry = malloc_2d_huge_cache_remove(i);
+      malloc_2d_free_os_page(entry.ptr, entry.page_count);
+    } else {
+      i++;
+    }
+  }
+  return;
+}
+
+void *malloc_2d_huge_map(int page_count, uint64_t alignment, int *is_zero) {
+  if(alignment > MALLOC_2D_PAGE_SIZE) {
+    // Map enough pages to contain an aligned range, and return the rest right away
+    int align_page_count = (int)(alignment / MALLOC_2D_PAGE_SIZE);
+    uint8_t *ptr = (uint8_t *)malloc_2d_alloc_os_page_unaligned(page_count + align_page_count - 1);
+    uint8_t *base = (uint8_t *)(((uint64_t)ptr + alignment - 1) & ~(alignment - 1));
+    int head_page_count = (int)((base - ptr) / MALLOC_2D_PAGE_SIZE);
+    if(head_page_count != 0) {
+      malloc_2d_free_os_page(ptr, head_page_count);
+    }
+    if(head_page_count != align_page_count - 1) {
+      malloc_2d_free_os_page(base + page_count * MALLOC_2D_PAGE_SIZE, align_page_count - 1 - head_page_count);
+    }
+    *is_zero = 1;
+    return base;
+  }
+  malloc_2d_lock(&malloc_2d->huge_lock);
+  malloc_2d_huge_cache_expire(malloc_2d_get_time());
+  int best = -1;
+  for(int i = 0;i < malloc_2d->huge_cache_count;i++) {
+    if(malloc_2d->huge_cache[i].page_count >= page_count && 
+       (best == -1 || malloc_2d->huge_cache[i].page_count < malloc_2d->huge_cache[best].page_count)) {
+      best = i;
+    }
+  }
+  if(best != -1) {
+    malloc_2d_huge_cache_t entry = malloc_2d_huge_cache_remove(best);
+    malloc_2d_unlock(&malloc_2d->huge_lock);
+    // The tail of a larger mapping is returned to the OS
+    if(entry.page_count > page_count) {
+      malloc_2d_free_os_page(MALLOC_2D_PTR_ADD(entry.ptr, (int)(page_count * MALLOC_2D_PAGE_SIZE)), 
+        entry.page_count - page_count);
+    }
+    malloc_2d_stat_inc(&malloc_2d->stat->huge_cache_hit_count, 1UL);
+    *is_zero = 0;
+    return entry.ptr;
+  }
+  malloc_2d_unlock(&malloc_2d->huge_lock);
+  *is_zero = 1;
+  return malloc_2d_alloc_os_page_unaligned(page_count);
+}
+
+// The oldest mappings are evicted if the cache is full
+void malloc_2d_huge_unmap(void *ptr, int page_count) {
+  if(page_count > MALLOC_2D_HUGE_CACHE_MAX_PAGES) {
+    malloc_2d_free_os_page(ptr, page_count);
+    return;
+  }
+  uint64_t now = malloc_2d_get_time();
+  malloc_2d_lock(&malloc_2d->huge_lock);
+  malloc_2d_huge_cache_expire(now);
+  while(malloc_2d->huge_cache_count == MALLOC_2D_HUGE_CACHE_COUNT || 
+        malloc_2d->huge_cache_page_count + page_count > MALLOC_2D_HUGE_CACHE_MAX_PAGES) {
+    int oldest = 0;
+    for(int i = 1;i < malloc_2d->huge_cache_count;i++) {
+      if(malloc_2d->huge_cache[i].time < malloc_2d->huge_cache[oldest].time) {
+        oldest = i;
+      }
+    }
+    malloc_2d_huge_cache_t entry = malloc_2d_huge_cache_remove(oldest);
+    malloc_2d_free_os_page(entry.ptr, entry.page_count);
+  }
+  malloc_2d_huge_cache_t *entry = &malloc_2d->huge_cache[malloc_2d->huge_cache_count++];
+  entry->ptr = ptr;
+  entry->page_count = page_count;
+  entry->time = now;
+  malloc_2d->huge_cache_page_count += page_count;
+  malloc_2d_unlock(&malloc_2d->huge_lock);
+  return;
+}
+
+void malloc_2d_huge_decay(int all) {
+  malloc_2d_lock(&malloc_2d->huge_lock);
+  if(all == 1) {
+    while(malloc_2d->huge_cache_count > 0) {
+      malloc_2d_huge_cache_t entry = malloc_2d_huge_cache_remove(0);
+      malloc_2d_free_os_page(entry.ptr, entry.page_count);
+    }
+  } else {
+    malloc_2d_huge_cache_expire(malloc_2d_get_time());
+  }
+  malloc_2d_unlock(&malloc_2d->huge_lock);
+  return;
+}
+
+// Header of the arena in the slab whose first chunk is at base
+inline static malloc_2d_arena_t *malloc_2d_slab_get_arena(void *base) {
+#ifdef MALLOC_2D_ARENA_SIDE_TABLE
+  malloc_2d_slab_region_t *region = malloc_2d->slab_region_table[(uint64_t)base / MALLOC_2D_SLAB_REGION_SIZE];
+  return &region->arenas[((uint64_t)base - (uint64_t)region->base) / MALLOC_2D_SLAB_CHUNK_SIZE];
+#else
+  return (malloc_2d_arena_t *)base;
+#endif
+}
+
+//
+//* malloc_2d_page_map_t
+//
+
+#define MALLOC_2D_PAGE_MAP_LEAF_PAGE_COUNT \
+  ((int)(MALLOC_2D_PAGE_MAP_LEAF_SIZE * sizeof(uint64_t) / MALLOC_2D_PAGE_SIZE))
+#define MALLOC_2D_PAGE_MAP_ROOT_PAGE_COUNT \
+  ((int)(MALLOC_2D_PAGE_MAP_ROOT_SIZE * sizeof(uint64_t *) / MALLOC_2D_PAGE_SIZE))
+
+// Returns the leaf covering the page, mapping it if it does not exist. Threads racing on the same 
+// leaf install it with CAS, and the losers unmap theirs
+static uint64_t *malloc_2d_page_map_get_leaf(uint64_t page) {
+  uint64_t **slot = &malloc_2d->page_map[page / MALLOC_2D_PAGE_MAP_LEAF_SIZE];
+  uint64_t *leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if(leaf != NULL) {
+    return leaf;
+  }
+  uint64_t *new_leaf = (uint64_t *)malloc_2d_alloc_os_page_unaligned(MALLOC_2D_PAGE_MAP_LEAF_PAGE_COUNT);
+  if(__atomic_compare_exchange_n(slot, &leaf, new_leaf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) == false) {
+    malloc_2d_free_os_page(new_leaf, MALLOC_2D_PAGE_MAP_LEAF_PAGE_COUNT);
+    return leaf;
+  }
+  __atomic_fetch_add(&malloc_2d->page_map_leaf_count, 1, __ATOMIC_RELAXED);
+  return new_leaf;
+}
+
+void malloc_2d_page_map_set(void *ptr, int page_count, malloc_2d_arena_t *arena) {
+  uint64_t page = (uint64_t)ptr / MALLOC_2D_PAGE_SIZE;
+  if(page + page_count > MALLOC_2D_PAGE_MAP_ROOT_SIZE * MALLOC_2D_PAGE_MAP_LEAF_SIZE) {
+    error_exit("[malloc_2d] Page 0x%lX is beyond %d bits of address\n", (uint64_t)ptr, MALLOC_2D_SLAB_VA_BITS);
+  }
+  uint64_t *leaf = NULL;
+  for(uint64_t i = page;i < page + page_count;i++) {
+    if(leaf == NULL || i % MALLOC_2D_PAGE_MAP_LEAF_SIZE == 0) {
+      leaf = malloc_2d_page_map_get_leaf(i);
+    }
+    uint64_t entry = 0UL;
+    if(arena != NULL) {
+      entry = (uint64_t)arena | ((i != page) ? MALLOC_2D_PAGE_MAP_INTERIOR : 0UL);
+    }
+    __atomic_store_n(&leaf[i % MALLOC_2D_PAGE_MAP_LEAF_SIZE], entry, __ATOMIC_RELAXED);
+  }
+  return;
+}
+
+// Returns the arena that owns the page of ptr, or NULL if the page is not mapped by malloc_2d
+inline static malloc_2d_arena_t *malloc_2d_page_map_get(void *ptr) {
+  uint64_t page = (uint64_t)ptr / MALLOC_2D_PAGE_SIZE;
+  if(page >= MALLOC_2D_PAGE_MAP_ROOT_SIZE * MALLOC_2D_PAGE_MAP_LEAF_SIZE) {
+    return NULL;
+  }
+  uint64_t *leaf = __atomic_load_n(&malloc_2d->page_map[page / MALLOC_2D_PAGE_MAP_LEAF_SIZE], __ATOMIC_ACQUIRE);
+  if(leaf == NULL) {
+    return NULL;
+  }
+  uint64_t entry = __atomic_load_n(&leaf[page % MALLOC_2D_PAGE_MAP_LEAF_SIZE], __ATOMIC_RELAXED);
+  return (malloc_2d_arena_t *)(entry & ~MALLOC_2D_PAGE_MAP_INTERIOR);
+}
+
+// Returns the arena of an object through the page map. Arenas in the slab may span several chunks, 
+// and every page of them maps to the header
+inline static malloc_2d_arena_t *malloc_2d_arena_get(void *ptr) {
+  malloc_2d_arena_t *arena = malloc_2d_page_map_get(ptr);
+  if(arena == NULL) {
+    error_exit("[malloc_2d] 0x%lX was not allocated by malloc_2d\n", (uint64_t)ptr);
+  }
+  return arena;
+}
+
+uint64_t malloc_2d_page_map_for_each(malloc_2d_arena_func_t func, void *arg) {
+  uint64_t count = 0UL;
+  for(uint64_t i = 0;i < MALLOC_2D_PAGE_MAP_ROOT_SIZE;i++) {
+    uint64_t *leaf = __atomic_load_n(&malloc_2d->page_map[i], __ATOMIC_ACQUIRE);
+    if(leaf == NULL) {
+      continue;
+    }
+    for(uint64_t j = 0;j < MALLOC_2D_PAGE_MAP_LEAF_SIZE;j++) {
+      uint64_t entry = __atomic_load_n(&leaf[j], __ATOMIC_RELAXED);
+      if(entry != 0UL && (entry & MALLOC_2D_PAGE_MAP_INTERIOR) == 0UL) {
+        func((malloc_2d_arena_t *)entry, arg);
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+//
+//* malloc_2d_profile_t
+//
+
+// Module whose executable segment contains addr, or whose name matches name_len bytes at name
+typedef struct {
+  uint64_t addr;
+  const char *name;
+  int name_len;
+  // Set when found
+  const char *found_name;
+  uint64_t base;
+} malloc_2d_module_query_t;
+
+// Modules are named by their file name, and the main program, whose name is empty, by "[exe]"
+static const char *malloc_2d_module_get_name(struct dl_phdr_info *info) {
+  if(info->dlpi_name[0] == '\0') {
+    return "[exe]";
+  }
+  const char *slash = strrchr(info->dlpi_name, '/');
+  return (slash == NULL) ? info->dlpi_name : slash + 1;
+}
+
+static int malloc_2d_module_find_name(struct dl_phdr_info *info, size_t size, void *arg) {
+  (void)size;
+  malloc_2d_module_query_t *query = (malloc_2d_module_query_t *)arg;
+  const char *name = malloc_2d_module_get_name(info);
+  if((int)strlen(name) == query->name_len && memcmp(name, query->name, query->name_len) == 0) {
+    query->found_name = name;
+    query->base = info->dlpi_addr;
+    return 1;
+  }
+  return 0;
+}
+
+#ifdef MALLOC_2D_TYPE_PROFILE
+
+static int malloc_2d_module_find_addr(struct dl_phdr_info *info, size_t size, void *arg) {
+  (void)size;
+  malloc_2d_module_query_t *query = (malloc_2d_module_query_t *)arg;
+  for(int i = 0;i < info->dlpi_phnum;i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    uint64_t begin = info->dlpi_addr + phdr->p_vaddr;
+    if(phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X) != 0 && 
+       query->addr >= begin && query->addr < begin + phdr->p_memsz) {
+      query->found_name = malloc_2d_module_get_name(info);
+      query->base = info->dlpi_addr;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Type allocated last by the thread, which votes for the next type of its entry
+static __thread uint64_t malloc_2d_profile_last_type __attribute__((tls_model("initial-exec"))) = 0UL;
+
+// Returns the entry of the type, or NULL if it does not exist and either "create" is 0 or the table 
+// is 3/4 full. The caller must hold the profile lock
+static malloc_2d_profile_t *malloc_2d_profile_get(uint64_t type_id, int create) {
+  uint64_t mask = MALLOC_2D_PROFILE_TABLE_SIZE - 1;
+  uint64_t index = (type_id * 0x9e3779b97f4a7c15UL >> 32) & mask;
+  while(malloc_2d->profile[index].type_id != type_id) {
+    if(malloc_2d->profile[index].type_id == 0UL) {
+      if(create == 0 || malloc_2d->profile_count * 4 >= MALLOC_2D_PROFILE_TABLE_SIZE * 3) {
+        return NULL;
+      }
+      malloc_2d->profile[index].type_id = type_id;
+      malloc_2d->profile[index].update_time = malloc_2d_get_time();
+      malloc_2d->profile_count++;
+      break;
+    }
+    index = (index + 1) & mask;
+  }
+  return &malloc_2d->profile[index];
+}
+
+// Advance the integral of the live count to the given time
+static void malloc_2d_profile_update(malloc_2d_profile_t *profile, uint64_t now) {
+  if(now > profile->update_time) {
+    profile->live_ns += (profile->alloc_count - profile->free_count) * (now - profile->update_time);
+    profile->update_time = now;
+  }
+  return;
+}
+
+void malloc_2d_profile_alloc(uint64_t type_id, uint64_t sz, int count) {
+  uint64_t now = malloc_2d_get_time();
+  uint64_t last_type = malloc_2d_profile_last_type;
+  malloc_2d_profile_last_type = type_id;
+  int bucket = (sz <= 1UL) ? 0 : 63 - __builtin_clzl(sz);
+  if(bucket >= MALLOC_2D_PROFILE_SIZE_BUCKETS) {
+    bucket = MALLOC_2D_PROFILE_SIZE_BUCKETS - 1;
+  }
+  malloc_2d_lock(&malloc_2d->profile_lock);
+  malloc_2d_profile_t *profile = malloc_2d_profile_get(type_id, 1);
+  if(profile == NULL) {
+    malloc_2d_unlock(&malloc_2d->profile_lock);
+    malloc_2d_stat_inc(&malloc_2d->stat->profile_drop_count, (uint64_t)count);
+    return;
+  }
+  malloc_2d_profile_update(profile, now);
+  profile->alloc_count += (uint64_t)count;
+  profile->size_sum += sz * (uint64_t)count;
+  profile->size_hist[bucket] += (uint64_t)count;
+  if(profile->alloc_count - profile->free_count > profile->max_live_count) {
+    profile->max_live_count = profile->alloc_count - profile->free_count;
+  }
+  // Boyer-Moore majority vote, which finds the next type if it follows more than half of the time
+  if(last_type != 0UL && last_type != type_id) {
+    malloc_2d_profile_t *last = malloc_2d_profile_get(last_type, 0);
+    if(last != NULL) {
+      if(last->next_type_id == type_id) {
+        last->next_votes++;
+      } else if(last->next_votes == 0) {
+        last->next_type_id = type_id;
+        last->next_votes = 1;
+      } else {
+        last->next_votes--;
+      }
+    }
+  }
+  malloc_2d_unlock(&malloc_2d->profile_lock);
+  return;
+}
+
+void malloc_2d_profile_release(uint64_t type_id, uint64_t count) {
+  if(count == 0UL) {
+    return;
+  }
+  uint64_t now = malloc_2d_get_time();
+  malloc_2d_lock(&malloc_2d->profile_lock);
+  malloc_2d_profile_t *profile = malloc_2d_profile_get(type_id, 0);
+  if(profile != NULL) {
+    malloc_2d_profile_update(profile, now);
+    profile->free_count += count;
+  }
+  malloc_2d_unlock(&malloc_2d->profile_lock);
+  return;
+}
+
+// Untyped objects are not recorded
+void malloc_2d_profile_dealloc(void *ptr) {
+  malloc_2d_arena_t *arena = malloc_2d_arena_get(ptr);
+  if(arena->sc != NULL && arena->sc->type_id != 0UL) {
+    malloc_2d_profile_release(arena->sc->type_id, 1UL);
+  }
+  return;
+}
+
+// Writes the type ID as the module and offset if it is a code address, and in hex otherwise
+static int malloc_2d_profile_format_id(char *buf, int size, uint64_t type_id) {
+  malloc_2d_module_query_t query = {type_id, NULL, 0, NULL, 0UL};
+  if(type_id != 0UL && dl_iterate_phdr(malloc_2d_module_find_addr, &query) != 0) {
+    return snprintf(buf, (size_t)size, "%s+0x%lx", query.found_name, type_id - query.base);
+  }
+  return snprintf(buf, (size_t)size, "0x%lx", type_id);
+}
+
+// Entries are copied out one at a time, such that the profile lock is not held while modules are 
+// enumerated under the lock of the dynamic linker, which may itself call malloc()
+int malloc_2d_profile_dump(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    return -1;
+  }
+  char line[1024];
+  int len = snprintf(line, sizeof(line), "# type alloc free max_live size_sum live_ns next next_votes size_hist[%d]\n", 
+    MALLOC_2D_PROFILE_SIZE_BUCKETS);
+  int ret = (write(fd, line, (size_t)len) == len) ? 0 : -1;
+  uint64_t now = malloc_2d_get_time();
+  for(int i = 0;i < MALLOC_2D_PROFILE_TABLE_SIZE && ret >= 0;i++) {
+    malloc_2d_lock(&malloc_2d->profile_lock);
+    if(malloc_2d->profile[i].type_id != 0UL) {
+      malloc_2d_profile_update(&malloc_2d->profile[i], now);
+    }
+    malloc_2d_profile_t profile = malloc_2d->profile[i];
+    malloc_2d_unlock(&malloc_2d->profile_lock);
+    if(profile.type_id == 0UL) {
+      continue;
+    }
+    char type[256], next[256];
+    malloc_2d_profile_format_id(type, sizeof(type), profile.type_id);
+    malloc_2d_profile_format_id(next, sizeof(next), profile.next_type_id);
+    len = snprintf(line, sizeof(line), "%s %lu %lu %lu %lu %lu %s %ld", type, profile.alloc_count, 
+      profile.free_count, profile.max_live_count, profile.size_sum, profile.live_ns, next, profile.next_votes);
+    for(int j = 0;j < MALLOC_2D_PROFILE_SIZE_BUCKETS;j++) {
+      len += snprintf(line + len, sizeof(line) - (size_t)len, " %lu", profile.size_hist[j]);
+    }
+    line[len++] = '\n';
+    if(write(fd, line, (size_t)len) != len) {
+      ret = -1;
+    } else {
+      ret++;
+    }
+  }
+  close(fd);
+  return ret;
+}
+
+#endif
+
+//
+//* malloc_2d_type_map_t
+//
+
+inline static const char *malloc_2d_type_map_skip_space(const char *p) {
+  while(*p == ' ' || *p == '\t' || *p == '\r') {
+    p++;
+  }
+  return p;
+}
+
+// Parses a type ID written as in a profile. Returns 0 if its module is not loaded
+static uint64_t malloc_2d_type_map_parse_id(const char *p, const char **end) {
+  const char *q = p;
+  while(*q != '\0' && *q != '\n' && *q != ' ' && *q != '\t' && *q != '+') {
+    q++;
+  }
+  if(*q != '+') {
+    return strtoull(p, (char **)end, 0);
+  }
+  uint64_t offset = strtoull(q + 1, (char **)end, 0);
+  malloc_2d_module_query_t query = {0UL, p, (int)(q - p), NULL, 0UL};
+  if(dl_iterate_phdr(malloc_2d_module_find_name, &query) == 0) {
+    return 0UL;
+  }
+  return query.base + offset;
+}
+
+int malloc_2d_type_map_load(const char *path) {
+  if(malloc_2d->type_map != NULL) {
+    return -1;
+  }
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return -1;
+  }
+  off_t size = lseek(fd, 0, SEEK_END);
+  if(size < 0 || lseek(fd, 0, SEEK_SET) != 0) {
+    close(fd);
+    return -1;
+  }
+  // The text is read into pages from the OS rather than allocated, and is NUL-terminated
+  int text_page_count = (int)((uint64_t)size / MALLOC_2D_PAGE_SIZE + 1);
+  char *text = (char *)malloc_2d_alloc_os_page_unaligned(text_page_count);
+  off_t offset = 0;
+  while(offset < size) {
+    ssize_t ret = read(fd, text + offset, (size_t)(size - offset));
+    if(ret <= 0) {
+      break;
+    }
+    offset += ret;
+  }
+  close(fd);
+  int line_count = 1;
+  for(off_t i = 0;i < offset;i++) {
+    line_count += (text[i] == '\n');
+  }
+  int capacity = 16;
+  while(capacity < line_count * 2) {
+    capacity *= 2;
+  }
+  malloc_2d_type_map_entry_t *map = (malloc_2d_type_map_entry_t *)malloc_2d_alloc_os_page_unaligned(
+    (int)((sizeof(malloc_2d_type_map_entry_t) * capacity + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE));
+  int count = 0;
+  for(const char *p = text;*p != '\0';) {
+    p = malloc_2d_type_map_skip_space(p);
+    if(*p != '#' && *p != '\n' && *p != '\0') {
+      int is_default = (*p == '*');
+      const char *q = p + 1;
+      uint64_t type_id = is_default ? 0UL : malloc_2d_type_map_parse_id(p, &q);
+      q = malloc_2d_type_map_skip_space(q);
+      uint64_t group = strtoull(q, (char **)&q, 0);
+      uint64_t group_id = (group == 0UL) ? 0UL : MALLOC_2D_TYPE_GROUP_BASE + group;
+      q = malloc_2d_type_map_skip_space(q);
+      uint64_t max_size = (*q >= '0' && *q <= '9') ? strtoull(q, (char **)&q, 0) : ~0UL;
+      if(is_default) {
+        malloc_2d->type_map_has_default = 1;
+        malloc_2d->type_map_default = group_id;
+      } else if(type_id != 0UL) {
+        uint64_t index = (type_id * 0x9e3779b97f4a7c15UL >> 32) & (uint64_t)(capacity - 1);
+        while(map[index].type_id != 0UL && map[index].type_id != type_id) {
+          index = (index + 1) & (uint64_t)(capacity - 1);
+        }
+        malloc_2d_type_map_entry_t *entry = &map[index];
+        if(entry->type_id == 0UL) {
+          entry->type_id = type_id;
+          count++;
+        }
+        if(entry->split_count < MALLOC_2D_TYPE_MAP_SPLIT_MAX) {
+          entry->max_size[entry->split_count] = max_size;
+          entry->group_id[entry->split_count] = group_id;
+          entry->split_count++;
+        }
+      }
+      p = q;
+    }
+    while(*p != '\0' && *p != '\n') {
+      p++;
+    }
+    if(*p == '\n') {
+      p++;
+    }
+  }
+  malloc_2d_free_os_page(text, text_page_count);
+  malloc_2d->type_map_capacity = capacity;
+  malloc_2d->type_map_count = count;
+  __atomic_store_n(&malloc_2d->type_map, map, __ATOMIC_RELEASE);
+  return count;
+}
+
+uint64_t malloc_2d_type_map_get(uint64_t type_id, uint64_t sz) {
+  malloc_2d_type_map_entry_t *map = __atomic_load_n(&malloc_2d->type_map, __ATOMIC_ACQUIRE);
+  if(map == NULL) {
+    return type_id;
+  }
+  uint64_t mask = (uint64_t)(malloc_2d->type_map_capacity - 1);
+  uint64_t index = (type_id * 0x9e3779b97f4a7c15UL >> 32) & mask;
+  while(map[index].type_id != type_id) {
+    if(map[index].type_id == 0UL) {
+      return malloc_2d->type_map_has_default ? malloc_2d->type_map_default : type_id;
+    }
+    index = (index + 1) & mask;
+  }
+  for(int i = 0;i < map[index].split_count;i++) {
+    if(sz <= map[index].max_size[i]) {
+      return map[index].group_id[i];
+    }
+  }
+  return type_id;
+}
+
+//
+//* malloc_2d_varlen_index_t
+//
+
+void malloc_2d_varlen_index_init(malloc_2d_varlen_index_t *index) {
+  memset(index, 0x00, sizeof(malloc_2d_varlen_index_t));
+  return;
+}
+
+// Returns the first level in fl and the second level in sl of the given block size
+inline static void malloc_2d_varlen_index_map(int size, int *fl, int *sl) {
+  int log2 = 31 - __builtin_clz((uint32_t)size);
+  *fl = log2 - MALLOC_2D_VARLEN_FL_SHIFT;
+  *sl = (size >> (log2 - MALLOC_2D_VARLEN_SL_LOG2)) & (MALLOC_2D_VARLEN_SL_COUNT - 1);
+  assert(*fl >= 0 && *fl < MALLOC_2D_VARLEN_FL_COUNT);
+  return;
+}
+
+void malloc_2d_varlen_index_insert(malloc_2d_varlen_index_t *index, malloc_2d_arena_varlen_header_t *header) {
+  int fl, sl;
+  malloc_2d_varlen_index_map(header->size, &fl, &sl);
+  header->prev_free = NULL;
+  header->next_free = index->lists[fl][sl];
+  if(header->next_free != NULL) {
+    header->next_free->prev_free = header;
+  }
+  index->lists[fl][sl] = header;
+  index->fl_bitmap |= (1U << fl);
+  index->sl_bitmap[fl] |= (1U << sl);
+  return;
+}
+
+void malloc_2d_varlen_index_remove(malloc_2d_varlen_index_t *index, malloc_2d_arena_varlen_header_t *header) {
+  int fl, sl;
+  malloc_2d_varlen_index_map(header->size, &fl, &sl);
+  if(header->next_free != NULL) {
+    header->next_free->prev_free = header->prev_free;
+  }
+  if(header->prev_free != NULL) {
+    header->prev_free->next_free = header->next_free;
+  } else {
+    index->lists[fl][sl] = header->next_free;
+    if(header->next_free == NULL) {
+      index->sl_bitmap[fl] &= ~(1U << sl);
+      if(index->sl_bitmap[fl] == 0) {
+        index->fl_bitmap &= ~(1U << fl);
+      }
+    }
+  }
+  return;
+}
+
+// The size is rounded up to the next list boundary, such that any block of the list found is large 
+// enough. If no such list is non-empty (or the rounded size exceeds the index), the first block of 
+// the size's own list is checked
+malloc_2d_arena_varlen_header_t *malloc_2d_varlen_index_find(malloc_2d_varlen_index_t *index, int size) {
+  int fl, sl;
+  int log2 = 31 - __builtin_clz((uint32_t)size);
+  int rounded_size = size + (1 << (log2 - MALLOC_2D_VARLEN_SL_LOG2)) - 1;
+  if(rounded_size < (1 << (MALLOC_2D_VARLEN_FL_SHIFT + MALLOC_2D_VARLEN_FL_COUNT))) {
+    malloc_2d_varlen_index_map(rounded_size, &fl, &sl);
+    uint32_t sl_map = index->sl_bitmap[fl] & (~0U << sl);
+    if(sl_map == 0) {
+      uint32_t fl_map = index->fl_bitmap & (~0U << (fl + 1));
+      if(fl_map != 0) {
+        fl = __builtin_ctz(fl_map);
+        sl_map = index->sl_bitmap[fl];
+      }
+    }
+    if(sl_map != 0) {
+      return index->lists[fl][__builtin_ctz(sl_map)];
+    }
+  }
+  malloc_2d_varlen_index_map(size, &fl, &sl);
+  malloc_2d_arena_varlen_header_t *header = index->lists[fl][sl];
+  if(header != NULL && header->size >= size) {
+    return header;
+  }
+  return NULL;
+}
+
 //
 //* malloc_2d_arena_t
 //
 
+// Small objects use a single chunk. For medium objects, the chunk count that wastes the smallest 
+// fraction of the arena is chosen
+int malloc_2d_arena_obj_get_chunk_count(int obj_size) {
+  int best_count = 1;
+  uint64_t offset = (uint64_t)malloc_2d_arena_obj_get_offset(obj_size);
+  uint64_t best_waste = (MALLOC_2D_SLAB_CHUNK_SIZE - offset) % obj_size + offset;
+  for(int count = 2;obj_size > MALLOC_2D_OBJ_MAX_SIZE && count <= MALLOC_2D_MEDIUM_ARENA_MAX_CHUNK;count++) {
+    uint64_t waste = (count * MALLOC_2D_SLAB_CHUNK_SIZE - offset) % obj_size + offset;
+    if(waste * best_count < best_waste * count) {
+      best_count = count;
+      best_waste = waste;
+    }
+  }
+  return best_count;
+}
+
 // If obj_size is -1, then we initialize a varlen arena. Otherwise, we initialize object arena.
 malloc_2d_arena_t *malloc_2d_arena_obj_init(int obj_size) {
-  assert(obj_size <= MALLOC_2D_OBJ_MAX_SIZE);
-  void *actual_base;
-  malloc_2d_arena_t *arena = (malloc_2d_arena_t *)malloc_2d_alloc_os_page(MALLOC_2D_ARENA_SIZE, &actual_base);
+  assert(obj_size <= MALLOC_2D_MEDIUM_MAX_SIZE);
+  int is_zero;
+  int chunk_count = malloc_2d_arena_obj_get_chunk_count(obj_size);
+  void *base = malloc_2d_slab_alloc(chunk_count, &is_zero);
+  malloc_2d_arena_t *arena = malloc_2d_slab_get_arena(base);
+  malloc_2d_page_map_set(base, chunk_count * MALLOC_2D_ARENA_SIZE, arena);
   arena->sc = NULL;
   arena->next = arena->prev = NULL;
-  arena->base = actual_base;
+  arena->base = base;
+  arena->flags = is_zero ? MALLOC_2D_ARENA_FLAGS_ZERO : 0;
   arena->free_count = arena->max_count = \
-    (((MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE) - sizeof(malloc_2d_arena_t)) / obj_size);
-  arena->free_list = (uint8_t *)arena + sizeof(malloc_2d_arena_t);
-  uint8_t *p = (uint8_t *)arena->free_list;
-  for(int i = 0;i < arena->max_count;i++) {
-    uint8_t *q = p + obj_size;
-    *((void **)p) = (void *)q;
-    p = q;
+    (int)((chunk_count * MALLOC_2D_SLAB_CHUNK_SIZE - malloc_2d_arena_obj_get_offset(obj_size)) / obj_size);
+#ifdef MALLOC_2D_THREAD_SAFE
+  arena->remote_free_list = NULL;
+  arena->remote_next = NULL;
+#endif
+  arena->obj_size = obj_size;
+  arena->free_list = NULL;
+  arena->bump = (uint8_t *)arena->base + malloc_2d_arena_obj_get_offset(obj_size);
+#ifdef MALLOC_2D_ARENA_BITMAP
+  arena->obj_offset = malloc_2d_arena_obj_get_offset(obj_size);
+  arena->obj_recip = (uint32_t)(((1UL << 32) + obj_size - 1) / obj_size);
+  if(is_zero == 0) {
+    memset(malloc_2d_arena_obj_get_bitmap(arena), 0x00, sizeof(uint64_t) * malloc_2d_arena_obj_get_bitmap_size(obj_size));
+  }
+#endif
+#ifdef MALLOC_2D_ARENA_BITMAP_ALLOC
+  // Slots past the end of the arena are marked as used, such that the search never returns them
+  arena->bitmap_hint = 0;
+  if((arena->max_count & 63) != 0) {
+    malloc_2d_arena_obj_get_bitmap(arena)[arena->max_count >> 6] |= ~((1UL << (arena->max_count & 63)) - 1);
   }
-  // Last object points to nothing
-  *((void **)(p - obj_size)) = NULL;
+#endif
   // SEE THIS:
   // Notify the OS of the step size (for Multi-Block Compression)
   //   1. If the object is <= 64 bytes, then the step size is zero
@@ -58,30 +943,34 @@ malloc_2d_arena_t *malloc_2d_arena_obj_init(int obj_size) {
   //      This mechanism works for non-full-cache-block objects.
   // Commented out for submitting to HPCA committee (it only works with the simulator)
   //zsim_magic_ops_notify_step_size((obj_size + 63) / 64);
-  malloc_2d->stat->arena_init_count++;
+  malloc_2d_stat_inc(&malloc_2d->stat->arena_init_count, 1UL);
   malloc_2d_arena_set_obj(arena);
   return arena;
 }
 
-// Allocate a varlen arena
-malloc_2d_arena_t *malloc_2d_arena_varlen_init() {
-  void *actual_base;
-  malloc_2d_arena_t *arena = (malloc_2d_arena_t *)malloc_2d_alloc_os_page(MALLOC_2D_ARENA_SIZE, &actual_base);
+// Allocate a varlen arena. Free blocks are linked in the index of the sc rather than in the arena, 
+// so arena->free_list is not used
+malloc_2d_arena_t *malloc_2d_arena_varlen_init(malloc_2d_varlen_index_t *index) {
+  int is_zero;
+  void *base = malloc_2d_slab_alloc(1, &is_zero);
+  malloc_2d_arena_t *arena = malloc_2d_slab_get_arena(base);
+  malloc_2d_page_map_set(base, MALLOC_2D_ARENA_SIZE, arena);
   arena->sc = NULL;
   arena->next = arena->prev = NULL;
-  arena->base = actual_base;
+  arena->base = base;
+  arena->flags = 0;
   arena->free_size = arena->max_size = MALLOC_2D_VARLEN_MAX_SIZE;
-  arena->free_list = MALLOC_2D_PTR_ADD(arena, sizeof(malloc_2d_arena_t));
-  malloc_2d_arena_varlen_header_t *header = (malloc_2d_arena_varlen_header_t *)arena->free_list;
+  arena->free_list = NULL;
+  malloc_2d_arena_varlen_header_t *header = malloc_2d_arena_varlen_get_first(arena);
   header->prev_size = 0;
   header->size = arena->free_size;
-  header->next_free = header->prev_free = NULL;
-  malloc_2d->stat->arena_init_count++;
+  malloc_2d_varlen_index_insert(index, header);
+  malloc_2d_stat_inc(&malloc_2d->stat->arena_init_count, 1UL);
   malloc_2d_arena_set_varlen(arena);
   return arena;
 }
 
-// Obj and varlen arena share the same free routine
+// Obj and varlen arena share the same free routine. Pages are unmapped before they can be reused
 void malloc_2d_arena_free(malloc_2d_arena_t *arena) {
   //if(arena->free_count != arena->max_count) {
   //  printf("[malloc_2d] Freeing a non-empty arena (max %d free %d addr 0x%lX base 0x%lX)\n",
@@ -89,67 +978,148 @@ void malloc_2d_arena_free(malloc_2d_arena_t *arena) {
   //}
   int type = malloc_2d_arena_get_type(arena);
   switch(type) {
-    case MALLOC_2D_ARENA_FLAGS_OBJ:
+    case MALLOC_2D_ARENA_FLAGS_OBJ: {
+      int chunk_count = malloc_2d_arena_obj_get_chunk_count(arena->obj_size);
+      malloc_2d_page_map_set(arena->base, chunk_count * MALLOC_2D_ARENA_SIZE, NULL);
+      malloc_2d_slab_free(arena->base, chunk_count);
+    } break;
     case MALLOC_2D_ARENA_FLAGS_VARLEN: {
-      malloc_2d_free_os_page(arena->base, MALLOC_2D_ARENA_SIZE);
+      malloc_2d_page_map_set(arena->base, MALLOC_2D_ARENA_SIZE, NULL);
+      malloc_2d_slab_free(arena->base, 1);
     } break;
     case MALLOC_2D_ARENA_FLAGS_HUGE: {
-      malloc_2d_free_os_page(arena->base, arena->alloc_page_count);
+      malloc_2d_page_map_set(arena->base, 1, NULL);
+      __atomic_fetch_sub(&malloc_2d->huge_count, 1, __ATOMIC_RELAXED);
+      malloc_2d_huge_unmap(arena->base, arena->page_count);
+      malloc_2d_arena_dealloc(arena);
     } break;
     default: {
       error_exit("Unknown arena type: %d\n", type);
     }
   }
-  malloc_2d->stat->arena_free_count++;
+  malloc_2d_stat_inc(&malloc_2d->stat->arena_free_count, 1UL);
   return;
 }
 
-void malloc_2d_arena_varlen_free_list_remove(
-  malloc_2d_arena_t *arena, malloc_2d_arena_varlen_header_t *header) {
-  if(header->next_free != NULL) {
-    header->next_free->prev_free = header->prev_free;
+// All arena lists of the sc are doubly linked by arena->prev and arena->next
+static void malloc_2d_arena_list_remove(malloc_2d_arena_t **list, malloc_2d_arena_t *arena) {
+  if(arena->next != NULL) {
+    arena->next->prev = arena->prev;
   }
-  if(header->prev_free != NULL) {
-    header->prev_free->next_free = header->next_free;
+  if(arena->prev != NULL) {
+    arena->prev->next = arena->next;
   } else {
-    arena->free_list = header->next_free;
+    *list = arena->next;
   }
   return;
 }
 
-void malloc_2d_arena_varlen_free_list_insert_head(
-  malloc_2d_arena_t *arena, malloc_2d_arena_varlen_header_t *header) {
-  header->prev_free = NULL;
-  header->next_free = (malloc_2d_arena_varlen_header_t *)arena->free_list;
-  if(arena->free_list != NULL) {
-    ((malloc_2d_arena_varlen_header_t *)arena->free_list)->prev_free = header;
+static void malloc_2d_arena_list_insert_head(malloc_2d_arena_t **list, malloc_2d_arena_t *arena) {
+  arena->next = *list;
+  arena->prev = NULL;
+  if(*list != NULL) {
+    (*list)->prev = arena;
   }
-  arena->free_list = header;
+  *list = arena;
   return;
 }
 
 // Remove the arena from the free list of its associated SC object
 void malloc_2d_arena_sc_free_list_remove(malloc_2d_arena_t *arena) {
-  if(arena->next != NULL) {
-    arena->next->prev = arena->prev;
+  malloc_2d_arena_list_remove(&arena->sc->free_list, arena);
+  return;
+}
+
+void malloc_2d_arena_sc_free_list_insert_head(malloc_2d_arena_t *arena) {
+  malloc_2d_arena_list_insert_head(&arena->sc->free_list, arena);
+  return;
+}
+
+// Bin of an object arena that is not full, given its number of free objects
+inline static int malloc_2d_arena_obj_get_bin(malloc_2d_arena_t *arena, int free_count) {
+  assert(free_count > 0 && free_count <= arena->max_count);
+  return (arena->max_count - free_count) * MALLOC_2D_SC_BIN_COUNT / arena->max_count;
+}
+
+#ifdef MALLOC_2D_ARENA_BITMAP_ALLOC
+// Returns the first bitmap word from "index" on with a free slot, which must exist. Full words are 
+// skipped four at a time with AVX2 if available
+inline static int malloc_2d_arena_obj_bitmap_find(malloc_2d_arena_t *arena, int index) {
+  uint64_t *bitmap = malloc_2d_arena_obj_get_bitmap(arena);
+#ifdef __AVX2__
+  int word_count = (arena->max_count + 63) / 64;
+  __m256i ones = _mm256_set1_epi64x(-1);
+  while(index + 4 <= word_count && 
+        _mm256_testc_si256(_mm256_loadu_si256((const __m256i *)(bitmap + index)), ones) == 1) {
+    index += 4;
   }
-  if(arena->prev != NULL) {
-    arena->prev->next = arena->next;
-  } else {
-    arena->sc->free_list = arena->next;
+#endif
+  while(bitmap[index] == ~0UL) {
+    index++;
+  }
+  assert(index < (arena->max_count + 63) / 64);
+  return index;
+}
+
+// The lowest free slots are taken, such that live objects stay dense and in allocation order
+static int malloc_2d_arena_obj_bitmap_alloc_batch(malloc_2d_arena_t *arena, void **objs, int count) {
+  uint64_t *bitmap = malloc_2d_arena_obj_get_bitmap(arena);
+  uint8_t *begin = (uint8_t *)arena->base + arena->obj_offset;
+  int index = arena->bitmap_hint;
+  int i = 0;
+  while(i < count) {
+    index = malloc_2d_arena_obj_bitmap_find(arena, index);
+    uint64_t word = bitmap[index];
+    while(word != ~0UL && i < count) {
+      int bit = __builtin_ctzl(~word);
+      word |= 1UL << bit;
+      objs[i++] = begin + (uint64_t)(index * 64 + bit) * arena->obj_size;
+    }
+    bitmap[index] = word;
   }
-  return;
+  arena->bitmap_hint = index;
+  void *end = MALLOC_2D_PTR_ADD(objs[count - 1], arena->obj_size);
+  if((uint64_t)end > (uint64_t)arena->bump) {
+    arena->bump = end;
+  }
+  arena->free_count -= count;
+  return count;
 }
+#endif
 
-void malloc_2d_arena_sc_free_list_insert_head(malloc_2d_arena_t *arena) {
-  malloc_2d_sc_t *sc = arena->sc;
-  arena->next = sc->free_list;
-  arena->prev = NULL;
-  if(sc->free_list != NULL) {
-    sc->free_list->prev = arena;
+// Objects are taken from the free list first, and the rest are carved from the bump pointer in one step
+int malloc_2d_arena_obj_alloc_batch(malloc_2d_arena_t *arena, void **objs, int count) {
+  if(count > arena->free_count) {
+    count = arena->free_count;
   }
-  sc->free_list = arena;
-  return;
+#ifdef MALLOC_2D_ARENA_BITMAP_ALLOC
+  if(count > 0) {
+    malloc_2d_arena_obj_bitmap_alloc_batch(arena, objs, count);
+  }
+#else
+  int i = 0;
+  void *free_list = arena->free_list;
+  while(i < count && free_list != NULL) {
+    objs[i++] = free_list;
+    free_list = *(void **)free_list;
+  }
+  arena->free_list = free_list;
+  void *bump = arena->bump;
+  while(i < count) {
+    objs[i++] = bump;
+    bump = MALLOC_2D_PTR_ADD(bump, arena->obj_size);
+  }
+  arena->bump = bump;
+  assert((uint64_t)arena->bump <= (uint64_t)arena->base + 
+    malloc_2d_arena_obj_get_chunk_count(arena->obj_size) * MALLOC_2D_SLAB_CHUNK_SIZE);
+  arena->free_count -= count;
+#ifdef MALLOC_2D_ARENA_BITMAP
+  for(i = 0;i < count;i++) {
+    malloc_2d_arena_obj_set_used(arena, objs[i]);
+  }
+#endif
+#endif
+  return count;
 }
 
 // This function returns NULL if the arena is already full
@@ -157,93 +1127,193 @@ void *malloc_2d_arena_obj_alloc(malloc_2d_arena_t *arena) {
   if(malloc_2d_arena_is_full(arena) == 1) {
     return NULL;
   }
-  void *ret = arena->free_list;
-  assert(ret != NULL);
-  arena->free_list = *(void **)ret;
+  void *ret;
+#ifdef MALLOC_2D_ARENA_BITMAP_ALLOC
+  malloc_2d_arena_obj_bitmap_alloc_batch(arena, &ret, 1);
+#else
+  ret = arena->free_list;
+  if(ret != NULL) {
+    arena->free_list = *(void **)ret;
+  } else {
+    ret = arena->bump;
+    arena->bump = MALLOC_2D_PTR_ADD(ret, arena->obj_size);
+    assert((uint64_t)arena->bump <= (uint64_t)arena->base + 
+      malloc_2d_arena_obj_get_chunk_count(arena->obj_size) * MALLOC_2D_SLAB_CHUNK_SIZE);
+  }
   assert(arena->free_count > 0);
   arena->free_count--;
-  assert(arena->free_list != NULL || arena->free_count == 0);
+#ifdef MALLOC_2D_ARENA_BITMAP
+  malloc_2d_arena_obj_set_used(arena, ret);
+#endif
+#endif
   return ret;
 }
 
-// Return NULL if allocation cannot be made from this arena
-void *malloc_2d_arena_varlen_alloc(malloc_2d_arena_t *arena, int size) {
-  // This is the actual size to be allocated
-  int actual_size = ((size + (MALLOC_2D_VARLEN_ALIGNMENT - 1)) & ~(MALLOC_2D_VARLEN_ALIGNMENT - 1)) + \
-          sizeof(malloc_2d_arena_varlen_header_t);
-  // Fast path
-  if(actual_size > arena->free_size) {
-    return NULL;
+void *malloc_2d_arena_varlen_alloc(malloc_2d_varlen_index_t *index, malloc_2d_arena_varlen_header_t *header, 
+                                   int actual_size) {
+  assert(actual_size <= header->size);
+  // Varlen arenas are a single chunk
+  uint64_t round_mask = ~(MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE - 1);
+  malloc_2d_arena_t *arena = malloc_2d_slab_get_arena((void *)((uint64_t)header & round_mask));
+  malloc_2d_varlen_index_remove(index, header);
+  if((header->size - actual_size) > (int)(MALLOC_2D_OBJ_MAX_SIZE + sizeof(malloc_2d_arena_varlen_header_t))) {
+    // Create a new block after the current one
+    malloc_2d_arena_varlen_header_t *new_header = \
+      (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(header, actual_size);
+    new_header->size = header->size - actual_size;
+    new_header->prev_size = actual_size;
+    // Update the status of the next block after the new block
+    malloc_2d_arena_varlen_header_t *next_header = \
+      (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(header, header->size);
+    void *arena_end = malloc_2d_arena_varlen_get_end(arena);
+    if(MALLOC_2D_PTR_IS_GEQ(next_header, arena_end) == 0) {
+      next_header->prev_size = new_header->size;
+    }
+    // Update the size field of the current header
+    header->size = actual_size;
+    malloc_2d_varlen_index_insert(index, new_header);
   }
-  // Traverse free list and find the first that match
-  void *ret = arena->free_list;
-  while(ret != NULL) {
-    malloc_2d_arena_varlen_header_t *header = (malloc_2d_arena_varlen_header_t *)ret;
-    if(actual_size <= header->size) {
-      if((header->size - actual_size) > (int)(MALLOC_2D_OBJ_MAX_SIZE + sizeof(malloc_2d_arena_varlen_header_t))) {
-        // Create a new block after the current one
-        malloc_2d_arena_varlen_header_t *new_header = \
-          (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(header, actual_size);
-        //new_header->next_free = header->next_free;
-        //new_header->prev_free = header->prev_free;
-        new_header->size = header->size - actual_size;
-        new_header->prev_size = actual_size;
-        // Update the status of the next block after the new block
-        malloc_2d_arena_varlen_header_t *next_header = \
-          (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(ret, header->size);
-        void *arena_end = MALLOC_2D_PTR_ADD(arena, MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE);
-        if(MALLOC_2D_PTR_IS_GEQ(next_header, arena_end) == 0) {
-          next_header->prev_size = new_header->size;
-        }
-        // Update the size field of the current header
-        header->size = actual_size;
-        // Remove header from free list, insert new header into the list
-        malloc_2d_arena_varlen_free_list_remove(arena, header);
-        malloc_2d_arena_varlen_free_list_insert_head(arena, new_header);
-      } else {
-        malloc_2d_arena_varlen_free_list_remove(arena, header);
-      }
-      // Set the current header's status as used
-      malloc_2d_arena_varlen_header_set_used(header);
-      // Use header's actual allocated size
-      arena->free_size -= header->size;
-      // Data region
-      ret = MALLOC_2D_PTR_ADD(ret, sizeof(malloc_2d_arena_varlen_header_t));
-      break;
+  // Set the current header's status as used
+  malloc_2d_arena_varlen_header_set_used(header);
+  // Use header's actual allocated size
+  arena->free_size -= header->size;
+  // Data region
+  return MALLOC_2D_PTR_ADD(header, sizeof(malloc_2d_arena_varlen_header_t));
+}
+
+int malloc_2d_arena_varlen_realloc(malloc_2d_arena_t *arena, void *ptr, size_t sz) {
+  int actual_size = (int)((sz + (MALLOC_2D_VARLEN_ALIGNMENT - 1)) & ~(MALLOC_2D_VARLEN_ALIGNMENT - 1)) + \
+          (int)sizeof(malloc_2d_arena_varlen_header_t);
+  assert(actual_size <= (int)MALLOC_2D_VARLEN_MAX_SIZE);
+  void *arena_end = malloc_2d_arena_varlen_get_end(arena);
+  malloc_2d_varlen_index_t *index = arena->sc->varlen_index;
+  malloc_2d_arena_varlen_header_t *header = \
+    (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_SUB(ptr, sizeof(malloc_2d_arena_varlen_header_t));
+  assert(malloc_2d_arena_varlen_header_is_used(header) == 1);
+  malloc_2d_arena_varlen_header_t *next_header = \
+    (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(header, header->size);
+  int next_is_free = (MALLOC_2D_PTR_IS_GEQ(next_header, arena_end) == 0) && \
+                     (malloc_2d_arena_varlen_header_is_used(next_header) == 0);
+  if(actual_size > header->size) {
+    if(next_is_free == 0 || header->size + next_header->size < actual_size) {
+      return 0;
     }
-    ret = header->next_free;
+    // Take the whole next block; The excess is split off below
+    malloc_2d_varlen_index_remove(index, next_header);
+    arena->free_size -= next_header->size;
+    header->size += next_header->size;
+    next_header = (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(header, header->size);
+    if(MALLOC_2D_PTR_IS_GEQ(next_header, arena_end) == 0) {
+      next_header->prev_size = header->size;
+    }
+    next_is_free = 0;
   }
-  // ret can be NULL or not NULL at this point
-  return ret;
+  int remainder = header->size - actual_size;
+  if(remainder > (int)(MALLOC_2D_OBJ_MAX_SIZE + sizeof(malloc_2d_arena_varlen_header_t))) {
+    malloc_2d_arena_varlen_header_t *new_header = \
+      (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(header, actual_size);
+    new_header->prev_size = actual_size;
+    new_header->size = remainder;
+    arena->free_size += remainder;
+    header->size = actual_size;
+    // The tail is coalesced with the next block if it is free, since free blocks are never adjacent
+    if(next_is_free == 1) {
+      malloc_2d_varlen_index_remove(index, next_header);
+      new_header->size += next_header->size;
+      next_header = (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(next_header, next_header->size);
+    }
+    if(MALLOC_2D_PTR_IS_GEQ(next_header, arena_end) == 0) {
+      next_header->prev_size = new_header->size;
+    }
+    malloc_2d_varlen_index_insert(index, new_header);
+  }
+  return 1;
 }
 
-void malloc_2d_arena_obj_dealloc(malloc_2d_arena_t *arena, void *ptr) {
-  *(void **)ptr = arena->free_list;
-  arena->free_list = ptr;
-  arena->free_count++;
+// Updates arena and sc after "count" objects have been linked into the free list of the arena
+static void malloc_2d_arena_obj_dealloc_update(malloc_2d_arena_t *arena, int count) {
+  arena->free_count += count;
   assert(arena->free_count <= arena->max_count);
   // If this is the first free object in the arena, then insert into the free list of the sc
   // If arena->sc == NULL then it is debug mode and we simply ignore it
-  if(arena->sc != NULL) {
-    assert(arena->sc->count > 0);
-    arena->sc->count--;
-    if(arena->free_count == 1 && arena != arena->sc->curr_arena) {
-      malloc_2d_arena_sc_free_list_insert_head(arena);
-      malloc_2d->stat->arena_full_to_free_count++;
-    } else if(arena->free_count == arena->max_count && arena != arena->sc->curr_arena) {
-      // Only free the arena if it is in the free list
-      malloc_2d_arena_sc_free_list_remove(arena);
+  malloc_2d_sc_t *sc = arena->sc;
+  if(sc != NULL) {
+    assert(sc->count >= count);
+    sc->count -= count;
+    if(arena == sc->curr_arena) {
+      return;
+    }
+    int was_full = (arena->free_count == count);
+    if(was_full == 1) {
+      malloc_2d_arena_list_remove(&sc->full_list, arena);
+    }
+    // Arenas of the meta sc are never returned to the OS, see malloc_2d_sc_ht_t
+    if(arena->free_count == arena->max_count && sc != &malloc_2d->meta_sc) {
+      // Only remove the arena if it is in a bin
+      if(was_full == 0) {
+        malloc_2d_arena_list_remove(&sc->bins[malloc_2d_arena_obj_get_bin(arena, arena->free_count - count)], arena);
+      }
       // Only return it to the OS when sc is not NULL
       malloc_2d_arena_free(arena);
+      malloc_2d_stat_inc(&malloc_2d->stat->arena_drain_count, 1UL);
+      return;
     }
+    int bin = malloc_2d_arena_obj_get_bin(arena, arena->free_count);
+    if(was_full == 1) {
+      malloc_2d_arena_list_insert_head(&sc->bins[bin], arena);
+      malloc_2d_stat_inc(&malloc_2d->stat->arena_full_to_free_count, 1UL);
+    } else {
+      int old_bin = malloc_2d_arena_obj_get_bin(arena, arena->free_count - count);
+      if(bin != old_bin) {
+        malloc_2d_arena_list_remove(&sc->bins[old_bin], arena);
+        malloc_2d_arena_list_insert_head(&sc->bins[bin], arena);
+        malloc_2d_stat_inc(&malloc_2d->stat->arena_bin_move_count, 1UL);
+      }
+    }
+  }
+  return;
+}
+
+void malloc_2d_arena_obj_dealloc(malloc_2d_arena_t *arena, void *ptr) {
+#ifdef MALLOC_2D_ARENA_BITMAP
+  malloc_2d_arena_obj_set_free(arena, ptr);
+#endif
+#ifndef MALLOC_2D_ARENA_BITMAP_ALLOC
+  *(void **)ptr = arena->free_list;
+  arena->free_list = ptr;
+#endif
+  malloc_2d_arena_obj_dealloc_update(arena, 1);
+  return;
+}
+
+#ifdef MALLOC_2D_THREAD_SAFE
+// The objects stay live (i.e., counted in sc->count and not in arena->free_count) until the sc lock 
+// holder reclaims them. This guarantees that neither the arena nor the sc is freed while we are 
+// still pushing. The thread that makes the remote list non-empty also publishes the arena to 
+// sc->remote_arenas, such that every arena is published at most once per reclamation
+void malloc_2d_arena_obj_remote_dealloc(malloc_2d_arena_t *arena, void *head, void *tail) {
+  void *old_head = __atomic_load_n(&arena->remote_free_list, __ATOMIC_RELAXED);
+  do {
+    *(void **)tail = old_head;
+  } while(__atomic_compare_exchange_n(&arena->remote_free_list, &old_head, head, 1, 
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED) == 0);
+  if(old_head == NULL) {
+    malloc_2d_sc_t *sc = arena->sc;
+    malloc_2d_arena_t *old_arena = __atomic_load_n(&sc->remote_arenas, __ATOMIC_RELAXED);
+    do {
+      arena->remote_next = old_arena;
+    } while(__atomic_compare_exchange_n(&sc->remote_arenas, &old_arena, arena, 1, 
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED) == 0);
   }
+  malloc_2d_stat_inc(&malloc_2d->stat->remote_free_count, 1UL);
   return;
 }
+#endif
 
 void malloc_2d_arena_varlen_dealloc(malloc_2d_arena_t *arena, void *ptr) {
-  void *arena_end = MALLOC_2D_PTR_ADD(arena, MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE);
+  void *arena_end = malloc_2d_arena_varlen_get_end(arena);
   // Data region begin
-  void *arena_begin = MALLOC_2D_PTR_ADD(arena, sizeof(malloc_2d_arena_t));
+  void *arena_begin = malloc_2d_arena_varlen_get_first(arena);
   assert(MALLOC_2D_PTR_IS_GEQ(ptr, arena_begin) == 1 && MALLOC_2D_PTR_IS_GEQ(ptr, arena_end) == 0);
   (void)arena_begin;
   malloc_2d_arena_varlen_header_t *header = \
@@ -255,6 +1325,8 @@ void malloc_2d_arena_varlen_dealloc(malloc_2d_arena_t *arena, void *ptr) {
   }
   //fprintf(stderr, "end %p begin %p\n", arena_end, arena_begin);
   //malloc_2d_arena_varlen_print(arena);
+  malloc_2d_sc_t *sc = arena->sc;
+  malloc_2d_varlen_index_t *index = sc->varlen_index;
   // Update arena free size here, because header will potentially change later
   arena->free_size += header->size;
   malloc_2d_arena_varlen_header_t *next_header = \
@@ -265,48 +1337,61 @@ void malloc_2d_arena_varlen_dealloc(malloc_2d_arena_t *arena, void *ptr) {
                      (malloc_2d_arena_varlen_header_is_used(next_header) == 0);
   int prev_is_free = (header->prev_size != 0) && \
                      (malloc_2d_arena_varlen_header_is_used(prev_header) == 0);
+  // Neighbors are removed from the index before their size changes
   if(next_is_free == 1 && prev_is_free == 1) {
-    malloc_2d_arena_varlen_free_list_remove(arena, next_header);
-    malloc_2d_arena_varlen_free_list_remove(arena, prev_header);
+    malloc_2d_varlen_index_remove(index, next_header);
+    malloc_2d_varlen_index_remove(index, prev_header);
     prev_header->size += (header->size + next_header->size);
     next_header = (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(next_header, next_header->size);
     header = prev_header;
   } else if(next_is_free == 1) {
-    malloc_2d_arena_varlen_free_list_remove(arena, next_header);
+    malloc_2d_varlen_index_remove(index, next_header);
     header->size += next_header->size;
     next_header = (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(next_header, next_header->size);
   } else if(prev_is_free == 1) {
-    malloc_2d_arena_varlen_free_list_remove(arena, prev_header);
+    malloc_2d_varlen_index_remove(index, prev_header);
     prev_header->size += header->size;
     header = prev_header;
   }
   //
-  // Invariant: header points to the block just inserted into the free list
+  // Invariant: header points to the merged free block
   // next_header points to the next block of the merged block
   //
-  // Insert the header into the head of the linked list
-  malloc_2d_arena_varlen_free_list_insert_head(arena, header);
   if(MALLOC_2D_PTR_IS_GEQ(next_header, arena_end) == 0) {
     next_header->prev_size = header->size;
   }
-  // Update sc
-  if(arena->sc != NULL) {
-    assert(arena->sc->count > 0);
-    arena->sc->count--;
-    // If the arena is completely free, then deallocate it
-    if(arena->free_size == arena->max_size && arena != arena->sc->curr_arena) {
-      malloc_2d_arena_sc_free_list_remove(arena);
-      malloc_2d_arena_free(arena);
-    }
+  assert(sc->count > 0);
+  sc->count--;
+  // If the arena is completely free, then deallocate it; Its only block is not indexed
+  if(arena->free_size == arena->max_size && arena != sc->curr_arena) {
+    malloc_2d_arena_sc_free_list_remove(arena);
+    malloc_2d_arena_free(arena);
+  } else {
+    malloc_2d_varlen_index_insert(index, header);
   }
   return;
 }
 
 void malloc_2d_arena_dealloc(void *ptr) {
-  // Round down to nearest arena boundary, low bits are zero
-  uint64_t round_mask = ~(MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE - 1);
-  malloc_2d_arena_t *arena = (malloc_2d_arena_t *)((uint64_t)ptr & round_mask);
+  malloc_2d_arena_t *arena = malloc_2d_arena_get(ptr);
+  // The sc cannot be reclaimed while ptr is still live, so it is safe to lock it here
+  malloc_2d_sc_t *sc = arena->sc;
   int type = malloc_2d_arena_get_type(arena);
+  if(sc != NULL) {
+#ifdef MALLOC_2D_THREAD_SAFE
+    // Objects do not wait for the sc lock; They are reclaimed later by the lock holder
+    if(type == MALLOC_2D_ARENA_FLAGS_OBJ) {
+      if(malloc_2d_trylock(&sc->lock) == 0) {
+        malloc_2d_arena_obj_remote_dealloc(arena, ptr, ptr);
+        return;
+      }
+    } else {
+      malloc_2d_lock(&sc->lock);
+    }
+#else
+    malloc_2d_lock(&sc->lock);
+#endif
+  }
   switch(type) {
     case MALLOC_2D_ARENA_FLAGS_OBJ: {
       malloc_2d_arena_obj_dealloc(arena, ptr);
@@ -321,30 +1406,30 @@ void malloc_2d_arena_dealloc(void *ptr) {
       error_exit("Unknown type: %d (0x%X) on arena deallocation\n", type, type);
     } break;
   }
+  if(sc != NULL) {
+    malloc_2d_unlock(&sc->lock);
+  }
   return;
 }
 
 // Initializes an arena for huge memory region
-// For huge memory region, one arena holds an entire object. The arena header should still be 
-// aligned on arena boundaries. The data body starts immediately after the arena header
-malloc_2d_arena_t *malloc_2d_arena_huge_init(size_t sz) {
-  assert(sz > MALLOC_2D_VARLEN_MAX_SIZE);
-  int page_count = (int)((sz + sizeof(malloc_2d_arena_t) + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE);
-  int alloc_page_count = page_count + MALLOC_2D_ARENA_SIZE;
-  void *ret = malloc_2d_alloc_os_page_unaligned(alloc_page_count);
-  void *old_ret = ret;
-  uint64_t mask = ~(MALLOC_2D_ARENA_SIZE * MALLOC_2D_PAGE_SIZE - 1);
-  if(((uint64_t)ret & mask) != (uint64_t)ret) {
-    // Round up to the nearest boundary
-    ret = (void *)(((uint64_t)ret + (MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE - 1)) & mask);
-  } 
-  malloc_2d_arena_t *arena = (malloc_2d_arena_t *)ret;
-  arena->base = old_ret;
+// For huge memory region, one arena holds an entire object, which is page-aligned. The arena header 
+// is allocated from a type-less sc and its first page is mapped to it. Objects of varlen size are 
+// only placed in huge arenas when they must be page-aligned
+malloc_2d_arena_t *malloc_2d_arena_huge_init(size_t sz, uint64_t alignment) {
+  int page_count = (int)((sz + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE);
+  int is_zero;
+  void *ptr = malloc_2d_huge_map(page_count, alignment, &is_zero);
+  malloc_2d_arena_t *arena = (malloc_2d_arena_t *)malloc_2d_sc_no_type_alloc((int)sizeof(malloc_2d_arena_t));
+  arena->base = ptr;
   arena->sc = NULL;
-  arena->alloc_page_count = alloc_page_count;
   arena->page_count = page_count;
+  arena->flags = (is_zero == 1) ? MALLOC_2D_ARENA_FLAGS_ZERO : 0;
   arena->free_list = arena->prev = arena->next = NULL;
   malloc_2d_arena_set_huge(arena);
+  malloc_2d_page_map_set(ptr, 1, arena);
+  __atomic_fetch_add(&malloc_2d->huge_count, 1, __ATOMIC_RELAXED);
+  malloc_2d_stat_inc(&malloc_2d->stat->arena_init_count, 1UL);
   return arena;
 }
 
@@ -360,19 +1445,41 @@ void malloc_2d_arena_huge_dealloc(malloc_2d_arena_t *arena) {
   return;
 }
 
+void *malloc_2d_arena_huge_realloc(malloc_2d_arena_t *arena, size_t sz) {
+  assert(sz > MALLOC_2D_VARLEN_MAX_SIZE - sizeof(malloc_2d_arena_varlen_header_t));
+  int page_count = (int)((sz + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE);
+  if(page_count == arena->page_count) {
+    return arena->base;
+  }
+  // The old address may be mapped by another thread as soon as the mapping moves
+  malloc_2d_page_map_set(arena->base, 1, NULL);
+  void *ptr = mremap(arena->base, MALLOC_2D_PAGE_SIZE * arena->page_count, MALLOC_2D_PAGE_SIZE * page_count, 
+    MREMAP_MAYMOVE);
+  SYSEXPECT(ptr != MAP_FAILED);
+  malloc_2d_page_map_set(ptr, 1, arena);
+  if(page_count > arena->page_count) {
+    malloc_2d_stat_inc(&malloc_2d->stat->mmap_page_count, (uint64_t)(page_count - arena->page_count));
+  } else {
+    malloc_2d_stat_inc(&malloc_2d->stat->munmap_page_count, (uint64_t)(arena->page_count - page_count));
+  }
+  malloc_2d_stat_inc(&malloc_2d->stat->huge_mremap_count, 1UL);
+  arena->base = ptr;
+  arena->page_count = page_count;
+  return ptr;
+}
+
 void malloc_2d_arena_huge_print(malloc_2d_arena_t *arena) {
-  printf("Arena (huge) 0x%lX base 0x%lX pages %d alloc pages %d\n", 
-    (uint64_t)arena, (uint64_t)arena->base, arena->page_count, arena->alloc_page_count);
+  printf("Arena (huge) 0x%lX base 0x%lX pages %d\n", 
+    (uint64_t)arena, (uint64_t)arena->base, arena->page_count);
   return;
 }
 
 uint64_t malloc_2d_arena_get_size(void *ptr) {
-  uint64_t round_mask = ~(MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE - 1);
-  malloc_2d_arena_t *arena = (malloc_2d_arena_t *)((uint64_t)ptr & round_mask);
+  malloc_2d_arena_t *arena = malloc_2d_arena_get(ptr);
   int type = malloc_2d_arena_get_type(arena);
   switch(type) {
     case MALLOC_2D_ARENA_FLAGS_OBJ: {
-      return (arena->sc->sc_index + 1) * 8UL;
+      return (uint64_t)arena->obj_size;
     } break;
     case MALLOC_2D_ARENA_FLAGS_VARLEN: {
       malloc_2d_arena_varlen_header_t *header = \
@@ -380,7 +1487,7 @@ uint64_t malloc_2d_arena_get_size(void *ptr) {
       return (uint64_t)header->size - sizeof(malloc_2d_arena_varlen_header_t);
     } break;
     case MALLOC_2D_ARENA_FLAGS_HUGE: {
-      return (uint64_t)arena->page_count * MALLOC_2D_PAGE_SIZE - sizeof(malloc_2d_arena_t);
+      return (uint64_t)arena->page_count * MALLOC_2D_PAGE_SIZE;
     } break;
     default: { 
       error_exit("Unknown type: %d (0x%X) on arena deallocation\n", type, type);
@@ -389,13 +1496,128 @@ uint64_t malloc_2d_arena_get_size(void *ptr) {
   return 0UL;
 }
 
+// Bits of live slots are set in "bitmap", which covers the arena. Without the maintained bitmap, slots 
+// below the bump pointer are live unless they are on the free list
+static void malloc_2d_arena_obj_get_live_bitmap(malloc_2d_arena_t *arena, uint64_t *bitmap) {
+  int word_count = (arena->max_count + 63) / 64;
+#ifdef MALLOC_2D_ARENA_BITMAP
+  memcpy(bitmap, malloc_2d_arena_obj_get_bitmap(arena), sizeof(uint64_t) * word_count);
+  // Slots past the end may be marked as used
+  if((arena->max_count & 63) != 0) {
+    bitmap[word_count - 1] &= (1UL << (arena->max_count & 63)) - 1;
+  }
+#else
+  void *begin = MALLOC_2D_PTR_ADD(arena->base, malloc_2d_arena_obj_get_offset(arena->obj_size));
+  int carved_count = (int)(((uint64_t)arena->bump - (uint64_t)begin) / arena->obj_size);
+  for(int i = 0;i < word_count;i++) {
+    if(carved_count >= (i + 1) * 64) {
+      bitmap[i] = ~0UL;
+    } else if(carved_count > i * 64) {
+      bitmap[i] = (1UL << (carved_count - i * 64)) - 1;
+    } else {
+      bitmap[i] = 0UL;
+    }
+  }
+  void *free_list = arena->free_list;
+  while(free_list != NULL) {
+    int slot = (int)(((uint64_t)free_list - (uint64_t)begin) / arena->obj_size);
+    bitmap[slot >> 6] &= ~(1UL << (slot & 63));
+    free_list = *(void **)free_list;
+  }
+#endif
+  return;
+}
+
+// Live slots are found with bit scans over the bitmap, skipping four empty words at a time with AVX2 
+// if available. Objects are prefetched MALLOC_2D_FOR_EACH_PREFETCH slots ahead, such that the 
+// misses of the objects visited next overlap with the call
+static uint64_t malloc_2d_arena_obj_for_each(malloc_2d_arena_t *arena, malloc_2d_for_each_func_t func, void *arg) {
+  uint64_t bitmap[MALLOC_2D_ARENA_BITMAP_MAX_SIZE];
+  malloc_2d_arena_obj_get_live_bitmap(arena, bitmap);
+  uint8_t *begin = (uint8_t *)arena->base + malloc_2d_arena_obj_get_offset(arena->obj_size);
+  int word_count = (arena->max_count + 63) / 64;
+  uint64_t count = 0UL;
+  for(int i = 0;i < word_count;i++) {
+#ifdef __AVX2__
+    if((i & 3) == 0 && i + 4 <= word_count) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(bitmap + i));
+      if(_mm256_testz_si256(v, v) == 1) {
+        i += 3;
+        continue;
+      }
+    }
+#endif
+    uint64_t word = bitmap[i];
+    while(word != 0UL) {
+      int slot = i * 64 + __builtin_ctzl(word);
+      word &= word - 1;
+      uint8_t *obj = begin + (uint64_t)slot * arena->obj_size;
+      __builtin_prefetch(obj + MALLOC_2D_FOR_EACH_PREFETCH * arena->obj_size);
+      func(obj, arg);
+      count++;
+    }
+  }
+  return count;
+}
+
+// Used blocks are found by walking the headers, which are in address order
+static uint64_t malloc_2d_arena_varlen_for_each(malloc_2d_arena_t *arena, malloc_2d_for_each_func_t func, void *arg) {
+  malloc_2d_arena_varlen_header_t *header = malloc_2d_arena_varlen_get_first(arena);
+  void *arena_end = malloc_2d_arena_varlen_get_end(arena);
+  uint64_t count = 0UL;
+  while(MALLOC_2D_PTR_IS_GEQ(header, arena_end) == 0 && header->size != 0) {
+    malloc_2d_arena_varlen_header_t *next = \
+      (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(header, header->size);
+    if(malloc_2d_arena_varlen_header_is_used(header) == 1) {
+      func(MALLOC_2D_PTR_ADD(header, sizeof(malloc_2d_arena_varlen_header_t)), arg);
+      count++;
+    }
+    header = next;
+  }
+  return count;
+}
+
+uint64_t malloc_2d_arena_for_each(malloc_2d_arena_t *arena, malloc_2d_for_each_func_t func, void *arg) {
+  int type = malloc_2d_arena_get_type(arena);
+  switch(type) {
+    case MALLOC_2D_ARENA_FLAGS_OBJ: {
+      return malloc_2d_arena_obj_for_each(arena, func, arg);
+    } break;
+    case MALLOC_2D_ARENA_FLAGS_VARLEN: {
+      return malloc_2d_arena_varlen_for_each(arena, func, arg);
+    } break;
+    case MALLOC_2D_ARENA_FLAGS_HUGE: {
+      func(arena->base, arg);
+      return 1UL;
+    } break;
+    default: {
+      error_exit("Unknown type: %d (0x%X) on arena iteration\n", type, type);
+    } break;
+  }
+  return 0UL;
+}
+
 // Check whether a given pointer within the arena is free (i.e., in the free list)
 // Works for both versions of arena
 static int malloc_2d_arena_check_ptr_free(malloc_2d_arena_t *arena, void *ptr) {
-  if((uint64_t)ptr < (uint64_t)arena || 
-     (uint64_t)ptr >= (uint64_t)((uint8_t *)arena + MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE)) {
+  if(malloc_2d_arena_get(ptr) != arena) {
     error_exit("The pointer is not within the given arena\n");
   }
+  // Objects that have not been carved are free
+  if(malloc_2d_arena_get_type(arena) == MALLOC_2D_ARENA_FLAGS_OBJ && 
+     (uint64_t)ptr >= (uint64_t)arena->bump) {
+    return 1;
+  }
+#ifdef MALLOC_2D_ARENA_BITMAP
+  if(malloc_2d_arena_get_type(arena) == MALLOC_2D_ARENA_FLAGS_OBJ) {
+    int slot = malloc_2d_arena_obj_get_slot(arena, ptr);
+    return (malloc_2d_arena_obj_get_bitmap(arena)[slot >> 6] & (1UL << (slot & 63))) == 0;
+  }
+#endif
+  // Free varlen blocks are linked in the index of the sc; ptr must point to a block header
+  if(malloc_2d_arena_get_type(arena) == MALLOC_2D_ARENA_FLAGS_VARLEN) {
+    return malloc_2d_arena_varlen_header_is_used((malloc_2d_arena_varlen_header_t *)ptr) == 0;
+  }
   void *free_list = arena->free_list;
   while(free_list != NULL) {
     if(free_list == ptr) {
@@ -412,26 +1634,28 @@ static int malloc_2d_arena_check_ptr_free(malloc_2d_arena_t *arena, void *ptr) {
 }
 
 static int malloc_2d_arena_get_free_list_count(malloc_2d_arena_t *arena) {
-  void *free_list = arena->free_list;
   int count = 0;
-  while(free_list != NULL) {
-    int type = malloc_2d_arena_get_type(arena);
-    if(type == MALLOC_2D_ARENA_FLAGS_OBJ) {
-      free_list = *(void **)free_list;
-    } else if(type == MALLOC_2D_ARENA_FLAGS_VARLEN) {
-      malloc_2d_arena_varlen_header_t *next_free = ((malloc_2d_arena_varlen_header_t *)free_list)->next_free;
-      malloc_2d_arena_varlen_header_t *prev_free = ((malloc_2d_arena_varlen_header_t *)free_list)->prev_free;
-      if(next_free != NULL && next_free->prev_free != free_list) {
-        printf("WARNING: Inconsistent free list on 0x%lX (curr->next->prev != curr)\n", (uint64_t)free_list);
-      }
-      if(prev_free != NULL && prev_free->next_free != free_list) {
-        printf("WARNING: Inconsistent free list on 0x%lX (curr->prev->next != curr)\n", (uint64_t)free_list);
-      }
-      if(prev_free == NULL && arena->free_list != free_list) {
-        printf("WARNING: Inconsistent free list on 0x%lX (arena->free_list != curr)\n", (uint64_t)free_list);
+  if(malloc_2d_arena_get_type(arena) == MALLOC_2D_ARENA_FLAGS_VARLEN) {
+    // Free blocks are linked in the index of the sc together with blocks of other arenas
+    malloc_2d_arena_varlen_header_t *header = malloc_2d_arena_varlen_get_first(arena);
+    void *arena_end = malloc_2d_arena_varlen_get_end(arena);
+    while(MALLOC_2D_PTR_IS_GEQ(header, arena_end) == 0 && header->size != 0) {
+      if(malloc_2d_arena_varlen_header_is_used(header) == 0) {
+        if(header->next_free != NULL && header->next_free->prev_free != header) {
+          printf("WARNING: Inconsistent free list on 0x%lX (curr->next->prev != curr)\n", (uint64_t)header);
+        }
+        if(header->prev_free != NULL && header->prev_free->next_free != header) {
+          printf("WARNING: Inconsistent free list on 0x%lX (curr->prev->next != curr)\n", (uint64_t)header);
+        }
+        count++;
       }
-      free_list = next_free;
+      header = (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(header, header->size);
     }
+    return count;
+  }
+  void *free_list = arena->free_list;
+  while(free_list != NULL) {
+    free_list = *(void **)free_list;
     count++;
   }
   return count;
@@ -439,12 +1663,12 @@ static int malloc_2d_arena_get_free_list_count(malloc_2d_arena_t *arena) {
 
 // Printing an arena's layout given the obj size
 void malloc_2d_arena_obj_print(malloc_2d_arena_t *arena, int obj_size) {
-  uint8_t *p = (uint8_t *)arena + sizeof(malloc_2d_arena_t);
+  uint8_t *p = (uint8_t *)arena->base + malloc_2d_arena_obj_get_offset(obj_size);
   int free_flag = malloc_2d_arena_check_ptr_free(arena, p);
   int span_index = 0;
-  printf("Arena (obj) 0x%lX base 0x%lX free %d max %d free list count %d\n", 
+  printf("Arena (obj) 0x%lX base 0x%lX free %d max %d free list count %d bump 0x%lX\n", 
     (uint64_t)arena, (uint64_t)arena->base, arena->free_count, arena->max_count, 
-    malloc_2d_arena_get_free_list_count(arena));
+    malloc_2d_arena_get_free_list_count(arena), (uint64_t)arena->bump);
   for(int i = 0;i < arena->max_count;i++) {
     int curr_free = malloc_2d_arena_check_ptr_free(arena, p);
     if(curr_free != free_flag) {
@@ -473,10 +1697,9 @@ void malloc_2d_arena_varlen_print(malloc_2d_arena_t *arena) {
   printf("Arena (varlen) 0x%lX base 0x%lX free list 0x%lX free %d max %d free list count %d\n", 
     (uint64_t)arena, (uint64_t)arena->base, (uint64_t)arena->free_list,
     arena->free_size, arena->max_size, free_count);
-  malloc_2d_arena_varlen_header_t *header = \
-    (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(arena, sizeof(malloc_2d_arena_t));
+  malloc_2d_arena_varlen_header_t *header = malloc_2d_arena_varlen_get_first(arena);
   malloc_2d_arena_varlen_header_t *prev = NULL;
-  void *arena_end = MALLOC_2D_PTR_ADD(arena, MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE);
+  void *arena_end = malloc_2d_arena_varlen_get_end(arena);
   int actual_free_count = 0;
   while(MALLOC_2D_PTR_IS_GEQ(header, arena_end) == 0) {
     printf("  Block 0x%lX data 0x%lX size %d prev size %d next free 0x%lX prev free 0x%lX is free %d\n",
@@ -521,142 +1744,453 @@ void malloc_2d_arena_print(malloc_2d_arena_t *arena, int obj_size) {
 //* malloc_2d_sc_t
 //
 
+// Set a new arena as the current arena of the object sc
+static void malloc_2d_sc_obj_arena_init(malloc_2d_sc_t *sc) {
+  sc->curr_arena = malloc_2d_arena_obj_init(malloc_2d_get_sc_obj_size(sc->sc_index));
+  sc->curr_arena->sc = sc;
+  // Objects of the meta sc must be zero-initialized, since the sc lock is never reset
+  if(sc == &malloc_2d->meta_sc && malloc_2d_arena_is_zero(sc->curr_arena) == 0) {
+    memset(sc->curr_arena->bump, 0x00, 
+      MALLOC_2D_SLAB_CHUNK_SIZE - malloc_2d_arena_obj_get_offset(sc->curr_arena->obj_size));
+  }
+  return;
+}
+
+void *malloc_2d_sc_no_type_alloc(int size) {
+  malloc_2d_sc_t *sc = &malloc_2d->sc_no_type[malloc_2d_get_sc_index((uint64_t)size)];
+  malloc_2d_lock(&sc->lock);
+  void *ret = malloc_2d_sc_obj_alloc(sc);
+  malloc_2d_unlock(&sc->lock);
+  return ret;
+}
+
+// The type-less varlen sc uses the static index. Typed varlen sc allocate theirs from the type-less 
+// object sc, since the index does not fit into the meta sc object
+static malloc_2d_varlen_index_t *malloc_2d_sc_varlen_index_alloc(malloc_2d_sc_t *sc) {
+  if(sc == &malloc_2d->varlen_sc) {
+    return &malloc_2d->varlen_index;
+  }
+  return (malloc_2d_varlen_index_t *)malloc_2d_sc_no_type_alloc((int)sizeof(malloc_2d_varlen_index_t));
+}
+
 // If sc_index == -1, then we initialize a varlen size class object. Otherwise we initialize object size class
 void malloc_2d_sc_init_in_place(malloc_2d_sc_t *sc, uint64_t type_id, int sc_index) {
   assert(sc_index == -1 || sc_index == -2 || (sc_index >= 0 && sc_index < MALLOC_2D_SC_COUNT));
-  memset(sc, 0x00, sizeof(malloc_2d_sc_t));
+  // The lock and the release generation are not reset, see malloc_2d_sc_t
+  memset(sc, 0x00, offsetof(malloc_2d_sc_t, lock));
+  memset(&sc->release_gen + 1, 0x00, sizeof(malloc_2d_sc_t) - offsetof(malloc_2d_sc_t, release_gen) - sizeof(uint64_t));
+#ifdef MALLOC_2D_THREAD_SAFE
+  sc->remote_arenas = NULL;
+#endif
+#ifdef MALLOC_2D_PERCPU
+  sc->percpu_class = -1;
+#endif
   sc->type_id = type_id;
   sc->sc_index = sc_index;
   switch(sc_index) {
     case MALLOC_2D_SC_INDEX_VARLEN: {
-      sc->curr_arena = malloc_2d_arena_varlen_init();
+      sc->varlen_index = malloc_2d_sc_varlen_index_alloc(sc);
+      malloc_2d_varlen_index_init(sc->varlen_index);
+      sc->curr_arena = malloc_2d_arena_varlen_init(sc->varlen_index);
       sc->curr_arena->sc = sc;
     } break;
     case MALLOC_2D_SC_INDEX_HUGE: {
       sc->curr_arena = NULL;
     } break;
     default: {
-      sc->curr_arena = malloc_2d_arena_obj_init((sc_index + 1) * MALLOC_2D_SC_INCREMENT);
+      malloc_2d_sc_obj_arena_init(sc);
+    }
+  }
+  malloc_2d_stat_inc(&malloc_2d->stat->sc_init_count, 1UL);
+  return;
+}
+
+malloc_2d_sc_t *malloc_2d_sc_init(uint64_t type_id, int sc_index) {
+  malloc_2d_lock(&malloc_2d->meta_sc.lock);
+  malloc_2d_sc_t *sc = (malloc_2d_sc_t *)malloc_2d_sc_obj_alloc(&malloc_2d->meta_sc);
+  malloc_2d_unlock(&malloc_2d->meta_sc.lock);
+  SYSEXPECT(sc != NULL);
+  // Memory of a freed sc may be reused, and a stale hash table lookup may be holding its lock
+  malloc_2d_lock(&sc->lock);
+  malloc_2d_sc_init_in_place(sc, type_id, sc_index);
+  return sc;
+}
+
+// Copies the heads of all arena lists of the sc other than the current arena, and returns their number
+static int malloc_2d_sc_get_arena_lists(malloc_2d_sc_t *sc, malloc_2d_arena_t **lists) {
+  lists[0] = sc->free_list;
+  lists[1] = sc->full_list;
+  for(int i = 0;i < MALLOC_2D_SC_BIN_COUNT;i++) {
+    lists[2 + i] = sc->bins[i];
+  }
+  return 2 + MALLOC_2D_SC_BIN_COUNT;
+}
+
+// Free all arenas of the sc, including those still holding live objects
+static void malloc_2d_sc_free_arenas(malloc_2d_sc_t *sc) {
+  malloc_2d_arena_t *lists[2 + MALLOC_2D_SC_BIN_COUNT];
+  int list_count = malloc_2d_sc_get_arena_lists(sc, lists);
+  for(int i = 0;i < list_count;i++) {
+    malloc_2d_arena_t *arena = lists[i];
+    while(arena != NULL) {
+      malloc_2d_arena_t *next = arena->next;
+      malloc_2d_arena_free(arena);
+      arena = next;
+    }
+  }
+  if(sc->curr_arena != NULL) {
+    malloc_2d_arena_free(sc->curr_arena);
+  }
+  sc->free_list = sc->full_list = sc->curr_arena = NULL;
+  memset(sc->bins, 0x00, sizeof(sc->bins));
+  return;
+}
+
+void malloc_2d_sc_free_in_place(malloc_2d_sc_t *sc) {
+  malloc_2d_sc_free_arenas(sc);
+  if(sc->sc_index == MALLOC_2D_SC_INDEX_VARLEN && sc->varlen_index != &malloc_2d->varlen_index) {
+    malloc_2d_arena_dealloc(sc->varlen_index);
+  }
+  malloc_2d_stat_inc(&malloc_2d->stat->sc_free_count, 1UL);
+  return;
+}
+
+void malloc_2d_sc_free(malloc_2d_sc_t *sc) {
+  malloc_2d_sc_free_in_place(sc);
+  malloc_2d_sc_dealloc(sc);
+  return;
+}
+
+uint64_t malloc_2d_sc_for_each(malloc_2d_sc_t *sc, malloc_2d_for_each_func_t func, void *arg) {
+#ifdef MALLOC_2D_THREAD_SAFE
+  malloc_2d_tcache_return(sc);
+#endif
+#ifdef MALLOC_2D_PERCPU
+  if(sc->percpu_class >= 0) {
+    for(int i = 0;i < MALLOC_2D_PERCPU_MAX_CPU;i++) {
+      malloc_2d_percpu_stack_t *stack = &malloc_2d->percpu[i].stacks[sc->percpu_class];
+      if(stack->count != 0) {
+        malloc_2d_sc_obj_dealloc_batch(sc, stack->objs, (int)stack->count);
+        stack->count = 0;
+      }
+    }
+  }
+#endif
+#ifdef MALLOC_2D_THREAD_SAFE
+  if(sc->remote_arenas != NULL) {
+    malloc_2d_sc_obj_reclaim_remote(sc);
+  }
+#endif
+  malloc_2d_arena_t *lists[2 + MALLOC_2D_SC_BIN_COUNT];
+  int list_count = malloc_2d_sc_get_arena_lists(sc, lists);
+  int arena_count = (sc->curr_arena != NULL) ? 1 : 0;
+  for(int i = 0;i < list_count;i++) {
+    for(malloc_2d_arena_t *arena = lists[i];arena != NULL;arena = arena->next) {
+      arena_count++;
+    }
+  }
+  malloc_2d_arena_t *stack_arenas[MALLOC_2D_FOR_EACH_STACK_COUNT];
+  malloc_2d_arena_t **arenas = stack_arenas;
+  int page_count = 0;
+  if(arena_count > MALLOC_2D_FOR_EACH_STACK_COUNT) {
+    page_count = (int)((sizeof(malloc_2d_arena_t *) * arena_count + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE);
+    arenas = (malloc_2d_arena_t **)malloc_2d_alloc_os_page_unaligned(page_count);
+  }
+  int index = 0;
+  if(sc->curr_arena != NULL) {
+    arenas[index++] = sc->curr_arena;
+  }
+  for(int i = 0;i < list_count;i++) {
+    for(malloc_2d_arena_t *arena = lists[i];arena != NULL;arena = arena->next) {
+      arenas[index++] = arena;
+    }
+  }
+  // Huge objects are not in their arena headers
+  std::sort(arenas, arenas + arena_count, [](malloc_2d_arena_t *a, malloc_2d_arena_t *b) {
+    return (uint64_t)a->base < (uint64_t)b->base;
+  });
+  uint64_t count = 0UL;
+  for(int i = 0;i < arena_count;i++) {
+    if(i + 1 < arena_count) {
+      __builtin_prefetch(arenas[i + 1]);
+    }
+    count += malloc_2d_arena_for_each(arenas[i], func, arg);
+  }
+  if(page_count != 0) {
+    malloc_2d_free_os_page(arenas, page_count);
+  }
+  return count;
+}
+
+// Arenas are freed as a whole rather than object by object, and the sc is left as if it had just 
+// been initialized. It stays in the hash table, and is reclaimed later if it remains idle
+int malloc_2d_sc_release(malloc_2d_sc_t *sc) {
+#ifdef MALLOC_2D_THREAD_SAFE
+  // Objects on remote free lists are counted as live until they are reclaimed
+  if(sc->remote_arenas != NULL) {
+    malloc_2d_sc_obj_reclaim_remote(sc);
+  }
+#endif
+  int count = sc->count;
+  __atomic_store_n(&sc->release_gen, sc->release_gen + 1, __ATOMIC_RELAXED);
+#ifdef MALLOC_2D_THREAD_SAFE
+  // Thread caches check their sc once the global generation has changed
+  __atomic_store_n(&malloc_2d->release_gen, malloc_2d->release_gen + 1, __ATOMIC_RELEASE);
+#endif
+#ifdef MALLOC_2D_PERCPU
+  // Objects of a promoted sc may be cached on any CPU, and are not live. The stacks are emptied 
+  // with plain stores, which is only safe since no other thread pushes or pops them meanwhile
+  if(sc->percpu_class >= 0) {
+    for(int i = 0;i < MALLOC_2D_PERCPU_MAX_CPU;i++) {
+      malloc_2d_percpu_stack_t *stack = &malloc_2d->percpu[i].stacks[sc->percpu_class];
+      if(stack->count != 0) {
+        count -= (int)stack->count;
+        stack->count = 0;
+      }
+    }
+  }
+#endif
+  malloc_2d_sc_free_arenas(sc);
+  switch(sc->sc_index) {
+    case MALLOC_2D_SC_INDEX_VARLEN: {
+      malloc_2d_varlen_index_init(sc->varlen_index);
+      sc->curr_arena = malloc_2d_arena_varlen_init(sc->varlen_index);
       sc->curr_arena->sc = sc;
+    } break;
+    case MALLOC_2D_SC_INDEX_HUGE: {
+    } break;
+    default: {
+      malloc_2d_sc_obj_arena_init(sc);
+    }
+  }
+  sc->count = 0;
+  malloc_2d_stat_inc(&malloc_2d->stat->sc_release_count, 1UL);
+  malloc_2d_stat_inc(&malloc_2d->stat->sc_release_obj_count, (uint64_t)count);
+  return count;
+}
+
+// Make sure that the current arena has a free object; Allocate new arena if the current one is full
+static void malloc_2d_sc_obj_refill_curr(malloc_2d_sc_t *sc) {
+#ifdef MALLOC_2D_THREAD_SAFE
+  // Remote frees are only reclaimed when the local free lists run dry
+  if(malloc_2d_arena_is_full(sc->curr_arena) == 1 && 
+     __atomic_load_n(&sc->remote_arenas, __ATOMIC_RELAXED) != NULL) {
+    malloc_2d_sc_obj_reclaim_remote(sc);
+  }
+#endif
+  if(malloc_2d_arena_is_full(sc->curr_arena) == 1) {
+    // Full arenas are only linked such that they can be found when the sc is released
+    malloc_2d_arena_list_insert_head(&sc->full_list, sc->curr_arena);
+    // The fullest arena is used first, such that nearly empty ones can drain and be freed
+    int bin = MALLOC_2D_SC_BIN_COUNT - 1;
+    while(bin >= 0 && sc->bins[bin] == NULL) {
+      bin--;
+    }
+    if(bin < 0) {
+      malloc_2d_sc_obj_arena_init(sc);
+    } else {
+      sc->curr_arena = sc->bins[bin];
+      malloc_2d_arena_list_remove(&sc->bins[bin], sc->curr_arena);
+      sc->curr_arena->next = sc->curr_arena->prev = NULL;
+      malloc_2d_stat_inc(&malloc_2d->stat->arena_free_to_curr_count, 1UL);
     }
+    malloc_2d_stat_inc(&malloc_2d->stat->arena_curr_to_full_count, 1UL);
+  }
+  return;
+}
+
+// Allocate an object from the size class
+void *malloc_2d_sc_obj_alloc(malloc_2d_sc_t *sc) {
+  malloc_2d_sc_obj_refill_curr(sc);
+  sc->count++;
+  sc->idle_time = 0;
+  void *ret = malloc_2d_arena_obj_alloc(sc->curr_arena);
+  assert(ret != NULL);
+  return ret;
+}
+
+// Objects at or after the bump pointer have never been allocated
+void *malloc_2d_sc_obj_alloc_zero(malloc_2d_sc_t *sc, int *is_zero) {
+  malloc_2d_sc_obj_refill_curr(sc);
+  void *bump = sc->curr_arena->bump;
+  sc->count++;
+  sc->idle_time = 0;
+  void *ret = malloc_2d_arena_obj_alloc(sc->curr_arena);
+  assert(ret != NULL);
+  *is_zero = ((uint64_t)ret >= (uint64_t)bump && malloc_2d_arena_is_zero(sc->curr_arena) == 1);
+  return ret;
+}
+
+// Thread caches and per-CPU stacks pop from the end, so batches are pushed in reverse, such that 
+// objects carved in address order are also handed out in address order
+inline static void malloc_2d_sc_obj_reverse(void **objs, int count) {
+  for(int i = 0;i < count / 2;i++) {
+    void *obj = objs[i];
+    objs[i] = objs[count - 1 - i];
+    objs[count - 1 - i] = obj;
   }
-  malloc_2d->stat->sc_init_count++;
   return;
 }
 
-malloc_2d_sc_t *malloc_2d_sc_init(uint64_t type_id, int sc_index) {
-  malloc_2d_sc_t *sc = (malloc_2d_sc_t *)malloc_2d_sc_obj_alloc(&malloc_2d->meta_sc);
-  SYSEXPECT(sc != NULL);
-  malloc_2d_sc_init_in_place(sc, type_id, sc_index);
-  return sc;
+// Each arena is drained at once before moving on to the next one
+void malloc_2d_sc_obj_alloc_batch(malloc_2d_sc_t *sc, void **objs, int count) {
+  int i = 0;
+  while(i < count) {
+    malloc_2d_sc_obj_refill_curr(sc);
+    i += malloc_2d_arena_obj_alloc_batch(sc->curr_arena, objs + i, count - i);
+  }
+  sc->count += count;
+  sc->idle_time = 0;
+  return;
 }
 
-void malloc_2d_sc_free_in_place(malloc_2d_sc_t *sc) {
-  malloc_2d_arena_t *arena = sc->free_list;
-  while(arena != NULL) {
-    malloc_2d_arena_t *next = arena->next;
-    malloc_2d_arena_free(arena);
-    arena = next;
-  }
-  if(sc->curr_arena != NULL) {
-    malloc_2d_arena_free(sc->curr_arena);
+// All objects must belong to the given sc. Runs of objects from the same arena are linked together 
+// and spliced into the free list of the arena, such that the arena is updated once per run
+void malloc_2d_sc_obj_dealloc_batch(malloc_2d_sc_t *sc, void **objs, int count) {
+  int begin = 0;
+  while(begin < count) {
+    malloc_2d_arena_t *arena = malloc_2d_arena_get(objs[begin]);
+    assert(arena->sc == sc);
+    int end = begin + 1;
+    while(end < count && malloc_2d_arena_get(objs[end]) == arena) {
+#ifndef MALLOC_2D_ARENA_BITMAP_ALLOC
+      *(void **)objs[end - 1] = objs[end];
+#endif
+      end++;
+    }
+#ifdef MALLOC_2D_ARENA_BITMAP
+    for(int i = begin;i < end;i++) {
+      malloc_2d_arena_obj_set_free(arena, objs[i]);
+    }
+#endif
+#ifndef MALLOC_2D_ARENA_BITMAP_ALLOC
+    *(void **)objs[end - 1] = arena->free_list;
+    arena->free_list = objs[begin];
+#endif
+    malloc_2d_arena_obj_dealloc_update(arena, end - begin);
+    begin = end;
   }
-  malloc_2d->stat->sc_free_count++;
+  (void)sc;
   return;
 }
 
-void malloc_2d_sc_free(malloc_2d_sc_t *sc) {
-  malloc_2d_sc_free_in_place(sc);
-  malloc_2d_sc_dealloc(sc);
+#ifdef MALLOC_2D_THREAD_SAFE
+void malloc_2d_sc_obj_reclaim_remote(malloc_2d_sc_t *sc) {
+  malloc_2d_arena_t *arena = __atomic_exchange_n(&sc->remote_arenas, NULL, __ATOMIC_ACQUIRE);
+  while(arena != NULL) {
+    // Read the next pointer first, since the arena may be published again as soon as its remote 
+    // list is taken. The arena itself cannot be freed before we reclaim its objects
+    malloc_2d_arena_t *next = arena->remote_next;
+    void *head = __atomic_exchange_n(&arena->remote_free_list, NULL, __ATOMIC_ACQUIRE);
+    assert(head != NULL);
+    // Splice the remote list in front of the local free list, or only mark the objects as free in 
+    // the bitmap with bitmap slot allocation
+    void *tail = head;
+    int count = 1;
+#ifdef MALLOC_2D_ARENA_BITMAP
+    malloc_2d_arena_obj_set_free(arena, head);
+#endif
+    while(*(void **)tail != NULL) {
+      tail = *(void **)tail;
+      count++;
+#ifdef MALLOC_2D_ARENA_BITMAP
+      malloc_2d_arena_obj_set_free(arena, tail);
+#endif
+    }
+#ifndef MALLOC_2D_ARENA_BITMAP_ALLOC
+    *(void **)tail = arena->free_list;
+    arena->free_list = head;
+#endif
+    malloc_2d_arena_obj_dealloc_update(arena, count);
+    malloc_2d_stat_inc(&malloc_2d->stat->remote_reclaim_count, 1UL);
+    arena = next;
+  }
   return;
 }
 
-// Allocate an object from the size class; Allocate new arena if the current one is full
-void *malloc_2d_sc_obj_alloc(malloc_2d_sc_t *sc) {
-  if(malloc_2d_arena_is_full(sc->curr_arena) == 1) {
-    if(sc->free_list == NULL) {
-      sc->curr_arena = malloc_2d_arena_obj_init((sc->sc_index + 1) * MALLOC_2D_SC_INCREMENT);
-      sc->curr_arena->sc = sc;
-    } else {
-      sc->curr_arena = sc->free_list;
-      sc->free_list = sc->curr_arena->next;
-      if(sc->curr_arena->next != NULL) {
-        sc->curr_arena->next->prev = NULL;
-      }
-      sc->curr_arena->next = sc->curr_arena->prev = NULL;
-      malloc_2d->stat->arena_free_to_curr_count++;
+// Return objects cached by a thread or CPU to the sc. If the sc lock is contended, objects are 
+// pushed to the remote free lists of their arenas instead, one CAS per run of objects from the 
+// same arena
+void malloc_2d_sc_obj_flush(malloc_2d_sc_t *sc, void **objs, int count) {
+  if(malloc_2d_trylock(&sc->lock) == 1) {
+    malloc_2d_sc_obj_dealloc_batch(sc, objs, count);
+    malloc_2d_unlock(&sc->lock);
+    return;
+  }
+  int begin = 0;
+  while(begin < count) {
+    malloc_2d_arena_t *arena = malloc_2d_arena_get(objs[begin]);
+    int end = begin + 1;
+    while(end < count && malloc_2d_arena_get(objs[end]) == arena) {
+      *(void **)objs[end - 1] = objs[end];
+      end++;
     }
-    malloc_2d->stat->arena_curr_to_full_count++;
+    malloc_2d_arena_obj_remote_dealloc(arena, objs[begin], objs[end - 1]);
+    begin = end;
   }
-  sc->count++;
-  void *ret = malloc_2d_arena_obj_alloc(sc->curr_arena);
-  assert(ret != NULL);
-  return ret;
+  return;
 }
+#endif
 
 // Allocate a varlen block from an sc object
-// The process is as follows:
-//   1. Try curr_arena;
-//   2. If curr_arena does not fulfill the request, then search free_list. We search all free arenas.
-//   3. If the previous search still does not find an allocation, then allocate a new arena, and make it the 
-//      current arena. The existing current arena will be moved to the free list
-// This process is not constant time. In fact, it is linear to the number of varlen blocks.
+// Free blocks of all arenas are found through the index in constant time. If there is no fitting 
+// block, a new arena is allocated and made the current arena. The existing current arena will be 
+// moved to the free list, which holds all other arenas of the sc
 void *malloc_2d_sc_varlen_alloc(malloc_2d_sc_t *sc, size_t sz) {
-  malloc_2d_arena_t *arena = sc->curr_arena;
-  void *ptr;
-  ptr = malloc_2d_arena_varlen_alloc(arena, (int)sz);
-  if(ptr == NULL) {
-    arena = sc->free_list;
-    while(arena != NULL) {
-      ptr = malloc_2d_arena_varlen_alloc(arena, (int)sz);
-      if(ptr != NULL) {
-        break;
-      }
-      arena = arena->next;
-    }
-    if(arena == NULL) {
-      assert(ptr == NULL);
-      sc->curr_arena->sc = sc;
+  int actual_size = (int)((sz + (MALLOC_2D_VARLEN_ALIGNMENT - 1)) & ~(MALLOC_2D_VARLEN_ALIGNMENT - 1)) + \
+          (int)sizeof(malloc_2d_arena_varlen_header_t);
+  assert(actual_size <= (int)MALLOC_2D_VARLEN_MAX_SIZE);
+  malloc_2d_arena_varlen_header_t *header = malloc_2d_varlen_index_find(sc->varlen_index, actual_size);
+  if(header == NULL) {
+    // The current arena may be empty if the request does not fit into any list but its own
+    if(sc->curr_arena->free_size == sc->curr_arena->max_size) {
+      malloc_2d_varlen_index_remove(sc->varlen_index, malloc_2d_arena_varlen_get_first(sc->curr_arena));
+      malloc_2d_arena_free(sc->curr_arena);
+    } else {
       malloc_2d_arena_sc_free_list_insert_head(sc->curr_arena);
-      sc->curr_arena = malloc_2d_arena_varlen_init();
-      sc->curr_arena->sc = sc;
-      ptr = malloc_2d_arena_varlen_alloc(sc->curr_arena, (int)sz);
-      assert(ptr != NULL);
     }
+    sc->curr_arena = malloc_2d_arena_varlen_init(sc->varlen_index);
+    sc->curr_arena->sc = sc;
+    header = malloc_2d_arena_varlen_get_first(sc->curr_arena);
   }
   sc->count++;
-  return ptr;
+  sc->idle_time = 0;
+  return malloc_2d_arena_varlen_alloc(sc->varlen_index, header, actual_size);
 }
 
-void *malloc_2d_sc_huge_alloc(malloc_2d_sc_t *sc, size_t sz) {
-  malloc_2d_arena_t *arena = malloc_2d_arena_huge_init(sz);
+void *malloc_2d_sc_huge_alloc(malloc_2d_sc_t *sc, size_t sz, uint64_t alignment) {
+  malloc_2d_arena_t *arena = malloc_2d_arena_huge_init(sz, alignment);
   arena->sc = sc;
   // Add the arena into the head of the sc
   malloc_2d_arena_sc_free_list_insert_head(arena);
   sc->count++;
-  return MALLOC_2D_PTR_ADD(arena, sizeof(malloc_2d_arena_t));
+  sc->idle_time = 0;
+  return arena->base;
 }
 
 // Print size class information and free list
 void malloc_2d_sc_obj_print(malloc_2d_sc_t *sc) {
-  printf("Size class (obj) type ID %lu sc index %d free list 0x%lX curr arena 0x%lX\n", 
-    sc->type_id, sc->sc_index, (uint64_t)sc->free_list, (uint64_t)sc->curr_arena);
+  printf("Size class (obj) type ID %lu sc index %d curr arena 0x%lX\n", 
+    sc->type_id, sc->sc_index, (uint64_t)sc->curr_arena);
   printf("  Curr arena 0x%lX free %d (used %d)\n", 
     (uint64_t)sc->curr_arena, sc->curr_arena->free_count, sc->curr_arena->max_count - sc->curr_arena->free_count);
-  malloc_2d_arena_t *arena = sc->free_list;
-  while(arena != NULL) {
-    printf("  Free arena 0x%lX free %d (used %d)\n", 
-      (uint64_t)arena, arena->free_count, arena->max_count - arena->free_count);
-    assert(arena->next == NULL || arena->next->prev == arena);
-    assert(arena->prev == NULL || arena->prev->next == arena);
-    arena = arena->next;
+  for(int i = MALLOC_2D_SC_BIN_COUNT - 1;i >= 0;i--) {
+    malloc_2d_arena_t *arena = sc->bins[i];
+    while(arena != NULL) {
+      printf("  Free arena 0x%lX bin %d free %d (used %d)\n", 
+        (uint64_t)arena, i, arena->free_count, arena->max_count - arena->free_count);
+      assert(malloc_2d_arena_obj_get_bin(arena, arena->free_count) == i);
+      assert(arena->next == NULL || arena->next->prev == arena);
+      assert(arena->prev == NULL || arena->prev->next == arena);
+      arena = arena->next;
+    }
   }
   return;
 }
 
 void malloc_2d_sc_varlen_print(malloc_2d_sc_t *sc) {
-  printf("Size class (varlen) free list 0x%lX curr arena 0x%lX\n", 
-    (uint64_t)sc->free_list, (uint64_t)sc->curr_arena);
+  printf("Size class (varlen) free list 0x%lX curr arena 0x%lX index fl bitmap 0x%X\n", 
+    (uint64_t)sc->free_list, (uint64_t)sc->curr_arena, sc->varlen_index->fl_bitmap);
   printf("  Curr arena 0x%lX free %d (used %d)\n", 
     (uint64_t)sc->curr_arena, sc->curr_arena->free_size, sc->curr_arena->max_size - sc->curr_arena->free_size);
   malloc_2d_arena_t *arena = sc->free_list;
@@ -675,8 +2209,8 @@ void malloc_2d_sc_huge_print(malloc_2d_sc_t *sc) {
     sc->count);
   malloc_2d_arena_t *arena = sc->free_list;
   while(arena != NULL) {
-    printf("  Huge arena 0x%lX base 0x%lX pages %d alloc pages %d\n", 
-      (uint64_t)arena, (uint64_t)arena->base, arena->page_count, arena->alloc_page_count);
+    printf("  Huge arena 0x%lX base 0x%lX pages %d\n", 
+      (uint64_t)arena, (uint64_t)arena->base, arena->page_count);
     assert(arena->next == NULL || arena->next->prev == arena);
     assert(arena->prev == NULL || arena->prev->next == arena);
     arena = arena->next;
@@ -695,6 +2229,121 @@ void malloc_2d_sc_print(malloc_2d_sc_t *sc) {
   return;
 }
 
+//
+//* malloc_2d_sc_ht_t
+//
+
+// Allocate a table with the given number of buckets. Memory from the OS is zero-initialized, i.e., 
+// all buckets are empty
+static malloc_2d_sc_ht_t *malloc_2d_sc_ht_init(int bucket_count) {
+  assert((bucket_count & (bucket_count - 1)) == 0);
+  // The header takes the space of one bucket
+  int page_count = (int)((sizeof(malloc_2d_sc_ht_bucket_t) * (bucket_count + 1) + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE);
+  malloc_2d_sc_ht_t *ht = (malloc_2d_sc_ht_t *)malloc_2d_alloc_os_page_unaligned(page_count);
+  ht->mask = (uint64_t)bucket_count - 1UL;
+  ht->bucket_count = bucket_count;
+  ht->page_count = page_count;
+  ht->next = NULL;
+  ht->buckets = (malloc_2d_sc_ht_bucket_t *)ht + 1;
+  return ht;
+}
+
+// Release buckets of a migrated table except the first page, which also holds the header. Stale 
+// lookups then see empty buckets
+static void malloc_2d_sc_ht_retire(malloc_2d_sc_ht_t *ht) {
+  if(ht->page_count > 1) {
+    int ret = madvise(MALLOC_2D_PTR_ADD(ht, MALLOC_2D_PAGE_SIZE), 
+      MALLOC_2D_PAGE_SIZE * (ht->page_count - 1), MADV_DONTNEED);
+    SYSEXPECT(ret == 0);
+  }
+  ht->next = malloc_2d->sc_ht_retired;
+  malloc_2d->sc_ht_retired = ht;
+  return;
+}
+
+inline static void malloc_2d_sc_ht_bucket_write_begin(malloc_2d_sc_ht_bucket_t *bucket) {
+  __atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return;
+}
+
+inline static void malloc_2d_sc_ht_bucket_write_end(malloc_2d_sc_ht_bucket_t *bucket) {
+  __atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELEASE);
+  return;
+}
+
+// Lookup without the hash table lock. It may return an sc that is being freed, or miss an sc that 
+// is being migrated
+static malloc_2d_sc_t *malloc_2d_sc_ht_lookup(
+  malloc_2d_sc_ht_t *ht, uint64_t h, uint64_t type_id, int sc_index) {
+  for(uint64_t i = 0;i < (uint64_t)ht->bucket_count;i++) {
+    malloc_2d_sc_ht_bucket_t *bucket = &ht->buckets[(h + i) & ht->mask];
+    malloc_2d_sc_t *ret;
+    int overflow_count;
+    uint32_t seq;
+    do {
+      seq = __atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE);
+      ret = NULL;
+      for(int j = 0;j < MALLOC_2D_SC_HT_BUCKET_SIZE;j++) {
+        malloc_2d_sc_t *sc = __atomic_load_n(&bucket->sc[j], __ATOMIC_RELAXED);
+        if(sc != NULL && __atomic_load_n(&bucket->type_id[j], __ATOMIC_RELAXED) == type_id && 
+           __atomic_load_n(&bucket->sc_index[j], __ATOMIC_RELAXED) == sc_index) {
+          ret = sc;
+          break;
+        }
+      }
+      overflow_count = __atomic_load_n(&bucket->overflow_count, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((seq & 0x1) != 0 || __atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) != seq);
+    if(ret != NULL) {
+      return ret;
+    } else if(overflow_count == 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+// The key must not be in the table. Buckets passed by the probe have their overflow count 
+// incremented before the sc becomes visible
+static void malloc_2d_sc_ht_insert(
+  malloc_2d_sc_ht_t *ht, uint64_t h, uint64_t type_id, int sc_index, malloc_2d_sc_t *sc) {
+  for(uint64_t i = 0;i < (uint64_t)ht->bucket_count;i++) {
+    malloc_2d_sc_ht_bucket_t *bucket = &ht->buckets[(h + i) & ht->mask];
+    for(int j = 0;j < MALLOC_2D_SC_HT_BUCKET_SIZE;j++) {
+      if(bucket->sc[j] == NULL) {
+        malloc_2d_sc_ht_bucket_write_begin(bucket);
+        __atomic_store_n(&bucket->type_id[j], type_id, __ATOMIC_RELAXED);
+        __atomic_store_n(&bucket->sc_index[j], (int16_t)sc_index, __ATOMIC_RELAXED);
+        __atomic_store_n(&bucket->sc[j], sc, __ATOMIC_RELAXED);
+        malloc_2d_sc_ht_bucket_write_end(bucket);
+        return;
+      }
+    }
+    assert(bucket->overflow_count < UINT16_MAX);
+    malloc_2d_sc_ht_bucket_write_begin(bucket);
+    __atomic_store_n(&bucket->overflow_count, bucket->overflow_count + 1, __ATOMIC_RELAXED);
+    malloc_2d_sc_ht_bucket_write_end(bucket);
+  }
+  error_exit("[malloc_2d] sc hash table is full\n");
+}
+
+// Remove the entry at the given bucket and slot; h is the hash of its key
+static void malloc_2d_sc_ht_remove(malloc_2d_sc_ht_t *ht, uint64_t h, uint64_t index, int slot) {
+  malloc_2d_sc_ht_bucket_t *bucket = &ht->buckets[index];
+  malloc_2d_sc_ht_bucket_write_begin(bucket);
+  __atomic_store_n(&bucket->sc[slot], (malloc_2d_sc_t *)NULL, __ATOMIC_RELAXED);
+  malloc_2d_sc_ht_bucket_write_end(bucket);
+  for(uint64_t i = h & ht->mask;i != index;i = (i + 1) & ht->mask) {
+    bucket = &ht->buckets[i];
+    assert(bucket->overflow_count > 0);
+    malloc_2d_sc_ht_bucket_write_begin(bucket);
+    __atomic_store_n(&bucket->overflow_count, bucket->overflow_count - 1, __ATOMIC_RELAXED);
+    malloc_2d_sc_ht_bucket_write_end(bucket);
+  }
+  return;
+}
+
 //
 //* malloc_2d_t
 //
@@ -703,51 +2352,151 @@ void malloc_2d_sc_print(malloc_2d_sc_t *sc) {
 void malloc_2d_init_static() {
   //fprintf(stderr, "init static\n");
   malloc_2d = &_malloc_2d;
+  malloc_2d_epoch++;
   malloc_2d->stat = &malloc_2d->_stat;
   memset(malloc_2d->stat, 0x00, sizeof(malloc_2d_stat_t));
+  // Initialize the slab before creating any arena; Regions are reserved on demand
+  malloc_2d->slab_region_count = 0;
+  malloc_2d->slab_dirty_count = 0;
+  malloc_2d->slab_op_count = 0;
+  malloc_2d->slab_decay_time = malloc_2d_get_time();
+  malloc_2d->slab_region_table = (malloc_2d_slab_region_t **)malloc_2d_alloc_os_page_unaligned(
+    (int)(MALLOC_2D_SLAB_TABLE_SIZE * sizeof(malloc_2d_slab_region_t *) / MALLOC_2D_PAGE_SIZE));
+  malloc_2d_lock_init(&malloc_2d->slab_lock);
+  // Initialize the page map, whose root and leaves are only touched where arenas are mapped
+  malloc_2d->page_map = (uint64_t **)malloc_2d_alloc_os_page_unaligned(MALLOC_2D_PAGE_MAP_ROOT_PAGE_COUNT);
+  malloc_2d->page_map_leaf_count = 0;
+#ifdef MALLOC_2D_LIB_CALL_SITE
+  malloc_2d->call_site_cache = (uint64_t *)malloc_2d_alloc_os_page_unaligned(MALLOC_2D_CALL_SITE_CACHE_PAGE_COUNT);
+#endif
+#ifdef MALLOC_2D_TYPE_PROFILE
+  malloc_2d->profile = (malloc_2d_profile_t *)malloc_2d_alloc_os_page_unaligned(MALLOC_2D_PROFILE_PAGE_COUNT);
+  malloc_2d->profile_count = 0;
+  malloc_2d_lock_init(&malloc_2d->profile_lock);
+#endif
+  malloc_2d->type_map = NULL;
+  malloc_2d->type_map_capacity = 0;
+  malloc_2d->type_map_count = 0;
+  malloc_2d->type_map_has_default = 0;
+  malloc_2d->type_map_default = 0UL;
+  // Initialize an empty cache of huge mappings
+  malloc_2d->huge_count = 0;
+  malloc_2d->huge_cache_count = 0;
+  malloc_2d->huge_cache_page_count = 0;
+  malloc_2d_lock_init(&malloc_2d->huge_lock);
   // Initialize type-less size classes
   for(int i = 0;i < MALLOC_2D_SC_COUNT;i++) {
+    malloc_2d_lock_init(&malloc_2d->sc_no_type[i].lock);
     malloc_2d_sc_init_in_place(&malloc_2d->sc_no_type[i], 0UL, i);
   }
   // Initialize the meta sc for allocating other scs
+  malloc_2d_lock_init(&malloc_2d->meta_sc.lock);
   malloc_2d_sc_init_in_place(&malloc_2d->meta_sc, 0UL, (sizeof(malloc_2d_sc_t) - 1) / 8);
   // Initialize sc for varlen object
+  malloc_2d_lock_init(&malloc_2d->varlen_sc.lock);
   malloc_2d_sc_init_in_place(&malloc_2d->varlen_sc, 0UL, MALLOC_2D_SC_INDEX_VARLEN);
   // Initialize sc for huge object
+  malloc_2d_lock_init(&malloc_2d->huge_sc.lock);
   malloc_2d_sc_init_in_place(&malloc_2d->huge_sc, 0UL, MALLOC_2D_SC_INDEX_HUGE);
   // Initialize typed size class hash table
-  malloc_2d->sc_ht_page_count = \
-    ((sizeof(malloc_2d_sc_t *) * MALLOC_2D_SC_HT_INIT_SIZE) + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE;
-  malloc_2d->sc_ht = (malloc_2d_sc_t **)malloc_2d_alloc_os_page_unaligned(malloc_2d->sc_ht_page_count);
-  SYSEXPECT(malloc_2d->sc_ht != NULL);
-  memset(malloc_2d->sc_ht, 0x00, sizeof(malloc_2d_sc_t *) * MALLOC_2D_SC_HT_INIT_SIZE);
-  malloc_2d->hash_mask = (uint64_t)MALLOC_2D_SC_HT_INIT_SIZE - 1UL;
+  malloc_2d->sc_ht = malloc_2d_sc_ht_init(MALLOC_2D_SC_HT_INIT_SIZE);
+  malloc_2d->sc_ht_old = NULL;
+  malloc_2d->sc_ht_migrate_index = 0;
+  malloc_2d->sc_ht_reclaim_index = 0;
+  malloc_2d->sc_ht_retired = NULL;
   malloc_2d->sc_ht_count = 0;
-  malloc_2d->sc_ht_bucket_count = MALLOC_2D_SC_HT_INIT_SIZE;
+  malloc_2d_lock_init(&malloc_2d->sc_ht_lock);
+#ifdef MALLOC_2D_THREAD_SAFE
+  malloc_2d->tcache_free_list = NULL;
+  malloc_2d->tcache_list = NULL;
+  malloc_2d_lock_init(&malloc_2d->tcache_lock);
+  malloc_2d->release_gen = 0UL;
+  int ret = pthread_key_create(&malloc_2d->tcache_key, malloc_2d_tcache_destroy);
+  SYSEXPECT(ret == 0);
+#endif
+#ifdef MALLOC_2D_PERCPU
+  // Type-less sc use the per-CPU class of the same index. Stacks are zero-initialized, i.e., empty
+  for(int i = 0;i < MALLOC_2D_SC_COUNT;i++) {
+    malloc_2d->sc_no_type[i].percpu_class = i;
+  }
+  malloc_2d->percpu = (malloc_2d_percpu_t *)malloc_2d_alloc_os_page_unaligned(
+    (int)((sizeof(malloc_2d_percpu_t) * MALLOC_2D_PERCPU_MAX_CPU + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE));
+  memset(malloc_2d->percpu_typed, 0x00, sizeof(malloc_2d->percpu_typed));
+  memset(malloc_2d->percpu_hot, 0x00, sizeof(malloc_2d->percpu_hot));
+  malloc_2d->percpu_typed_count = 0;
+  malloc_2d_lock_init(&malloc_2d->percpu_lock);
+#endif
   return;
 }
 
 void malloc_2d_free_static() {
-  // Free all sc in the static region first
-  for(int i = 0;i < MALLOC_2D_SC_COUNT;i++) {
-    malloc_2d_sc_free_in_place(&malloc_2d->sc_no_type[i]);
-  }
-  // Free all sc in the hash table
-  for(int i = 0;i < malloc_2d->sc_ht_bucket_count;i++) {
-    malloc_2d_sc_t *sc = malloc_2d->sc_ht[i];
-    while(sc != NULL) {
-      malloc_2d_sc_t *next = sc->next;
-      malloc_2d_sc_free(sc);
-      sc = next;
+#ifdef MALLOC_2D_THREAD_SAFE
+  // Objects cached by the calling thread would otherwise keep their sc alive
+  malloc_2d_tcache_flush();
+#endif
+  // Free all sc in the hash table first
+  malloc_2d_sc_ht_t *hts[2] = {malloc_2d->sc_ht_old, malloc_2d->sc_ht};
+  for(int i = 0;i < 2;i++) {
+    if(hts[i] == NULL) {
+      continue;
+    }
+    for(int j = 0;j < hts[i]->bucket_count;j++) {
+      for(int k = 0;k < MALLOC_2D_SC_HT_BUCKET_SIZE;k++) {
+        if(hts[i]->buckets[j].sc[k] != NULL) {
+          malloc_2d_sc_free(hts[i]->buckets[j].sc[k]);
+        }
+      }
     }
   }
   // Free huge sc
   malloc_2d_sc_free_in_place(&malloc_2d->huge_sc);
   // Free varlen sc
   malloc_2d_sc_free_in_place(&malloc_2d->varlen_sc);
+  // Free all sc in the static region last, since they hold huge arena headers and varlen indices
+  for(int i = 0;i < MALLOC_2D_SC_COUNT;i++) {
+    malloc_2d_sc_free_in_place(&malloc_2d->sc_no_type[i]);
+  }
+  malloc_2d_huge_decay(1);
   // Free meta sc -- this function must be called after we freed hash table entries
   malloc_2d_sc_free_in_place(&malloc_2d->meta_sc);
-  malloc_2d_free_os_page(malloc_2d->sc_ht, malloc_2d->sc_ht_page_count);
+  malloc_2d_free_os_page(malloc_2d->sc_ht, malloc_2d->sc_ht->page_count);
+  if(malloc_2d->sc_ht_old != NULL) {
+    malloc_2d_free_os_page(malloc_2d->sc_ht_old, malloc_2d->sc_ht_old->page_count);
+  }
+  while(malloc_2d->sc_ht_retired != NULL) {
+    malloc_2d_sc_ht_t *next = malloc_2d->sc_ht_retired->next;
+    malloc_2d_free_os_page(malloc_2d->sc_ht_retired, malloc_2d->sc_ht_retired->page_count);
+    malloc_2d->sc_ht_retired = next;
+  }
+  // All arenas have been freed
+  for(int i = 0;i < malloc_2d->slab_region_count;i++) {
+    malloc_2d_slab_region_t *region = malloc_2d->slab_regions[i];
+    malloc_2d_free_os_page(region->base, (int)(MALLOC_2D_SLAB_REGION_SIZE / MALLOC_2D_PAGE_SIZE));
+    malloc_2d_free_os_page(region, malloc_2d_slab_region_get_page_count());
+  }
+  malloc_2d->slab_region_count = 0;
+  malloc_2d_free_os_page(malloc_2d->slab_region_table, 
+    (int)(MALLOC_2D_SLAB_TABLE_SIZE * sizeof(malloc_2d_slab_region_t *) / MALLOC_2D_PAGE_SIZE));
+  for(uint64_t i = 0;i < MALLOC_2D_PAGE_MAP_ROOT_SIZE;i++) {
+    if(malloc_2d->page_map[i] != NULL) {
+      malloc_2d_free_os_page(malloc_2d->page_map[i], MALLOC_2D_PAGE_MAP_LEAF_PAGE_COUNT);
+    }
+  }
+  malloc_2d_free_os_page(malloc_2d->page_map, MALLOC_2D_PAGE_MAP_ROOT_PAGE_COUNT);
+#ifdef MALLOC_2D_LIB_CALL_SITE
+  malloc_2d_free_os_page(malloc_2d->call_site_cache, MALLOC_2D_CALL_SITE_CACHE_PAGE_COUNT);
+#endif
+#ifdef MALLOC_2D_TYPE_PROFILE
+  malloc_2d_free_os_page(malloc_2d->profile, MALLOC_2D_PROFILE_PAGE_COUNT);
+#endif
+  if(malloc_2d->type_map != NULL) {
+    malloc_2d_free_os_page(malloc_2d->type_map, (int)((sizeof(malloc_2d_type_map_entry_t) * 
+      malloc_2d->type_map_capacity + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE));
+  }
+#ifdef MALLOC_2D_PERCPU
+  malloc_2d_free_os_page(malloc_2d->percpu, 
+    (int)((sizeof(malloc_2d_percpu_t) * MALLOC_2D_PERCPU_MAX_CPU + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE));
+#endif
   malloc_2d = NULL;
   return;
 }
@@ -760,26 +2509,8 @@ void *malloc_2d_alloc_os_page_unaligned(int count) {
     error_exit("[malloc_2d] mmap() failed with return code %lu (0x%lX)\n", (uint64_t)ret, (uint64_t)ret);
   }
   // Update stats
-  malloc_2d->stat->mmap_count++;
-  malloc_2d->stat->mmap_page_count += (uint64_t)count;
-  return ret;
-}
-
-// Allocate virtual addresses used as heap memory
-// The function aligns the returned page to "count" page boundaries
-// "count" must be a power of 2
-// Value "actual base" is the address that should be saved and used on munmap()
-void *malloc_2d_alloc_os_page(int count, void **actual_base) {
-  // This mask has high bits being one and low bits being zero
-  uint64_t mask = ~((MALLOC_2D_PAGE_SIZE * count) - 1);
-  // Request 2x larger from the OS
-  void *ret = malloc_2d_alloc_os_page_unaligned(count * 2);
-  *actual_base = ret;
-  if(((uint64_t)ret & mask) != (uint64_t)ret) {
-    // Round up to the nearest boundary
-    ret = (void *)(((uint64_t)ret + (MALLOC_2D_PAGE_SIZE * count)) & mask);
-  } 
-  assert(((uint64_t)ret & ~mask) == 0UL);
+  malloc_2d_stat_inc(&malloc_2d->stat->mmap_count, 1UL);
+  malloc_2d_stat_inc(&malloc_2d->stat->mmap_page_count, (uint64_t)count);
   return ret;
 }
 
@@ -787,114 +2518,669 @@ void *malloc_2d_alloc_os_page(int count, void **actual_base) {
 void malloc_2d_free_os_page(void *ptr, int count) {
   int ret = munmap(ptr, MALLOC_2D_PAGE_SIZE * count);
   SYSEXPECT(ret == 0);
-  malloc_2d->stat->munmap_count++;
-  malloc_2d->stat->munmap_page_count += (uint64_t)count;
+  malloc_2d_stat_inc(&malloc_2d->stat->munmap_count, 1UL);
+  malloc_2d_stat_inc(&malloc_2d->stat->munmap_page_count, (uint64_t)count);
   return;
 }
 
+// Negative indices (varlen and huge) are masked such that they do not clobber the type ID bits
 inline static uint64_t malloc_2d_get_hash(uint64_t type_id, int sc_index) {
-  uint64_t h = (type_id << 9) | sc_index;
+  uint64_t h = (type_id << 9) | (uint64_t)(sc_index & 0x1FF);
   h ^= h >> 33;
   h *= 0xff51afd7ed558ccdL;
   h ^= h >> 33;
   h *= 0xc4ceb9fe1a85ec53L;
   h ^= h >> 33;
-  return h & malloc_2d->hash_mask;
+  return h;
+}
+
+// Create a table of twice the size. Existing sc are migrated by later insertions
+static void malloc_2d_sc_ht_resize() {
+  assert(malloc_2d->sc_ht_old == NULL);
+  malloc_2d_sc_ht_t *ht = malloc_2d_sc_ht_init(malloc_2d->sc_ht->bucket_count * 2);
+  malloc_2d->sc_ht_migrate_index = 0;
+  malloc_2d->sc_ht_reclaim_index = 0;
+  // Lookups read sc_ht_old before sc_ht, so the current table must become the old one first
+  __atomic_store_n(&malloc_2d->sc_ht_old, malloc_2d->sc_ht, __ATOMIC_RELEASE);
+  __atomic_store_n(&malloc_2d->sc_ht, ht, __ATOMIC_RELEASE);
+  malloc_2d_stat_inc(&malloc_2d->stat->sc_ht_resize_count, 1UL);
+  return;
+}
+
+// Move sc from the next "count" buckets of the old table to the current one
+static void malloc_2d_sc_ht_migrate(int count) {
+  malloc_2d_sc_ht_t *old_ht = malloc_2d->sc_ht_old;
+  while(count-- > 0 && malloc_2d->sc_ht_migrate_index < old_ht->bucket_count) {
+    uint64_t index = (uint64_t)malloc_2d->sc_ht_migrate_index++;
+    malloc_2d_sc_ht_bucket_t *bucket = &old_ht->buckets[index];
+    for(int i = 0;i < MALLOC_2D_SC_HT_BUCKET_SIZE;i++) {
+      if(bucket->sc[i] != NULL) {
+        uint64_t h = malloc_2d_get_hash(bucket->type_id[i], bucket->sc_index[i]);
+        // Insert before removing, such that a lookup that searches the old table first always 
+        // finds the sc in one of them
+        malloc_2d_sc_ht_insert(malloc_2d->sc_ht, h, bucket->type_id[i], bucket->sc_index[i], bucket->sc[i]);
+        malloc_2d_sc_ht_remove(old_ht, h, index, i);
+      }
+    }
+  }
+  if(malloc_2d->sc_ht_migrate_index == old_ht->bucket_count) {
+    __atomic_store_n(&malloc_2d->sc_ht_old, (malloc_2d_sc_ht_t *)NULL, __ATOMIC_RELEASE);
+    malloc_2d_sc_ht_retire(old_ht);
+  }
+  return;
+}
+
+// Returns 1 and marks the sc as removed from the hash table if it has been without live objects 
+// for MALLOC_2D_SC_IDLE_NS. The first pass that finds the sc idle only records the time, and any 
+// allocation in-between resets it. Allocation from a typed sc requires the hash table lock which 
+// we hold, or the sc lock acquired before the sc is checked. The count is therefore checked again 
+// under the sc lock
+static int malloc_2d_sc_check_free(malloc_2d_sc_t *sc, uint64_t now) {
+  if(__atomic_load_n(&sc->count, __ATOMIC_RELAXED) != 0) {
+#ifdef MALLOC_2D_THREAD_SAFE
+    // Objects on remote free lists are still counted as live
+    if(__atomic_load_n(&sc->remote_arenas, __ATOMIC_RELAXED) == NULL) {
+      return 0;
+    }
+#else
+    return 0;
+#endif
+  }
+  int is_free = 0;
+  malloc_2d_lock(&sc->lock);
+#ifdef MALLOC_2D_THREAD_SAFE
+  if(sc->remote_arenas != NULL) {
+    malloc_2d_sc_obj_reclaim_remote(sc);
+  }
+#endif
+  if(sc->count == 0) {
+#ifdef MALLOC_2D_PERCPU
+    // Promoted sc are referenced by the per-CPU lookup table
+    if(sc->percpu_class >= 0) {
+      malloc_2d_unlock(&sc->lock);
+      return 0;
+    }
+#endif
+    if(sc->idle_time == 0) {
+      sc->idle_time = now;
+    } else if(now - sc->idle_time >= MALLOC_2D_SC_IDLE_NS) {
+      sc->in_ht = 0;
+      is_free = 1;
+    }
+  }
+  malloc_2d_unlock(&sc->lock);
+  return is_free;
+}
+
+// Check "count" buckets starting from "begin" and free idle sc in them
+static void malloc_2d_sc_ht_reclaim(malloc_2d_sc_ht_t *ht, int begin, int count, uint64_t now) {
+  for(int i = 0;i < count;i++) {
+    uint64_t index = (uint64_t)(begin + i) & ht->mask;
+    malloc_2d_sc_ht_bucket_t *bucket = &ht->buckets[index];
+    for(int j = 0;j < MALLOC_2D_SC_HT_BUCKET_SIZE;j++) {
+      malloc_2d_sc_t *sc = bucket->sc[j];
+      if(sc != NULL && malloc_2d_sc_check_free(sc, now) == 1) {
+        malloc_2d_sc_ht_remove(ht, malloc_2d_get_hash(bucket->type_id[j], bucket->sc_index[j]), index, j);
+        malloc_2d_sc_free(sc);
+        malloc_2d->sc_ht_count--;
+      }
+    }
+  }
+  return;
 }
 
 // This function allocates a new size class and inserts into the hash table of the given type ID and sz
 // Returns the newly allocated size class object
-malloc_2d_sc_t *malloc_2d_add_new_sc(int ht_index, uint64_t type_id, int sc_index) {
+malloc_2d_sc_t *malloc_2d_add_new_sc(uint64_t type_id, int sc_index) {
+  // Insertions pay for reclamation, such that the table does not fill up with idle sc even if 
+  // malloc_2d_maintain() is never called
+  malloc_2d_sc_ht_reclaim(malloc_2d->sc_ht, malloc_2d->sc_ht_reclaim_index, MALLOC_2D_SC_HT_RECLAIM_STEP, 
+    malloc_2d_get_time());
+  malloc_2d->sc_ht_reclaim_index = (malloc_2d->sc_ht_reclaim_index + MALLOC_2D_SC_HT_RECLAIM_STEP) & 
+    (int)malloc_2d->sc_ht->mask;
+  if(malloc_2d->sc_ht_old == NULL && (malloc_2d->sc_ht_count + 1) * 100 > 
+     malloc_2d->sc_ht->bucket_count * MALLOC_2D_SC_HT_BUCKET_SIZE * MALLOC_2D_SC_HT_MAX_LOAD) {
+    malloc_2d_sc_ht_resize();
+  }
+  // The old table is fully migrated long before the new one needs to grow
+  if(malloc_2d->sc_ht_old != NULL) {
+    malloc_2d_sc_ht_migrate(MALLOC_2D_SC_HT_MIGRATE_STEP);
+  }
   malloc_2d_sc_t *sc = malloc_2d_sc_init(type_id, sc_index);
-  sc->next = malloc_2d->sc_ht[ht_index];
-  malloc_2d->sc_ht[ht_index] = sc;
-  // TODO: Resizing logic here
+  malloc_2d_sc_ht_insert(malloc_2d->sc_ht, malloc_2d_get_hash(type_id, sc_index), type_id, sc_index, sc);
+  sc->in_ht = 1;
   malloc_2d->sc_ht_count++;
   return sc;
 }
 
-// Searches the linked list on the hash table, and return if found.
-// Returns NULL if not found
-malloc_2d_sc_t *malloc_2d_find_sc(int ht_index, uint64_t type_id, int sc_index) {
-  assert(ht_index >= 0 && ht_index < malloc_2d->sc_ht_bucket_count);
-  malloc_2d_sc_t *sc = malloc_2d->sc_ht[ht_index];
-  malloc_2d_sc_t *prev = NULL;
-  while(sc != NULL) {
-    if(sc->type_id == type_id && sc->sc_index == sc_index) {
-      break;
-    }
-    // Removing the sc from the hash table if it is free
-    if(sc->count == 0) {
-      malloc_2d_sc_t *gc = NULL;
-      if(prev != NULL) {
-        prev->next = sc->next;
-        gc = sc;
-        sc = prev->next;
-      } else {
-        malloc_2d->sc_ht[ht_index] = sc->next;
-        gc = sc;
-        sc = malloc_2d->sc_ht[ht_index];
+// Searches both tables, and return if found.
+// Returns NULL if not found
+malloc_2d_sc_t *malloc_2d_find_sc(uint64_t type_id, int sc_index) {
+  uint64_t h = malloc_2d_get_hash(type_id, sc_index);
+  malloc_2d_sc_ht_t *hts[2] = {malloc_2d->sc_ht_old, malloc_2d->sc_ht};
+  for(int i = 0;i < 2;i++) {
+    if(hts[i] == NULL) {
+      continue;
+    }
+    malloc_2d_sc_t *sc = malloc_2d_sc_ht_lookup(hts[i], h, type_id, sc_index);
+    if(sc != NULL) {
+      return sc;
+    }
+  }
+  return NULL;
+}
+
+void malloc_2d_maintain() {
+  uint64_t now = malloc_2d_get_time();
+  malloc_2d_lock(&malloc_2d->sc_ht_lock);
+  malloc_2d_sc_ht_t *hts[2] = {malloc_2d->sc_ht_old, malloc_2d->sc_ht};
+  for(int i = 0;i < 2;i++) {
+    if(hts[i] != NULL) {
+      malloc_2d_sc_ht_reclaim(hts[i], 0, hts[i]->bucket_count, now);
+    }
+  }
+  malloc_2d_unlock(&malloc_2d->sc_ht_lock);
+  malloc_2d_lock(&malloc_2d->slab_lock);
+  malloc_2d_slab_decay();
+  malloc_2d_unlock(&malloc_2d->slab_lock);
+  malloc_2d_huge_decay(0);
+  malloc_2d_stat_inc(&malloc_2d->stat->maintain_count, 1UL);
+  return;
+}
+
+malloc_2d_sc_t *malloc_2d_get_sc_locked(uint64_t type_id, int sc_index) {
+  // Lock-free lookup first. The sc is checked after it is locked, since it may have been freed 
+  // and reused for another key in-between
+  uint64_t h = malloc_2d_get_hash(type_id, sc_index);
+  malloc_2d_sc_t *sc = NULL;
+  malloc_2d_sc_ht_t *ht = __atomic_load_n(&malloc_2d->sc_ht_old, __ATOMIC_ACQUIRE);
+  if(ht != NULL) {
+    sc = malloc_2d_sc_ht_lookup(ht, h, type_id, sc_index);
+  }
+  if(sc == NULL) {
+    sc = malloc_2d_sc_ht_lookup(__atomic_load_n(&malloc_2d->sc_ht, __ATOMIC_ACQUIRE), h, type_id, sc_index);
+  }
+  if(sc != NULL) {
+    malloc_2d_lock(&sc->lock);
+    if(sc->in_ht == 1 && sc->type_id == type_id && sc->sc_index == sc_index) {
+      return sc;
+    }
+    malloc_2d_unlock(&sc->lock);
+  }
+  malloc_2d_lock(&malloc_2d->sc_ht_lock);
+  sc = malloc_2d_find_sc(type_id, sc_index);
+  if(sc == NULL) {
+    // If no entry found, then allocate a new one
+    sc = malloc_2d_add_new_sc(type_id, sc_index);
+  } else {
+    // Lock the sc before releasing the hash table such that it cannot be reclaimed in-between
+    malloc_2d_lock(&sc->lock);
+  }
+  malloc_2d_unlock(&malloc_2d->sc_ht_lock);
+  malloc_2d_stat_inc(&malloc_2d->stat->sc_ht_locked_count, 1UL);
+  return sc;
+}
+
+// Allocation larger than MALLOC_2D_MEDIUM_MAX_SIZE; Shared by typed and untyped allocation
+static void *malloc_2d_alloc_large(uint64_t sz) {
+  void *ret;
+  // The varlen header is part of the block
+  if(sz <= MALLOC_2D_VARLEN_MAX_SIZE - sizeof(malloc_2d_arena_varlen_header_t)) {
+    //ret = malloc_2d_debug_alloc(sz); 
+    malloc_2d_lock(&malloc_2d->varlen_sc.lock);
+    ret = malloc_2d_sc_varlen_alloc(&malloc_2d->varlen_sc, sz);
+    malloc_2d_unlock(&malloc_2d->varlen_sc.lock);
+  } else {
+    //ret = malloc_2d_debug_alloc(sz);
+    malloc_2d_lock(&malloc_2d->huge_sc.lock);
+    ret = malloc_2d_sc_huge_alloc(&malloc_2d->huge_sc, sz, MALLOC_2D_PAGE_SIZE);
+    malloc_2d_unlock(&malloc_2d->huge_sc.lock);
+  }
+  return ret;
+}
+
+void *malloc_2d_alloc(uint64_t sz) {
+  void *ret;
+  if(sz > MALLOC_2D_MEDIUM_MAX_SIZE) {
+    ret = malloc_2d_alloc_large(sz);
+  } else {
+    if(sz == 0UL) {
+      sz = 1UL;
+    }
+    int sc_index = malloc_2d_get_sc_index(sz);
+#if defined(MALLOC_2D_PERCPU)
+    return malloc_2d_percpu_alloc(&malloc_2d->sc_no_type[sc_index], sc_index);
+#elif defined(MALLOC_2D_THREAD_SAFE)
+    malloc_2d_tcache_t *tcache = malloc_2d_tcache_get();
+    if(tcache != NULL) {
+      return malloc_2d_tcache_alloc(tcache, sc_index);
+    }
+#endif
+    malloc_2d_sc_t *sc = &malloc_2d->sc_no_type[sc_index];
+    malloc_2d_lock(&sc->lock);
+    ret = malloc_2d_sc_obj_alloc(sc);
+    malloc_2d_unlock(&sc->lock);
+  }
+  //fprintf(stderr, "malloc_2d_alloc %lu ptr %p\n", sz, ret);
+  return ret;
+}
+
+// The sc is looked up and locked once for the whole batch
+void malloc_2d_typed_alloc_batch(uint64_t type_id, uint64_t sz, int count, void **objs) {
+#ifdef MALLOC_2D_TYPE_PROFILE
+  malloc_2d_profile_alloc(type_id, sz, count);
+#endif
+  malloc_2d_sc_t *sc;
+  if(sz > MALLOC_2D_VARLEN_MAX_SIZE - sizeof(malloc_2d_arena_varlen_header_t)) {
+    sc = malloc_2d_get_sc_locked(type_id, MALLOC_2D_SC_INDEX_HUGE);
+    for(int i = 0;i < count;i++) {
+      objs[i] = malloc_2d_sc_huge_alloc(sc, sz, MALLOC_2D_PAGE_SIZE);
+    }
+  } else if(sz > MALLOC_2D_MEDIUM_MAX_SIZE) {
+    sc = malloc_2d_get_sc_locked(type_id, MALLOC_2D_SC_INDEX_VARLEN);
+    for(int i = 0;i < count;i++) {
+      objs[i] = malloc_2d_sc_varlen_alloc(sc, sz);
+    }
+  } else {
+    sc = malloc_2d_get_sc_locked(type_id, malloc_2d_get_sc_index(sz == 0UL ? 1UL : sz));
+    malloc_2d_sc_obj_alloc_batch(sc, objs, count);
+  }
+  malloc_2d_unlock(&sc->lock);
+  return;
+}
+
+// Runs of objects of the same object sc are returned under one acquisition of the sc lock, and 
+// the arena of each run is updated once. Objects of other arenas are freed one by one
+void malloc_2d_dealloc_batch(void **objs, int count) {
+#ifdef MALLOC_2D_TYPE_PROFILE
+  for(int i = 0;i < count;i++) {
+    if(objs[i] != NULL) {
+      malloc_2d_profile_dealloc(objs[i]);
+    }
+  }
+#endif
+  int begin = 0;
+  while(begin < count) {
+    if(objs[begin] == NULL) {
+      begin++;
+      continue;
+    }
+    malloc_2d_arena_t *arena = malloc_2d_arena_get(objs[begin]);
+    if(malloc_2d_arena_get_type(arena) != MALLOC_2D_ARENA_FLAGS_OBJ) {
+      malloc_2d_arena_dealloc(objs[begin]);
+      begin++;
+      continue;
+    }
+    malloc_2d_sc_t *sc = arena->sc;
+    int end = begin + 1;
+    while(end < count && objs[end] != NULL) {
+      malloc_2d_arena_t *next = malloc_2d_arena_get(objs[end]);
+      if(next != arena) {
+        if(malloc_2d_arena_get_type(next) != MALLOC_2D_ARENA_FLAGS_OBJ || next->sc != sc) {
+          break;
+        }
+        arena = next;
+      }
+      end++;
+    }
+#ifdef MALLOC_2D_THREAD_SAFE
+    malloc_2d_sc_obj_flush(sc, objs + begin, end - begin);
+#else
+    malloc_2d_lock(&sc->lock);
+    malloc_2d_sc_obj_dealloc_batch(sc, objs + begin, end - begin);
+    malloc_2d_unlock(&sc->lock);
+#endif
+    begin = end;
+  }
+  return;
+}
+
+// Returns the sc of the key locked, or NULL if it does not exist; Never creates one
+static malloc_2d_sc_t *malloc_2d_find_sc_locked(uint64_t type_id, int sc_index) {
+  malloc_2d_lock(&malloc_2d->sc_ht_lock);
+  malloc_2d_sc_t *sc = malloc_2d_find_sc(type_id, sc_index);
+  if(sc != NULL) {
+    malloc_2d_lock(&sc->lock);
+  }
+  malloc_2d_unlock(&malloc_2d->sc_ht_lock);
+  return sc;
+}
+
+static uint64_t malloc_2d_type_release_index(uint64_t type_id, int sc_index) {
+  malloc_2d_sc_t *sc = malloc_2d_find_sc_locked(type_id, sc_index);
+  if(sc == NULL) {
+    return 0UL;
+  }
+  // Objects cached by threads are not live, and are counted before the release invalidates them
+#ifdef MALLOC_2D_THREAD_SAFE
+  int cached_count = malloc_2d_tcache_count(sc);
+#else
+  int cached_count = 0;
+#endif
+  int count = malloc_2d_sc_release(sc) - cached_count;
+  malloc_2d_unlock(&sc->lock);
+#ifdef MALLOC_2D_TYPE_PROFILE
+  malloc_2d_profile_release(type_id, (uint64_t)count);
+#endif
+  return (uint64_t)count;
+}
+
+uint64_t malloc_2d_type_release(uint64_t type_id) {
+  uint64_t count = 0UL;
+  for(int i = MALLOC_2D_SC_INDEX_HUGE;i < MALLOC_2D_SC_COUNT;i++) {
+    count += malloc_2d_type_release_index(type_id, i);
+  }
+  return count;
+}
+
+uint64_t malloc_2d_type_for_each(uint64_t type_id, malloc_2d_for_each_func_t func, void *arg) {
+  uint64_t count = 0UL;
+  for(int i = MALLOC_2D_SC_INDEX_HUGE;i < MALLOC_2D_SC_COUNT;i++) {
+    malloc_2d_sc_t *sc = malloc_2d_find_sc_locked(type_id, i);
+    if(sc != NULL) {
+      count += malloc_2d_sc_for_each(sc, func, arg);
+      malloc_2d_unlock(&sc->lock);
+    }
+  }
+  return count;
+}
+
+uint64_t malloc_2d_type_release_sc(uint64_t type_id, uint64_t sz) {
+  int sc_index;
+  if(sz > MALLOC_2D_VARLEN_MAX_SIZE - sizeof(malloc_2d_arena_varlen_header_t)) {
+    sc_index = MALLOC_2D_SC_INDEX_HUGE;
+  } else if(sz > MALLOC_2D_MEDIUM_MAX_SIZE) {
+    sc_index = MALLOC_2D_SC_INDEX_VARLEN;
+  } else {
+    sc_index = malloc_2d_get_sc_index(sz == 0UL ? 1UL : sz);
+  }
+  return malloc_2d_type_release_index(type_id, sc_index);
+}
+
+// Small objects are cleared, which is cheaper than bypassing the thread cache. Medium objects are 
+// taken from the sc directly to find out whether they have ever been used, and huge objects are 
+// cleared by dropping their pages unless they are freshly mapped
+void *malloc_2d_calloc(uint64_t count, uint64_t sz) {
+  uint64_t total;
+  if(__builtin_mul_overflow(count, sz, &total)) {
+    return NULL;
+  }
+  void *ret;
+  int is_zero = 0;
+  if(total <= MALLOC_2D_OBJ_MAX_SIZE) {
+    ret = malloc_2d_alloc(total);
+  } else if(total <= MALLOC_2D_MEDIUM_MAX_SIZE) {
+    malloc_2d_sc_t *sc = &malloc_2d->sc_no_type[malloc_2d_get_sc_index(total)];
+    malloc_2d_lock(&sc->lock);
+    ret = malloc_2d_sc_obj_alloc_zero(sc, &is_zero);
+    malloc_2d_unlock(&sc->lock);
+  } else {
+    ret = malloc_2d_alloc(total);
+    malloc_2d_arena_t *arena = malloc_2d_arena_get(ret);
+    if(malloc_2d_arena_get_type(arena) == MALLOC_2D_ARENA_FLAGS_HUGE) {
+      is_zero = malloc_2d_arena_is_zero(arena);
+      if(is_zero == 0 && total >= MALLOC_2D_CALLOC_MADVISE_SIZE) {
+        int madvise_ret = madvise(ret, MALLOC_2D_PAGE_SIZE * arena->page_count, MADV_DONTNEED);
+        SYSEXPECT(madvise_ret == 0);
+        malloc_2d_stat_inc(&malloc_2d->stat->madvise_count, 1UL);
+        malloc_2d_stat_inc(&malloc_2d->stat->madvise_page_count, (uint64_t)arena->page_count);
+        is_zero = 1;
+      }
+    }
+  }
+  if(is_zero == 1) {
+    malloc_2d_stat_inc(&malloc_2d->stat->calloc_zero_count, 1UL);
+  } else {
+    memset(ret, 0x00, total);
+  }
+  return ret;
+}
+
+// Uses the implicit return address as the type ID, or its group if a type map is loaded
+// This piece of code must remain an actual function and must not be inlined. Otherwise the 
+// compiler would give the wrong return address
+void *malloc_2d_typed_alloc_implicit(uint64_t sz) {
+  // This built-in function with argument 0 returns the current return address
+  // i.e., the implicit type ID
+  uint64_t type_id = malloc_2d_type_map_get((uint64_t)__builtin_return_address(0), sz);
+  return (type_id == 0UL) ? malloc_2d_alloc(sz) : malloc_2d_typed_alloc(type_id, sz);
+}
+
+#ifdef MALLOC_2D_LIB_CALL_SITE
+
+// Dynamic symbols of functions that allocate on behalf of their caller. Return addresses into them 
+// are skipped, such that objects are typed by the caller of the wrapper
+static const char *malloc_2d_call_site_skip[] = {
+  "_Znwm", "_Znam", "_ZnwmRKSt9nothrow_t", "_ZnamRKSt9nothrow_t", "_ZnwmSt11align_val_t", 
+  "_ZnamSt11align_val_t", "strdup", "__strdup", "strndup", "__strndup", NULL,
+};
+// Set while the thread computes a type ID. dladdr() and pthread_getattr_np() may call malloc(), 
+// whose objects are then untyped
+static __thread int malloc_2d_call_site_busy __attribute__((tls_model("initial-exec"))) = 0;
+// End of the stack of the thread, found on the first walk; 1 if it is unknown
+static __thread uint64_t malloc_2d_call_site_stack_end __attribute__((tls_model("initial-exec"))) = 0UL;
+
+// Returns 1 if the return address is in a wrapper. Addresses missing from the cache are looked up 
+// with dladdr(), which finds the nearest dynamic symbol
+static int malloc_2d_call_site_is_wrapper(uint64_t ret_addr) {
+  uint64_t *entry = &malloc_2d->call_site_cache[
+    (ret_addr * 0x9e3779b97f4a7c15UL >> 32) & (MALLOC_2D_CALL_SITE_CACHE_SIZE - 1)];
+  uint64_t value = __atomic_load_n(entry, __ATOMIC_RELAXED);
+  if((value & ~MALLOC_2D_CALL_SITE_WRAPPER) == ret_addr) {
+    return (value & MALLOC_2D_CALL_SITE_WRAPPER) != 0UL;
+  }
+  int is_wrapper = 0;
+  Dl_info info;
+  if(dladdr((void *)ret_addr, &info) != 0 && info.dli_sname != NULL) {
+    for(int i = 0;malloc_2d_call_site_skip[i] != NULL;i++) {
+      if(strcmp(info.dli_sname, malloc_2d_call_site_skip[i]) == 0) {
+        is_wrapper = 1;
+        break;
+      }
+    }
+  }
+  __atomic_store_n(entry, ret_addr | (is_wrapper ? MALLOC_2D_CALL_SITE_WRAPPER : 0UL), __ATOMIC_RELAXED);
+  malloc_2d_stat_inc(&malloc_2d->stat->call_site_miss_count, 1UL);
+  return is_wrapper;
+}
+
+static uint64_t malloc_2d_call_site_get_stack_end() {
+  if(malloc_2d_call_site_stack_end == 0UL) {
+    malloc_2d_call_site_stack_end = 1UL;
+    pthread_attr_t attr;
+    if(pthread_getattr_np(pthread_self(), &attr) == 0) {
+      void *addr;
+      size_t size;
+      if(pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        malloc_2d_call_site_stack_end = (uint64_t)addr + size;
+      }
+      pthread_attr_destroy(&attr);
+    }
+  }
+  return malloc_2d_call_site_stack_end;
+}
+
+// Return addresses are combined such that the type ID of depth 1 is the return address itself, as 
+// with malloc_2d_typed_alloc_implicit(). Saved frame pointers must point upwards into the stack, 
+// which bounds the walk even if some frames do not keep one. If the walk ends in a wrapper, e.g., 
+// one that uses the frame pointer register for data, the wrapper itself is the call site
+uint64_t malloc_2d_call_site_get_type(void *ret_addr, void *frame) {
+  if(malloc_2d_call_site_busy != 0) {
+    return 0UL;
+  }
+  malloc_2d_call_site_busy = 1;
+  uint64_t type_id = 0UL;
+  uint64_t addr = (uint64_t)ret_addr;
+  uint64_t *fp = (uint64_t *)frame;
+  int depth = 0;
+  for(int i = 0;i < MALLOC_2D_CALL_SITE_MAX_FRAMES;i++) {
+    if(malloc_2d_call_site_is_wrapper(addr) == 0) {
+      type_id = type_id * 0x9e3779b97f4a7c15UL + addr;
+      if(++depth == MALLOC_2D_CALL_SITE_DEPTH) {
+        break;
       }
-      malloc_2d_sc_free(gc);
-      malloc_2d->sc_ht_count--;
-    } else {
-      prev = sc;
-      sc = sc->next;
     }
+    // The saved frame pointer and return address must be below the end, without overflowing
+    uint64_t *next = (uint64_t *)fp[0];
+    uint64_t stack_end = malloc_2d_call_site_get_stack_end();
+    if(next <= fp || ((uint64_t)next & 0x7UL) != 0UL || (uint64_t)next >= stack_end || 
+       stack_end - (uint64_t)next < 2 * sizeof(uint64_t)) {
+      break;
+    }
+    fp = next;
+    addr = fp[1];
   }
-  return sc;
+  if(depth == 0) {
+    type_id = (uint64_t)ret_addr;
+  }
+  malloc_2d_call_site_busy = 0;
+  return type_id;
 }
 
-void *malloc_2d_alloc(uint64_t sz) {
+#endif
+
+// Large objects of a type are placed in the varlen or huge sc of the type, found by the same hash
+static void *malloc_2d_typed_alloc_large(uint64_t type_id, uint64_t sz) {
   void *ret;
-  if(sz > MALLOC_2D_OBJ_MAX_SIZE) {
-    if(sz <= MALLOC_2D_VARLEN_MAX_SIZE) {
-      //ret = malloc_2d_debug_alloc(sz); 
-      ret = malloc_2d_sc_varlen_alloc(&malloc_2d->varlen_sc, sz);
-    } else {
-      //ret = malloc_2d_debug_alloc(sz);
-      ret = malloc_2d_sc_huge_alloc(&malloc_2d->huge_sc, sz);
-    }
+  malloc_2d_sc_t *sc;
+  if(sz <= MALLOC_2D_VARLEN_MAX_SIZE - sizeof(malloc_2d_arena_varlen_header_t)) {
+    sc = malloc_2d_get_sc_locked(type_id, MALLOC_2D_SC_INDEX_VARLEN);
+    ret = malloc_2d_sc_varlen_alloc(sc, sz);
   } else {
-    if(sz == 0UL) {
-      sz = 1UL;
-    }
-    int sc_index = (int)(sz - 1) / MALLOC_2D_SC_INCREMENT;
-    ret = malloc_2d_sc_obj_alloc(&malloc_2d->sc_no_type[sc_index]);
+    sc = malloc_2d_get_sc_locked(type_id, MALLOC_2D_SC_INDEX_HUGE);
+    ret = malloc_2d_sc_huge_alloc(sc, sz, MALLOC_2D_PAGE_SIZE);
   }
-  //fprintf(stderr, "malloc_2d_alloc %lu ptr %p\n", sz, ret);
+  malloc_2d_unlock(&sc->lock);
   return ret;
 }
 
-// Uses the implicit return address as the type ID
-// This piece of code must remain an actual function and must not be inlined. Otherwise the 
-// compiler would give the wrong return address
-void *malloc_2d_typed_alloc_implicit(uint64_t sz) {
-  // This built-in function with argument 0 returns the current return address
-  // i.e., the implicit type ID
-  return malloc_2d_typed_alloc((uint64_t)__builtin_return_address(0), sz);
+void *malloc_2d_typed_alloc(uint64_t type_id, uint64_t sz) {
+#ifdef MALLOC_2D_TYPE_PROFILE
+  malloc_2d_profile_alloc(type_id, sz, 1);
+#endif
+  if(sz > MALLOC_2D_MEDIUM_MAX_SIZE) {
+    return malloc_2d_typed_alloc_large(type_id, sz);
+  } else if(sz == 0UL) {
+    sz = 1UL;
+  }
+  int sc_index = malloc_2d_get_sc_index(sz);
+#if defined(MALLOC_2D_PERCPU)
+  return malloc_2d_percpu_typed_alloc(type_id, sc_index);
+#elif defined(MALLOC_2D_THREAD_SAFE)
+  malloc_2d_tcache_t *tcache = malloc_2d_tcache_get();
+  if(tcache != NULL) {
+    return malloc_2d_tcache_typed_alloc(tcache, type_id, sc_index);
+  }
+#endif
+  malloc_2d_sc_t *sc = malloc_2d_get_sc_locked(type_id, sc_index);
+  void *ret = malloc_2d_sc_obj_alloc(sc);
+  malloc_2d_unlock(&sc->lock);
+  return ret;
 }
 
-void *malloc_2d_typed_alloc(uint64_t type_id, uint64_t sz) {
-  if(sz > MALLOC_2D_OBJ_MAX_SIZE) {
-    if(sz <= MALLOC_2D_VARLEN_MAX_SIZE) {
-      return malloc_2d_sc_varlen_alloc(&malloc_2d->varlen_sc, sz);
-    } else {
-      return malloc_2d_sc_huge_alloc(&malloc_2d->huge_sc, sz);
+// The cached sc is validated after it is locked as in the lock-free lookup of the hash table. 
+// Otherwise the sc is looked up and cached again; Concurrent updates store equally valid sc
+static malloc_2d_sc_t *malloc_2d_handle_get_sc_locked(malloc_2d_handle_t *handle) {
+  malloc_2d_sc_t *sc = __atomic_load_n(&handle->sc, __ATOMIC_RELAXED);
+  if(sc != NULL && __atomic_load_n(&handle->epoch, __ATOMIC_RELAXED) == malloc_2d_epoch) {
+    malloc_2d_lock(&sc->lock);
+    if(sc->in_ht == 1 && sc->type_id == handle->type_id && sc->sc_index == handle->sc_index) {
+      return sc;
     }
+    malloc_2d_unlock(&sc->lock);
+  }
+  sc = malloc_2d_get_sc_locked(handle->type_id, handle->sc_index);
+  __atomic_store_n(&handle->epoch, malloc_2d_epoch, __ATOMIC_RELAXED);
+  __atomic_store_n(&handle->sc, sc, __ATOMIC_RELAXED);
+  return sc;
+}
+
+void *malloc_2d_handle_alloc(malloc_2d_handle_t *handle) {
+#ifdef MALLOC_2D_TYPE_PROFILE
+  malloc_2d_profile_alloc(handle->type_id, (uint64_t)malloc_2d_get_sc_obj_size(handle->sc_index), 1);
+#endif
+#if defined(MALLOC_2D_PERCPU)
+  return malloc_2d_percpu_handle_alloc(handle);
+#elif defined(MALLOC_2D_THREAD_SAFE)
+  malloc_2d_tcache_t *tcache = malloc_2d_tcache_get();
+  if(tcache != NULL) {
+    return malloc_2d_tcache_handle_alloc(tcache, handle);
+  }
+#endif
+  malloc_2d_sc_t *sc = malloc_2d_handle_get_sc_locked(handle);
+  void *ret = malloc_2d_sc_obj_alloc(sc);
+  malloc_2d_unlock(&sc->lock);
+  return ret;
+}
+
+// Objects are resized in place if they stay in the same object size class, if a varlen block can 
+// take the free block after it or give away its tail, or if a huge object stays huge. Otherwise the 
+// object is copied into a new one of the same type
+void *malloc_2d_realloc(void *ptr, uint64_t sz) {
+  if(ptr == NULL) {
+    return malloc_2d_alloc(sz);
   } else if(sz == 0UL) {
     sz = 1UL;
   }
-  int sc_index = (int)(sz - 1) / MALLOC_2D_SC_INCREMENT;
-  uint64_t h = malloc_2d_get_hash(type_id, sc_index);
-  assert(h < (uint64_t)malloc_2d->sc_ht_bucket_count);
-  malloc_2d_sc_t *sc = malloc_2d_find_sc(h, type_id, sc_index);
-  if(sc == NULL) {
-    // If no entry found, then allocate a new one
-    sc = malloc_2d_add_new_sc(h, type_id, sc_index);
+  malloc_2d_arena_t *arena = malloc_2d_arena_get(ptr);
+  malloc_2d_sc_t *sc = arena->sc;
+  int in_place = 0;
+  switch(malloc_2d_arena_get_type(arena)) {
+    case MALLOC_2D_ARENA_FLAGS_OBJ: {
+      in_place = (sz <= (uint64_t)arena->obj_size && 
+                  malloc_2d_get_sc_index(sz) == malloc_2d_get_sc_index((uint64_t)arena->obj_size));
+    } break;
+    case MALLOC_2D_ARENA_FLAGS_VARLEN: {
+      if(sz > MALLOC_2D_MEDIUM_MAX_SIZE && sz <= MALLOC_2D_VARLEN_MAX_SIZE - sizeof(malloc_2d_arena_varlen_header_t)) {
+        malloc_2d_lock(&sc->lock);
+        in_place = malloc_2d_arena_varlen_realloc(arena, ptr, sz);
+        malloc_2d_unlock(&sc->lock);
+      }
+    } break;
+    case MALLOC_2D_ARENA_FLAGS_HUGE: {
+      // Huge objects stay huge as long as the new size does not fit into a varlen block
+      if(sz > MALLOC_2D_VARLEN_MAX_SIZE - sizeof(malloc_2d_arena_varlen_header_t)) {
+        malloc_2d_stat_inc(&malloc_2d->stat->realloc_in_place_count, 1UL);
+        return malloc_2d_arena_huge_realloc(arena, sz);
+      }
+    } break;
   }
-  assert(sc != NULL);
-  void *ret = malloc_2d_sc_obj_alloc(sc);
+  if(in_place == 1) {
+    malloc_2d_stat_inc(&malloc_2d->stat->realloc_in_place_count, 1UL);
+    return ptr;
+  }
+  // The sc cannot be reclaimed while ptr is live
+  uint64_t old_sz = malloc_2d_arena_get_size(ptr);
+  void *ret = (sc == NULL || sc->type_id == 0UL) ? malloc_2d_alloc(sz) : malloc_2d_typed_alloc(sc->type_id, sz);
+  memcpy(ret, ptr, (sz > old_sz) ? old_sz : sz);
+  malloc_2d_dealloc(ptr);
+  malloc_2d_stat_inc(&malloc_2d->stat->realloc_move_count, 1UL);
+  return ret;
+}
+
+// Objects of a size class are aligned to the largest power of two dividing the class size (up to a 
+// page), so the smallest class that is a multiple of the alignment is used without any padding. 
+// Larger objects and alignments are served by huge arenas, which are at least page-aligned
+void *malloc_2d_aligned_alloc(uint64_t alignment, uint64_t sz) {
+  if(alignment == 0UL || (alignment & (alignment - 1)) != 0UL) {
+    return NULL;
+  } else if(alignment <= MALLOC_2D_SC_INCREMENT) {
+    return malloc_2d_alloc(sz);
+  } else if(sz == 0UL) {
+    sz = 1UL;
+  }
+  if(alignment <= MALLOC_2D_PAGE_SIZE && sz <= MALLOC_2D_MEDIUM_MAX_SIZE) {
+    for(int sc_index = malloc_2d_get_sc_index(sz > alignment ? sz : alignment);sc_index < MALLOC_2D_SC_COUNT;sc_index++) {
+      int obj_size = malloc_2d_get_sc_obj_size(sc_index);
+      if((obj_size & (alignment - 1)) == 0) {
+        return malloc_2d_alloc((uint64_t)obj_size);
+      }
+    }
+  }
+  malloc_2d_lock(&malloc_2d->huge_sc.lock);
+  void *ret = malloc_2d_sc_huge_alloc(&malloc_2d->huge_sc, sz, 
+    alignment > MALLOC_2D_PAGE_SIZE ? alignment : MALLOC_2D_PAGE_SIZE);
+  malloc_2d_unlock(&malloc_2d->huge_sc.lock);
   return ret;
 }
 
@@ -903,32 +3189,41 @@ uint64_t malloc_2d_get_net_mmap_count() {
 }
 
 int malloc_2d_get_sc_ht_bucket_count() {
-  return malloc_2d->sc_ht_bucket_count;
+  return malloc_2d->sc_ht->bucket_count;
 }
 
 int malloc_2d_get_sc_ht_count() {
   return malloc_2d->sc_ht_count;
 }
 
-// Print hash buckets related information
+// Print hash buckets related information. The range of a class starts above the previous one, and 
+// the class before the first one has size 0
 void malloc_2d_print() {
   for(int i = 0;i < MALLOC_2D_SC_COUNT;i++) {
     malloc_2d_sc_t *sc = &malloc_2d->sc_no_type[i];
     if(sc->count != 0) {
       printf("Static sc index %d (%d--%d) count %d curr arena free %d max %d\n",
-        sc->sc_index, sc->sc_index * 8 + 1, sc->sc_index * 8 + 8,
+        sc->sc_index, malloc_2d_get_sc_obj_size(sc->sc_index - 1) + 1, malloc_2d_get_sc_obj_size(sc->sc_index),
         sc->count, sc->curr_arena->free_count, sc->curr_arena->max_count);
     }
   }
-  printf("Average chain len %.4lf\n", 
-    (double)malloc_2d->sc_ht_count / (double)malloc_2d->sc_ht_bucket_count);
-  for(int i = 0;i < malloc_2d->sc_ht_bucket_count;i++) {
-    malloc_2d_sc_t *sc = malloc_2d->sc_ht[i];
-    while(sc != NULL) {
+  malloc_2d_sc_ht_t *ht = malloc_2d->sc_ht;
+  printf("Load factor %.4lf%s\n", 
+    (double)malloc_2d->sc_ht_count / (double)(ht->bucket_count * MALLOC_2D_SC_HT_BUCKET_SIZE),
+    malloc_2d->sc_ht_old != NULL ? " (resizing)" : "");
+  for(int i = 0;i < ht->bucket_count;i++) {
+    for(int j = 0;j < MALLOC_2D_SC_HT_BUCKET_SIZE;j++) {
+      malloc_2d_sc_t *sc = ht->buckets[i].sc[j];
+      if(sc == NULL) {
+        continue;
+      } else if(sc->sc_index < 0) {
+        printf("Bucket %d type ID %lu (0x%lX) %s count %d\n", i, sc->type_id, sc->type_id, 
+          sc->sc_index == MALLOC_2D_SC_INDEX_VARLEN ? "varlen" : "huge", sc->count);
+        continue;
+      }
       printf("Bucket %d type ID %lu (0x%lX) sc index %d (%d--%d) count %d curr arena free %d max %d\n",
-        i, sc->type_id, sc->type_id, sc->sc_index, sc->sc_index * 8 + 1, sc->sc_index * 8 + 8,
+        i, sc->type_id, sc->type_id, sc->sc_index, malloc_2d_get_sc_obj_size(sc->sc_index - 1) + 1, malloc_2d_get_sc_obj_size(sc->sc_index),
         sc->count, sc->curr_arena->free_count, sc->curr_arena->max_count);
-      sc = sc->next;
     }
   }
   return;
@@ -942,13 +3237,56 @@ void malloc_2d_conf_print() {
   printf("---------- malloc_2d conf ----------\n");
   printf("Page size %lu arena size (# of pages) %lu\n", 
     MALLOC_2D_PAGE_SIZE, (uint64_t)MALLOC_2D_ARENA_SIZE);
+  printf("Slab region size %lu max regions %d max cached chunks %d decay ops %d ns %lu\n",
+    MALLOC_2D_SLAB_REGION_SIZE, MALLOC_2D_SLAB_REGION_MAX, MALLOC_2D_SLAB_DIRTY_MAX,
+    MALLOC_2D_SLAB_DECAY_OPS, MALLOC_2D_SLAB_DECAY_NS);
   printf("Arena (obj) size max %d inc %d size class count %d\n",
-    MALLOC_2D_OBJ_MAX_SIZE, MALLOC_2D_SC_INCREMENT, MALLOC_2D_SC_COUNT);
-  printf("Arena (varlen) max size %d min size %d alignment %d\n",
-    (int)MALLOC_2D_VARLEN_MAX_SIZE, (int)MALLOC_2D_VARLEN_MIN_SIZE, (int)MALLOC_2D_VARLEN_ALIGNMENT);
-  printf("HT init buckets %d pages %d\n",
-    MALLOC_2D_SC_HT_INIT_SIZE, 
-    (int)(((sizeof(malloc_2d_sc_t *) * MALLOC_2D_SC_HT_INIT_SIZE) + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE));
+    MALLOC_2D_OBJ_MAX_SIZE, MALLOC_2D_SC_INCREMENT, MALLOC_2D_SC_SMALL_COUNT);
+  printf("Arena (medium obj) size max %d classes per power of two %d size class count %d max chunks %d\n",
+    MALLOC_2D_MEDIUM_MAX_SIZE, 1 << MALLOC_2D_MEDIUM_STEP_LOG2, MALLOC_2D_SC_MEDIUM_COUNT, 
+    MALLOC_2D_MEDIUM_ARENA_MAX_CHUNK);
+  printf("Arena (varlen) max size %d min size %d alignment %d index levels %d x %d\n",
+    (int)MALLOC_2D_VARLEN_MAX_SIZE, (int)MALLOC_2D_VARLEN_MIN_SIZE, (int)MALLOC_2D_VARLEN_ALIGNMENT,
+    MALLOC_2D_VARLEN_FL_COUNT, MALLOC_2D_VARLEN_SL_COUNT);
+#ifdef MALLOC_2D_ARENA_BITMAP
+  int bitmap_on = 1;
+#else
+  int bitmap_on = 0;
+#endif
+#ifdef MALLOC_2D_ARENA_BITMAP_ALLOC
+  int bitmap_alloc_on = 1;
+#else
+  int bitmap_alloc_on = 0;
+#endif
+#ifdef MALLOC_2D_ARENA_SIDE_TABLE
+  int side_table_on = 1;
+#else
+  int side_table_on = 0;
+#endif
+  printf("Arena (obj) occupancy bitmap %d bitmap alloc %d header %lu side table %d iteration prefetch %d\n", 
+    bitmap_on, bitmap_alloc_on, sizeof(malloc_2d_arena_t), side_table_on, MALLOC_2D_FOR_EACH_PREFETCH);
+  printf("HT init buckets %d bucket size %d max load %d%% migrate step %d reclaim step %d\n",
+    MALLOC_2D_SC_HT_INIT_SIZE, MALLOC_2D_SC_HT_BUCKET_SIZE, MALLOC_2D_SC_HT_MAX_LOAD, MALLOC_2D_SC_HT_MIGRATE_STEP,
+    MALLOC_2D_SC_HT_RECLAIM_STEP);
+  printf("SC idle ns %lu arena bins %d\n", MALLOC_2D_SC_IDLE_NS, MALLOC_2D_SC_BIN_COUNT);
+  printf("Huge cache count %d max pages %d calloc madvise size %lu\n",
+    MALLOC_2D_HUGE_CACHE_COUNT, MALLOC_2D_HUGE_CACHE_MAX_PAGES, MALLOC_2D_CALLOC_MADVISE_SIZE);
+  printf("Page map leaf bits %d root size %lu\n", MALLOC_2D_PAGE_MAP_LEAF_BITS, MALLOC_2D_PAGE_MAP_ROOT_SIZE);
+#ifdef MALLOC_2D_LIB_CALL_SITE
+  int call_site_on = 1;
+#else
+  int call_site_on = 0;
+#endif
+  printf("Call site types %d depth %d max frames %d max size %d cache %d\n", call_site_on, 
+    MALLOC_2D_CALL_SITE_DEPTH, MALLOC_2D_CALL_SITE_MAX_FRAMES, MALLOC_2D_CALL_SITE_MAX_SIZE, 
+    MALLOC_2D_CALL_SITE_CACHE_SIZE);
+#ifdef MALLOC_2D_TYPE_PROFILE
+  int profile_on = 1;
+#else
+  int profile_on = 0;
+#endif
+  printf("Type profile %d table %d size buckets %d map split max %d\n", profile_on, 
+    MALLOC_2D_PROFILE_TABLE_SIZE, MALLOC_2D_PROFILE_SIZE_BUCKETS, MALLOC_2D_TYPE_MAP_SPLIT_MAX);
   printf("SC size %lu sc index %d\n",
     sizeof(malloc_2d_sc_t), (int)(sizeof(malloc_2d_sc_t) - 1) / 8);
   return;
@@ -961,25 +3299,635 @@ void malloc_2d_stat_print() {
   printf("Malloc %lu free %lu\n", stat->malloc_count, stat->free_count);
   printf("Mmap %lu pages %lu\n", stat->mmap_count, stat->mmap_page_count);
   printf("Munmap %lu pages %lu\n", stat->munmap_count, stat->munmap_page_count);
+  printf("Madvise %lu pages %lu\n", stat->madvise_count, stat->madvise_page_count);
+  printf("Slab regions %d cached chunks %d reuse %lu decay %lu\n", malloc_2d->slab_region_count, 
+    malloc_2d->slab_dirty_count, stat->slab_reuse_count, stat->slab_decay_count);
   printf("SC init %lu free %lu\n", stat->sc_init_count, stat->sc_free_count);
   printf("   meta count %d\n", malloc_2d->meta_sc.count);
   printf("Arena init %lu free %lu curr_to_full %lu full_to_free %lu free_to_curr %lu\n",
     stat->arena_init_count, stat->arena_free_count, stat->arena_curr_to_full_count,
     stat->arena_full_to_free_count, stat->arena_free_to_curr_count);
-  printf("HT curr buckets %d count %d mask 0x%lX (%d buckets) pages %d\n",
-    malloc_2d->sc_ht_bucket_count, malloc_2d->sc_ht_count, malloc_2d->hash_mask, 
-    (int)(malloc_2d->hash_mask + 1), malloc_2d->sc_ht_page_count);
+  printf("   live %lu bin move %lu drained %lu\n", stat->arena_init_count - stat->arena_free_count,
+    stat->arena_bin_move_count, stat->arena_drain_count);
+  printf("Tcache init %lu refill %lu flush %lu\n",
+    stat->tcache_init_count, stat->tcache_refill_count, stat->tcache_flush_count);
+  printf("Remote free %lu reclaim %lu\n", stat->remote_free_count, stat->remote_reclaim_count);
+  printf("Percpu refill %lu flush %lu promote %lu\n",
+    stat->percpu_refill_count, stat->percpu_flush_count, stat->percpu_promote_count);
+  printf("SC release %lu objects %lu\n", stat->sc_release_count, stat->sc_release_obj_count);
+  printf("Realloc in place %lu move %lu calloc without clearing %lu\n", 
+    stat->realloc_in_place_count, stat->realloc_move_count, stat->calloc_zero_count);
+  printf("Huge live %d cached %d pages %d hit %lu mremap %lu\n", malloc_2d->huge_count, 
+    malloc_2d->huge_cache_count, malloc_2d->huge_cache_page_count, stat->huge_cache_hit_count, stat->huge_mremap_count);
+  printf("Page map leaves %d foreign free %lu realloc %lu call site misses %lu\n", malloc_2d->page_map_leaf_count, 
+    stat->foreign_free_count, stat->foreign_realloc_count, stat->call_site_miss_count);
+#ifdef MALLOC_2D_TYPE_PROFILE
+  int profile_count = malloc_2d->profile_count;
+#else
+  int profile_count = 0;
+#endif
+  printf("Profile types %d dropped %lu type map entries %d\n", profile_count, stat->profile_drop_count, 
+    malloc_2d->type_map_count);
+  printf("HT curr buckets %d count %d mask 0x%lX pages %d resizing %d\n",
+    malloc_2d->sc_ht->bucket_count, malloc_2d->sc_ht_count, malloc_2d->sc_ht->mask, 
+    malloc_2d->sc_ht->page_count, malloc_2d->sc_ht_old != NULL);
+  printf("HT resize %lu locked lookup %lu maintain %lu\n", stat->sc_ht_resize_count, stat->sc_ht_locked_count, 
+    stat->maintain_count);
+  return;
+}
+
+#ifdef MALLOC_2D_THREAD_SAFE
+
+//
+//* malloc_2d_tcache_t
+//
+
+// Value of the thread cache pointer after the thread has exited. All later requests from the 
+// thread go to the central size classes directly
+#define MALLOC_2D_TCACHE_DESTROYED ((malloc_2d_tcache_t *)1UL)
+
+// Initial-exec TLS model avoids calling __tls_get_addr(), which may call malloc() itself
+static __thread malloc_2d_tcache_t *malloc_2d_tcache __attribute__((tls_model("initial-exec"))) = NULL;
+
+// Returns the first magazine of the set that (type_id, sc_index) maps to
+inline static malloc_2d_tcache_mag_t *malloc_2d_tcache_typed_set(
+  malloc_2d_tcache_t *tcache, uint64_t type_id, int sc_index) {
+  uint64_t h = (type_id ^ (type_id >> 29) ^ ((uint64_t)sc_index << 3)) * 0x9e3779b97f4a7c15UL;
+  int set = (int)(h >> 32) & (MALLOC_2D_TCACHE_TYPED_COUNT / MALLOC_2D_TCACHE_TYPED_WAYS - 1);
+  return &tcache->typed[set * MALLOC_2D_TCACHE_TYPED_WAYS];
+}
+
+// Return the "count" oldest objects of the magazine to the central sc. Recently freed objects are 
+// kept in the magazine since they are more likely to be in the cache
+// Typed magazines are flushed under the sc lock, such that they cannot return objects of a released 
+// sc; All objects of a stale magazine are dropped and it is unbound
+static void malloc_2d_tcache_mag_flush(malloc_2d_tcache_mag_t *mag, int count) {
+  assert(count <= mag->count && mag->sc != NULL);
+  malloc_2d_sc_t *sc = mag->sc;
+  if(sc >= &malloc_2d->sc_no_type[0] && sc < &malloc_2d->sc_no_type[MALLOC_2D_SC_COUNT]) {
+    malloc_2d_sc_obj_flush(sc, mag->objs, count);
+  } else {
+    malloc_2d_lock(&sc->lock);
+    if(sc->release_gen != mag->sc_gen) {
+      malloc_2d_unlock(&sc->lock);
+      mag->count = 0;
+      mag->sc = NULL;
+      return;
+    }
+    malloc_2d_sc_obj_dealloc_batch(sc, mag->objs, count);
+    malloc_2d_unlock(&sc->lock);
+  }
+  memmove(mag->objs, mag->objs + count, sizeof(void *) * (mag->count - count));
+  mag->count -= count;
+  malloc_2d_stat_inc(&malloc_2d->stat->tcache_flush_count, 1UL);
+  return;
+}
+
+// Fill an empty magazine with objects from its sc. Returns 0 if the sc has been released since the 
+// magazine was bound, in which case its objects are dropped and it is unbound
+static int malloc_2d_tcache_mag_refill(malloc_2d_tcache_mag_t *mag, malloc_2d_sc_t *sc) {
+  malloc_2d_lock(&sc->lock);
+  if(sc->release_gen != mag->sc_gen) {
+    malloc_2d_unlock(&sc->lock);
+    mag->count = 0;
+    mag->sc = NULL;
+    return 0;
+  }
+  malloc_2d_sc_obj_alloc_batch(sc, mag->objs + mag->count, MALLOC_2D_TCACHE_BATCH_SIZE);
+  malloc_2d_unlock(&sc->lock);
+  malloc_2d_sc_obj_reverse(mag->objs + mag->count, MALLOC_2D_TCACHE_BATCH_SIZE);
+  mag->count += MALLOC_2D_TCACHE_BATCH_SIZE;
+  malloc_2d_stat_inc(&malloc_2d->stat->tcache_refill_count, 1UL);
+  return 1;
+}
+
+// Returns 1 if the sc of the magazine has not been released since it was bound. Otherwise its 
+// objects are dropped and it is unbound. The sc is only read if any sc has been released since the 
+// magazine was last checked
+inline static int malloc_2d_tcache_mag_check(malloc_2d_tcache_mag_t *mag) {
+  uint64_t gen = __atomic_load_n(&malloc_2d->release_gen, __ATOMIC_ACQUIRE);
+  if(__builtin_expect(mag->checked_gen == gen, 1)) {
+    return 1;
+  } else if(__atomic_load_n(&mag->sc->release_gen, __ATOMIC_RELAXED) != mag->sc_gen) {
+    mag->count = 0;
+    mag->sc = NULL;
+    return 0;
+  }
+  mag->checked_gen = gen;
+  return 1;
+}
+
+// The caller must hold the sc lock, or an object of the sc, such that it is not released meanwhile
+inline static void malloc_2d_tcache_mag_bind(malloc_2d_tcache_mag_t *mag, malloc_2d_sc_t *sc) {
+  mag->checked_gen = __atomic_load_n(&malloc_2d->release_gen, __ATOMIC_ACQUIRE);
+  mag->sc_gen = __atomic_load_n(&sc->release_gen, __ATOMIC_RELAXED);
+  mag->sc = sc;
+  mag->type_id = sc->type_id;
+  mag->sc_index = sc->sc_index;
+  return;
+}
+
+// Returns the magazine bound to the given sc in the set, or NULL if there is none
+inline static malloc_2d_tcache_mag_t *malloc_2d_tcache_typed_find(
+  malloc_2d_tcache_mag_t *set, uint64_t type_id, int sc_index) {
+  for(int i = 0;i < MALLOC_2D_TCACHE_TYPED_WAYS;i++) {
+    if(set[i].count != 0 && set[i].type_id == type_id && set[i].sc_index == sc_index) {
+      return (malloc_2d_tcache_mag_check(&set[i]) == 1) ? &set[i] : NULL;
+    }
+  }
+  return NULL;
+}
+
+// Returns an empty magazine in the set; If all of them are in use, one is flushed
+static malloc_2d_tcache_mag_t *malloc_2d_tcache_typed_victim(
+  malloc_2d_tcache_t *tcache, malloc_2d_tcache_mag_t *set) {
+  for(int i = 0;i < MALLOC_2D_TCACHE_TYPED_WAYS;i++) {
+    if(set[i].count == 0) {
+      return &set[i];
+    }
+  }
+  malloc_2d_tcache_mag_t *mag = &set[tcache->typed_victim++ & (MALLOC_2D_TCACHE_TYPED_WAYS - 1)];
+  malloc_2d_tcache_mag_flush(mag, mag->count);
+  return mag;
+}
+
+static void malloc_2d_tcache_flush_all(malloc_2d_tcache_t *tcache) {
+  for(int i = 0;i < MALLOC_2D_SC_COUNT;i++) {
+    malloc_2d_tcache_mag_t *mag = &tcache->no_type[i];
+    if(mag->count != 0) {
+      malloc_2d_tcache_mag_flush(mag, mag->count);
+    }
+  }
+  for(int i = 0;i < MALLOC_2D_TCACHE_TYPED_COUNT;i++) {
+    malloc_2d_tcache_mag_t *mag = &tcache->typed[i];
+    if(mag->count != 0) {
+      malloc_2d_tcache_mag_flush(mag, mag->count);
+    }
+    mag->sc = NULL;
+  }
+  return;
+}
+
+// Called by pthread on thread exit with the thread's cache as argument
+static void malloc_2d_tcache_destroy(void *arg) {
+  malloc_2d_tcache_t *tcache = (malloc_2d_tcache_t *)arg;
+  malloc_2d_tcache = MALLOC_2D_TCACHE_DESTROYED;
+  malloc_2d_tcache_flush_all(tcache);
+  malloc_2d_lock(&malloc_2d->tcache_lock);
+  tcache->next = malloc_2d->tcache_free_list;
+  malloc_2d->tcache_free_list = tcache;
+  malloc_2d_unlock(&malloc_2d->tcache_lock);
+  return;
+}
+
+// Reuse the cache of an exited thread if there is one; Otherwise allocate from the OS
+static malloc_2d_tcache_t *malloc_2d_tcache_init() {
+  malloc_2d_lock(&malloc_2d->tcache_lock);
+  malloc_2d_tcache_t *tcache = malloc_2d->tcache_free_list;
+  if(tcache != NULL) {
+    malloc_2d->tcache_free_list = tcache->next;
+  }
+  malloc_2d_unlock(&malloc_2d->tcache_lock);
+  if(tcache == NULL) {
+    int page_count = (int)((sizeof(malloc_2d_tcache_t) + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE);
+    // Memory from the OS is zero-initialized, i.e., all magazines are empty
+    tcache = (malloc_2d_tcache_t *)malloc_2d_alloc_os_page_unaligned(page_count);
+    for(int i = 0;i < MALLOC_2D_SC_COUNT;i++) {
+      tcache->no_type[i].sc = &malloc_2d->sc_no_type[i];
+    }
+    malloc_2d_lock(&malloc_2d->tcache_lock);
+    tcache->all_next = malloc_2d->tcache_list;
+    malloc_2d->tcache_list = tcache;
+    malloc_2d_unlock(&malloc_2d->tcache_lock);
+    malloc_2d_stat_inc(&malloc_2d->stat->tcache_init_count, 1UL);
+  }
+  tcache->next = NULL;
+  // Set the TLS pointer first, since pthread_setspecific() may allocate
+  malloc_2d_tcache = tcache;
+  pthread_setspecific(malloc_2d->tcache_key, tcache);
+  return tcache;
+}
+
+malloc_2d_tcache_t *malloc_2d_tcache_get() {
+  malloc_2d_tcache_t *tcache = malloc_2d_tcache;
+  if(__builtin_expect(tcache == NULL, 0)) {
+    tcache = malloc_2d_tcache_init();
+  } else if(__builtin_expect(tcache == MALLOC_2D_TCACHE_DESTROYED, 0)) {
+    tcache = NULL;
+  }
+  return tcache;
+}
+
+void *malloc_2d_tcache_alloc(malloc_2d_tcache_t *tcache, int sc_index) {
+  malloc_2d_tcache_mag_t *mag = &tcache->no_type[sc_index];
+  if(mag->count == 0) {
+    malloc_2d_tcache_mag_refill(mag, mag->sc);
+  }
+  return mag->objs[--mag->count];
+}
+
+void *malloc_2d_tcache_typed_alloc(malloc_2d_tcache_t *tcache, uint64_t type_id, int sc_index) {
+  malloc_2d_handle_t handle = {type_id, sc_index, 0UL, NULL};
+  return malloc_2d_tcache_handle_alloc(tcache, &handle);
+}
+
+// The handle is only used to find the sc when a magazine is bound
+void *malloc_2d_tcache_handle_alloc(malloc_2d_tcache_t *tcache, malloc_2d_handle_t *handle) {
+  uint64_t type_id = handle->type_id;
+  int sc_index = handle->sc_index;
+  malloc_2d_tcache_mag_t *set = malloc_2d_tcache_typed_set(tcache, type_id, sc_index);
+  malloc_2d_tcache_mag_t *mag = malloc_2d_tcache_typed_find(set, type_id, sc_index);
+  // The sc is pinned by the last object, so refill before handing it out. This way the magazine 
+  // stays bound and we do not need to look up the hash table again
+  if(mag != NULL && (mag->count > 1 || malloc_2d_tcache_mag_refill(mag, mag->sc) == 1)) {
+    return mag->objs[--mag->count];
+  }
+  mag = malloc_2d_tcache_typed_victim(tcache, set);
+  malloc_2d_sc_t *sc = malloc_2d_handle_get_sc_locked(handle);
+  malloc_2d_sc_obj_alloc_batch(sc, mag->objs, MALLOC_2D_TCACHE_BATCH_SIZE);
+  malloc_2d_tcache_mag_bind(mag, sc);
+  malloc_2d_unlock(&sc->lock);
+  malloc_2d_sc_obj_reverse(mag->objs, MALLOC_2D_TCACHE_BATCH_SIZE);
+  mag->count = MALLOC_2D_TCACHE_BATCH_SIZE;
+  malloc_2d_stat_inc(&malloc_2d->stat->tcache_refill_count, 1UL);
+  return mag->objs[--mag->count];
+}
+
+void malloc_2d_tcache_dealloc(void *ptr) {
+  malloc_2d_arena_t *arena = malloc_2d_arena_get(ptr);
+  malloc_2d_sc_t *sc = arena->sc;
+  malloc_2d_tcache_t *tcache;
+  // Varlen, huge and meta objects are not cached
+  if(malloc_2d_arena_get_type(arena) != MALLOC_2D_ARENA_FLAGS_OBJ || sc == NULL || 
+     sc == &malloc_2d->meta_sc || (tcache = malloc_2d_tcache_get()) == NULL) {
+    malloc_2d_arena_dealloc(ptr);
+    return;
+  }
+  malloc_2d_tcache_mag_t *mag;
+  if(sc >= &malloc_2d->sc_no_type[0] && sc < &malloc_2d->sc_no_type[MALLOC_2D_SC_COUNT]) {
+    mag = &tcache->no_type[sc - &malloc_2d->sc_no_type[0]];
+  } else {
+    malloc_2d_tcache_mag_t *set = malloc_2d_tcache_typed_set(tcache, sc->type_id, sc->sc_index);
+    mag = malloc_2d_tcache_typed_find(set, sc->type_id, sc->sc_index);
+    if(mag == NULL) {
+      mag = malloc_2d_tcache_typed_victim(tcache, set);
+      malloc_2d_tcache_mag_bind(mag, sc);
+    }
+  }
+  if(mag->count == MALLOC_2D_TCACHE_MAG_SIZE) {
+    malloc_2d_tcache_mag_flush(mag, MALLOC_2D_TCACHE_BATCH_SIZE);
+    // The sc has been released concurrently, and the object with it
+    if(mag->sc == NULL) {
+      return;
+    }
+  }
+  mag->objs[mag->count++] = ptr;
+  return;
+}
+
+// Returns the typed magazine of the calling thread bound to the sc, or NULL if there is none
+static malloc_2d_tcache_mag_t *malloc_2d_tcache_find_mag(malloc_2d_sc_t *sc) {
+  malloc_2d_tcache_t *tcache = malloc_2d_tcache;
+  if(tcache == NULL || tcache == MALLOC_2D_TCACHE_DESTROYED) {
+    return NULL;
+  }
+  malloc_2d_tcache_mag_t *set = malloc_2d_tcache_typed_set(tcache, sc->type_id, sc->sc_index);
+  malloc_2d_tcache_mag_t *mag = malloc_2d_tcache_typed_find(set, sc->type_id, sc->sc_index);
+  assert(mag == NULL || mag->sc == sc);
+  return mag;
+}
+
+// Magazines of other threads are read without their owners' cooperation. Only magazines bound to 
+// the sc since its last release hold its objects
+int malloc_2d_tcache_count(malloc_2d_sc_t *sc) {
+  int count = 0;
+  malloc_2d_lock(&malloc_2d->tcache_lock);
+  for(malloc_2d_tcache_t *tcache = malloc_2d->tcache_list;tcache != NULL;tcache = tcache->all_next) {
+    malloc_2d_tcache_mag_t *set = malloc_2d_tcache_typed_set(tcache, sc->type_id, sc->sc_index);
+    for(int i = 0;i < MALLOC_2D_TCACHE_TYPED_WAYS;i++) {
+      if(__atomic_load_n(&set[i].sc, __ATOMIC_RELAXED) == sc && set[i].sc_gen == sc->release_gen) {
+        count += __atomic_load_n(&set[i].count, __ATOMIC_RELAXED);
+      }
+    }
+  }
+  malloc_2d_unlock(&malloc_2d->tcache_lock);
+  return count;
+}
+
+void malloc_2d_tcache_return(malloc_2d_sc_t *sc) {
+  malloc_2d_tcache_mag_t *mag = malloc_2d_tcache_find_mag(sc);
+  if(mag != NULL) {
+    malloc_2d_sc_obj_dealloc_batch(sc, mag->objs, mag->count);
+    mag->count = 0;
+    mag->sc = NULL;
+  }
+  return;
+}
+
+void malloc_2d_tcache_flush() {
+  malloc_2d_tcache_t *tcache = malloc_2d_tcache;
+  if(tcache != NULL && tcache != MALLOC_2D_TCACHE_DESTROYED) {
+    malloc_2d_tcache_flush_all(tcache);
+  }
+  return;
+}
+
+#endif
+
+#ifdef MALLOC_2D_PERCPU
+
+//
+//* malloc_2d_percpu_t
+//
+
+// Published by glibc 2.35+ if it registered rseq for the thread; Weak such that older glibc links
+extern "C" const ptrdiff_t __rseq_offset __attribute__((weak));
+extern "C" const unsigned int __rseq_size __attribute__((weak));
+
+// Value of the rseq pointer if rseq is not available to the thread
+#define MALLOC_2D_PERCPU_RSEQ_NONE ((struct rseq *)1UL)
+
+// rseq area of the thread, NULL if not checked yet
+static __thread struct rseq *malloc_2d_percpu_rseq __attribute__((tls_model("initial-exec"))) = NULL;
+// Registered by us if glibc did not
+static __thread struct rseq malloc_2d_percpu_rseq_area __attribute__((tls_model("initial-exec")));
+
+static struct rseq *malloc_2d_percpu_rseq_init() {
+  struct rseq *rs = MALLOC_2D_PERCPU_RSEQ_NONE;
+#ifdef __x86_64__
+  if(&__rseq_size != NULL && __rseq_size != 0) {
+    rs = (struct rseq *)((uint8_t *)__builtin_thread_pointer() + __rseq_offset);
+  } else {
+    malloc_2d_percpu_rseq_area.cpu_id = (uint32_t)RSEQ_CPU_ID_UNINITIALIZED;
+    if(syscall(__NR_rseq, &malloc_2d_percpu_rseq_area, sizeof(struct rseq), 0, MALLOC_2D_RSEQ_SIG) == 0) {
+      rs = &malloc_2d_percpu_rseq_area;
+    }
+  }
+#endif
+  malloc_2d_percpu_rseq = rs;
+  return rs;
+}
+
+// Returns NULL if rseq is not available, in which case the caller uses the central sc
+inline static struct rseq *malloc_2d_percpu_rseq_get() {
+  struct rseq *rs = malloc_2d_percpu_rseq;
+  if(__builtin_expect(rs == NULL, 0)) {
+    rs = malloc_2d_percpu_rseq_init();
+  }
+  return rs == MALLOC_2D_PERCPU_RSEQ_NONE ? NULL : rs;
+}
+
+// Both critical sections below index the stack of the class on the current CPU, and commit with 
+// the final store to the stack count. If the thread is preempted, migrated or signaled before the 
+// commit, the kernel jumps to the abort handler which restarts from the beginning. CPUs not lower 
+// than MALLOC_2D_PERCPU_MAX_CPU, as well as an uninitialized cpu_id (-1), fail the range check
+
+// Pop an object from the stack of the class on the current CPU; Returns NULL if the stack is empty
+inline static void *malloc_2d_percpu_pop(struct rseq *rs, int percpu_class) {
+  void *ret = NULL;
+#ifdef __x86_64__
+  malloc_2d_percpu_stack_t *stack = &malloc_2d->percpu[0].stacks[percpu_class];
+  __asm__ __volatile__(
+    ".pushsection __rseq_cs, \"aw\"\n\t"
+    ".balign 32\n\t"
+    "3:\n\t"
+    ".long 0x0, 0x0\n\t"
+    ".quad 1f, (2f - 1f), 4f\n\t"
+    ".popsection\n\t"
+    "9:\n\t"
+    "xorl %k[ret], %k[ret]\n\t"
+    "leaq 3b(%%rip), %%rax\n\t"
+    "movq %%rax, %[rseq_cs]\n\t"
+    "1:\n\t"
+    "movl %[cpu_id], %%eax\n\t"
+    "cmpl %[max_cpu], %%eax\n\t"
+    "jae 5f\n\t"
+    "imulq %[stride], %%rax\n\t"
+    "addq %[stack], %%rax\n\t"
+    "movq (%%rax), %%rcx\n\t"
+    "testq %%rcx, %%rcx\n\t"
+    "jz 5f\n\t"
+    "movq (%%rax, %%rcx, 8), %[ret]\n\t"
+    "decq %%rcx\n\t"
+    "movq %%rcx, (%%rax)\n\t"
+    "2:\n\t"
+    ".pushsection __rseq_failure, \"ax\"\n\t"
+    ".byte 0x0f, 0xb9, 0x3d\n\t"
+    ".long %c[sig]\n\t"
+    "4:\n\t"
+    "jmp 9b\n\t"
+    ".popsection\n\t"
+    "5:\n\t"
+    : [ret] "=&r" (ret), [rseq_cs] "=m" (rs->rseq_cs)
+    : [cpu_id] "m" (rs->cpu_id), [max_cpu] "i" (MALLOC_2D_PERCPU_MAX_CPU), 
+      [stride] "i" (sizeof(malloc_2d_percpu_t)), [stack] "r" (stack), [sig] "i" (MALLOC_2D_RSEQ_SIG)
+    : "rax", "rcx", "memory", "cc");
+#else
+  (void)rs; (void)percpu_class;
+#endif
+  return ret;
+}
+
+// Push an object onto the stack of the class on the current CPU; Returns 0 if the stack is full
+inline static int malloc_2d_percpu_push(struct rseq *rs, int percpu_class, void *obj) {
+  int ret = 0;
+#ifdef __x86_64__
+  malloc_2d_percpu_stack_t *stack = &malloc_2d->percpu[0].stacks[percpu_class];
+  __asm__ __volatile__(
+    ".pushsection __rseq_cs, \"aw\"\n\t"
+    ".balign 32\n\t"
+    "3:\n\t"
+    ".long 0x0, 0x0\n\t"
+    ".quad 1f, (2f - 1f), 4f\n\t"
+    ".popsection\n\t"
+    "9:\n\t"
+    "leaq 3b(%%rip), %%rax\n\t"
+    "movq %%rax, %[rseq_cs]\n\t"
+    "1:\n\t"
+    "movl %[cpu_id], %%eax\n\t"
+    "cmpl %[max_cpu], %%eax\n\t"
+    "jae 5f\n\t"
+    "imulq %[stride], %%rax\n\t"
+    "addq %[stack], %%rax\n\t"
+    "movq (%%rax), %%rcx\n\t"
+    "cmpq %[capacity], %%rcx\n\t"
+    "jae 5f\n\t"
+    "movq %[obj], 8(%%rax, %%rcx, 8)\n\t"
+    "incq %%rcx\n\t"
+    "movq %%rcx, (%%rax)\n\t"
+    "2:\n\t"
+    "movl $1, %[ret]\n\t"
+    ".pushsection __rseq_failure, \"ax\"\n\t"
+    ".byte 0x0f, 0xb9, 0x3d\n\t"
+    ".long %c[sig]\n\t"
+    "4:\n\t"
+    "jmp 9b\n\t"
+    ".popsection\n\t"
+    "5:\n\t"
+    : [ret] "+r" (ret), [rseq_cs] "=m" (rs->rseq_cs)
+    : [cpu_id] "m" (rs->cpu_id), [max_cpu] "i" (MALLOC_2D_PERCPU_MAX_CPU), 
+      [stride] "i" (sizeof(malloc_2d_percpu_t)), [stack] "r" (stack), [obj] "r" (obj), 
+      [capacity] "i" (MALLOC_2D_PERCPU_CAPACITY), [sig] "i" (MALLOC_2D_RSEQ_SIG)
+    : "rax", "rcx", "memory", "cc");
+#else
+  (void)rs; (void)percpu_class; (void)obj;
+#endif
+  return ret;
+}
+
+// Allocate from the stack of the current CPU, or refill it with a batch from the central sc
+void *malloc_2d_percpu_alloc(malloc_2d_sc_t *sc, int percpu_class) {
+  struct rseq *rs = malloc_2d_percpu_rseq_get();
+  void *ret;
+  if(rs != NULL && (ret = malloc_2d_percpu_pop(rs, percpu_class)) != NULL) {
+    return ret;
+  }
+  void *objs[MALLOC_2D_PERCPU_BATCH_SIZE];
+  int count = (rs != NULL) ? MALLOC_2D_PERCPU_BATCH_SIZE : 1;
+  malloc_2d_lock(&sc->lock);
+  malloc_2d_sc_obj_alloc_batch(sc, objs, count);
+  malloc_2d_unlock(&sc->lock);
+  malloc_2d_sc_obj_reverse(objs + 1, count - 1);
+  int i = 1;
+  while(i < count && malloc_2d_percpu_push(rs, percpu_class, objs[i]) == 1) {
+    i++;
+  }
+  // The stack was filled concurrently, or the CPU is not covered
+  if(i < count) {
+    malloc_2d_sc_obj_flush(sc, objs + i, count - i);
+  }
+  malloc_2d_stat_inc(&malloc_2d->stat->percpu_refill_count, 1UL);
+  return objs[0];
+}
+
+inline static uint64_t malloc_2d_percpu_hot_hash(uint64_t type_id, int sc_index) {
+  return (type_id ^ (type_id >> 29) ^ ((uint64_t)sc_index << 3)) * 0x9e3779b97f4a7c15UL;
+}
+
+// Allocate from the locked sc centrally, and promote it if it becomes hot. The sc is unlocked
+static void *malloc_2d_percpu_typed_alloc_sc(malloc_2d_sc_t *sc) {
+  uint64_t type_id = sc->type_id;
+  int sc_index = sc->sc_index;
+  uint64_t h = malloc_2d_percpu_hot_hash(type_id, sc_index);
+  void *ret = malloc_2d_sc_obj_alloc(sc);
+  if(sc->percpu_alloc_count < MALLOC_2D_PERCPU_HOT_THRESHOLD && 
+     ++sc->percpu_alloc_count == MALLOC_2D_PERCPU_HOT_THRESHOLD) {
+    malloc_2d_lock(&malloc_2d->percpu_lock);
+    if(malloc_2d->percpu_typed_count < MALLOC_2D_PERCPU_TYPED_COUNT) {
+      int percpu_class = MALLOC_2D_SC_COUNT + malloc_2d->percpu_typed_count++;
+      malloc_2d->percpu_typed[percpu_class - MALLOC_2D_SC_COUNT] = sc;
+      __atomic_store_n(&sc->percpu_class, percpu_class, __ATOMIC_RELEASE);
+      // There are more hot entries than typed classes, so the probe always ends
+      int i = 0;
+      while(malloc_2d->percpu_hot[(h + i) & (MALLOC_2D_PERCPU_HOT_HT_SIZE - 1)].percpu_class != 0) {
+        i++;
+      }
+      malloc_2d_percpu_hot_t *hot = &malloc_2d->percpu_hot[(h + i) & (MALLOC_2D_PERCPU_HOT_HT_SIZE - 1)];
+      hot->type_id = type_id;
+      hot->sc_index = sc_index;
+      __atomic_store_n(&hot->percpu_class, percpu_class, __ATOMIC_RELEASE);
+      malloc_2d_stat_inc(&malloc_2d->stat->percpu_promote_count, 1UL);
+    }
+    malloc_2d_unlock(&malloc_2d->percpu_lock);
+  }
+  malloc_2d_unlock(&sc->lock);
+  return ret;
+}
+
+// Typed allocation from a promoted sc does not touch the hash table. Other sc are allocated from 
+// centrally and promoted once they reach MALLOC_2D_PERCPU_HOT_THRESHOLD allocations
+void *malloc_2d_percpu_typed_alloc(uint64_t type_id, int sc_index) {
+  uint64_t h = malloc_2d_percpu_hot_hash(type_id, sc_index);
+  for(int i = 0;i < MALLOC_2D_PERCPU_HOT_HT_SIZE;i++) {
+    malloc_2d_percpu_hot_t *hot = &malloc_2d->percpu_hot[(h + i) & (MALLOC_2D_PERCPU_HOT_HT_SIZE - 1)];
+    int percpu_class = __atomic_load_n(&hot->percpu_class, __ATOMIC_ACQUIRE);
+    if(percpu_class == 0) {
+      break;
+    } else if(hot->type_id == type_id && hot->sc_index == sc_index) {
+      return malloc_2d_percpu_alloc(malloc_2d->percpu_typed[percpu_class - MALLOC_2D_SC_COUNT], percpu_class);
+    }
+  }
+  return malloc_2d_percpu_typed_alloc_sc(malloc_2d_get_sc_locked(type_id, sc_index));
+}
+
+// A promoted sc is never freed, so its key cannot change once its per-CPU class is seen, and the 
+// cached sc can be used without locking it
+void *malloc_2d_percpu_handle_alloc(malloc_2d_handle_t *handle) {
+  malloc_2d_sc_t *sc = __atomic_load_n(&handle->sc, __ATOMIC_RELAXED);
+  if(sc != NULL && __atomic_load_n(&handle->epoch, __ATOMIC_RELAXED) == malloc_2d_epoch) {
+    int percpu_class = __atomic_load_n(&sc->percpu_class, __ATOMIC_ACQUIRE);
+    if(percpu_class >= MALLOC_2D_SC_COUNT && sc->type_id == handle->type_id && 
+       sc->sc_index == handle->sc_index) {
+      return malloc_2d_percpu_alloc(sc, percpu_class);
+    }
+  }
+  return malloc_2d_percpu_typed_alloc_sc(malloc_2d_handle_get_sc_locked(handle));
+}
+
+void malloc_2d_percpu_dealloc(void *ptr) {
+  malloc_2d_arena_t *arena = malloc_2d_arena_get(ptr);
+  malloc_2d_sc_t *sc = arena->sc;
+  struct rseq *rs;
+  int percpu_class;
+  // Varlen, huge, meta and typed objects without a per-CPU class are freed centrally
+  if(malloc_2d_arena_get_type(arena) != MALLOC_2D_ARENA_FLAGS_OBJ || sc == NULL || 
+     (percpu_class = __atomic_load_n(&sc->percpu_class, __ATOMIC_RELAXED)) < 0 || 
+     (rs = malloc_2d_percpu_rseq_get()) == NULL) {
+    malloc_2d_arena_dealloc(ptr);
+    return;
+  }
+  if(malloc_2d_percpu_push(rs, percpu_class, ptr) == 1) {
+    return;
+  }
+  // Move a batch from the stack to the central sc; Nothing is popped if the CPU is not covered
+  void *objs[MALLOC_2D_PERCPU_BATCH_SIZE];
+  int count = 0;
+  void *obj;
+  while(count < MALLOC_2D_PERCPU_BATCH_SIZE && (obj = malloc_2d_percpu_pop(rs, percpu_class)) != NULL) {
+    objs[count++] = obj;
+  }
+  if(count != 0) {
+    malloc_2d_sc_obj_flush(sc, objs, count);
+    malloc_2d_stat_inc(&malloc_2d->stat->percpu_flush_count, 1UL);
+  }
+  if(count == 0 || malloc_2d_percpu_push(rs, percpu_class, ptr) == 0) {
+    malloc_2d_arena_dealloc(ptr);
+  }
   return;
 }
 
+#endif
+
 #ifdef MALLOC_2D_LIB
 
+#ifdef MALLOC_2D_LIB_CALL_SITE
+// Small objects are typed by their call site, or its group if a type map is loaded, given the 
+// return address and frame of the exported function. The caller must have initialized malloc_2d
+static void *malloc_2d_call_site_alloc(void *ret_addr, void *frame, size_t sz) {
+  if(sz <= MALLOC_2D_CALL_SITE_MAX_SIZE) {
+    uint64_t type_id = malloc_2d_call_site_get_type(ret_addr, frame);
+    if(type_id != 0UL) {
+      type_id = malloc_2d_type_map_get(type_id, sz);
+    }
+    if(type_id != 0UL) {
+      return malloc_2d_typed_alloc(type_id, sz);
+    }
+  }
+  return malloc_2d_alloc(sz);
+}
+#endif
+
 extern "C" {
 
 void __attribute__((constructor)) init() {
   if(malloc_2d == NULL) {
     malloc_2d_init_static();
   }
+#ifdef MALLOC_2D_TYPE_MAP_PATH
+  if(malloc_2d_type_map_load(MALLOC_2D_TYPE_MAP_PATH) < 0) {
+    fprintf(stderr, "[malloc_2d] Cannot load type map %s\n", MALLOC_2D_TYPE_MAP_PATH);
+  }
+#endif
   return;
 }
 
@@ -987,6 +3935,13 @@ void __attribute__((destructor)) fini() {
   //if(malloc_2d != NULL) {
   //  malloc_2d_free_static();
   //}
+#ifdef MALLOC_2D_TYPE_PROFILE
+  if(malloc_2d != NULL) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.%d", MALLOC_2D_PROFILE_PATH, (int)getpid());
+    malloc_2d_profile_dump(path);
+  }
+#endif
   return;
 }
 
@@ -994,64 +3949,119 @@ void *malloc(size_t sz) {
   if(malloc_2d == NULL) {
     malloc_2d_init_static();
   }
+#ifdef MALLOC_2D_LIB_CALL_SITE
+  void *ptr = malloc_2d_call_site_alloc(__builtin_return_address(0), __builtin_frame_address(0), sz);
+#else
   void *ptr = malloc_2d_alloc(sz);
+#endif
   //fprintf(stderr, "malloc sz %lu\n", sz);
   return ptr;
 }
 
 void *calloc(size_t sz, size_t count) {
   //fprintf(stderr, "calloc sz %lu count %lu\n", sz, count);
-  void *ptr = malloc_2d_alloc(sz * count);
-  memset(ptr, 0x00, sz * count);
+  if(malloc_2d == NULL) {
+    malloc_2d_init_static();
+  }
+#ifdef MALLOC_2D_LIB_CALL_SITE
+  // Typed objects are cleared, since whether they are fresh is only tracked for untyped ones
+  uint64_t total;
+  if(__builtin_mul_overflow(sz, count, &total) == false && total <= MALLOC_2D_CALL_SITE_MAX_SIZE) {
+    void *ptr = malloc_2d_call_site_alloc(__builtin_return_address(0), __builtin_frame_address(0), total);
+    memset(ptr, 0x00, total);
+    return ptr;
+  }
+#endif
+  void *ptr = malloc_2d_calloc(sz, count);
+  if(ptr == NULL) {
+    errno = ENOMEM;
+  }
   return ptr;
 }
 
+// Moved objects keep their type, so only new ones are typed by the call site
 void *realloc(void *old, size_t sz) {
   if(old == NULL) {
+    if(malloc_2d == NULL) {
+      malloc_2d_init_static();
+    }
+#ifdef MALLOC_2D_LIB_CALL_SITE
+    return malloc_2d_call_site_alloc(__builtin_return_address(0), __builtin_frame_address(0), sz);
+#else
     return malloc_2d_alloc(sz);
+#endif
+  } else if(malloc_2d == NULL || malloc_2d_page_map_get(old) == NULL) {
+    // As with free(), pointers not allocated by malloc_2d are left alone. Their size is unknown, so 
+    // they cannot be moved, and the caller keeps the old object
+    if(malloc_2d != NULL) {
+      malloc_2d_stat_inc(&malloc_2d->stat->foreign_realloc_count, 1UL);
+    }
+    errno = ENOMEM;
+    return NULL;
   } else if(sz == 0UL) {
-    malloc_2d_dealloc(old);
+    free(old);
     return NULL;
   }
-  uint64_t old_sz = malloc_2d_arena_get_size(old);
-  //fprintf(stderr, "realloc old %p sz %lu old sz %lu\n", old, sz, old_sz);
-  if(sz == old_sz) {
-    return old;
-  } 
-  void *ptr = malloc_2d_alloc(sz);
-  memcpy(ptr, old, (sz > old_sz) ? old_sz : sz);
-  malloc_2d_dealloc(old);
-  return ptr;
+  //fprintf(stderr, "realloc old %p sz %lu\n", old, sz);
+  return malloc_2d_realloc(old, sz);
 }
 
+// Pointers not allocated by malloc_2d, e.g., from before the library was loaded, are ignored
 void free(void *ptr) {
   //fprintf(stderr, "free ptr %p\n", ptr);
+  if(ptr == NULL) {
+    return;
+  } else if(malloc_2d == NULL || malloc_2d_page_map_get(ptr) == NULL) {
+    if(malloc_2d != NULL) {
+      malloc_2d_stat_inc(&malloc_2d->stat->foreign_free_count, 1UL);
+    }
+    return;
+  }
   malloc_2d_dealloc(ptr);
   return;
 }
 
 void *aligned_alloc(size_t alignment, size_t size) {
-  error_exit("Not implemented\n"); (void)alignment; (void)size;
+  if(malloc_2d == NULL) {
+    malloc_2d_init_static();
+  }
+  void *ptr = malloc_2d_aligned_alloc(alignment, size);
+  if(ptr == NULL) {
+    errno = EINVAL;
+  }
+  return ptr;
 }
 
+// Like glibc, alignments that are not a power of two are rounded up
 void *memalign(size_t alignment, size_t size) {
-  error_exit("Not implemented\n"); (void)alignment; (void)size;
+  if(alignment > 1UL && (alignment & (alignment - 1)) != 0UL) {
+    alignment = 1UL << (64 - __builtin_clzl(alignment));
+  }
+  return aligned_alloc(alignment == 0UL ? 1UL : alignment, size);
 }
 
 int posix_memalign(void **memptr, size_t alignment, size_t size) {
-  error_exit("Not implemented\n"); (void)memptr; (void)alignment; (void)size;
+  if((alignment % sizeof(void *)) != 0UL || (alignment & (alignment - 1)) != 0UL || alignment == 0UL) {
+    return EINVAL;
+  }
+  *memptr = aligned_alloc(alignment, size);
+  return 0;
 }
 
 void *valloc(size_t size) {
-  error_exit("Not implemented\n"); (void)size;
+  return aligned_alloc(MALLOC_2D_PAGE_SIZE, size);
 }
 
 void *pvalloc(size_t size) {
-  error_exit("Not implemented\n"); (void)size;
+  size = (size + MALLOC_2D_PAGE_SIZE - 1) & ~(MALLOC_2D_PAGE_SIZE - 1);
+  return aligned_alloc(MALLOC_2D_PAGE_SIZE, size == 0UL ? MALLOC_2D_PAGE_SIZE : size);
 }
 
 size_t malloc_usable_size(void *ptr) {
-  error_exit("Not implemented\n"); (void)ptr;
+  if(ptr == NULL || malloc_2d == NULL || malloc_2d_page_map_get(ptr) == NULL) {
+    return 0UL;
+  }
+  return malloc_2d_arena_get_size(ptr);
 }
 
 }
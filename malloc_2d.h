@@ -6,10 +6,38 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <errno.h>
+// Per-CPU caches are a front end of the thread-safe allocator
+#if defined(MALLOC_2D_PERCPU) && !defined(MALLOC_2D_THREAD_SAFE)
+#define MALLOC_2D_THREAD_SAFE
+#endif
+#ifdef MALLOC_2D_THREAD_SAFE
+#include <pthread.h>
+#include <sched.h>
+#elif defined(MALLOC_2D_LIB_CALL_SITE)
+// The stack bounds of the thread limit the frame walk
+#include <pthread.h>
+#endif
+#ifdef MALLOC_2D_PERCPU
+#include <sys/syscall.h>
+#include <linux/rseq.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <link.h>
+// Bitmap slot allocation keeps free slots in the occupancy bitmap
+#if defined(MALLOC_2D_ARENA_BITMAP_ALLOC) && !defined(MALLOC_2D_ARENA_BITMAP)
+#define MALLOC_2D_ARENA_BITMAP
+#endif
 
 // Error reporting and system call assertion
 #define SYSEXPECT(expr) do { if(!(expr)) { perror(__func__); assert(0); exit(1); } } while(0)
@@ -25,20 +53,130 @@
 #define MALLOC_2D_PAGE_SIZE 4096UL
 // Number of pages in an arena
 #define MALLOC_2D_ARENA_SIZE 16
-// Maximum size of objects
+// Bytes of virtual addresses reserved at a time for arenas; Must be a multiple of 64 arenas
+#define MALLOC_2D_SLAB_REGION_SIZE  (1UL << 30)
+// Maximum number of reserved regions
+#define MALLOC_2D_SLAB_REGION_MAX   256
+// Maximum number of free arenas cached with their pages; The excess is released right away
+#define MALLOC_2D_SLAB_DIRTY_MAX    256
+// Cached arenas are aged every this many arena allocations and frees, or this many nanoseconds
+#define MALLOC_2D_SLAB_DECAY_OPS    4096
+#define MALLOC_2D_SLAB_DECAY_NS     1000000000UL
+// Freed huge objects are cached for reuse, up to this many mappings and pages in total; Cached 
+// mappings are unmapped after MALLOC_2D_SLAB_DECAY_NS
+#define MALLOC_2D_HUGE_CACHE_COUNT     16
+#define MALLOC_2D_HUGE_CACHE_MAX_PAGES 16384
+// Huge objects from the cache at least this large are cleared with MADV_DONTNEED instead of memset
+#define MALLOC_2D_CALLOC_MADVISE_SIZE  (1UL << 20)
+// Number of pages covered by a leaf of the page map is 2^MALLOC_2D_PAGE_MAP_LEAF_BITS
+#define MALLOC_2D_PAGE_MAP_LEAF_BITS   18
+// Maximum size of small objects, whose size classes are MALLOC_2D_SC_INCREMENT bytes apart
 #define MALLOC_2D_OBJ_MAX_SIZE    512
+// Maximum size of medium objects, whose size classes are spaced geometrically, i.e., 
+// 2^MALLOC_2D_MEDIUM_STEP_LOG2 classes per power of two above MALLOC_2D_OBJ_MAX_SIZE
+#define MALLOC_2D_MEDIUM_MAX_SIZE   16384
+#define MALLOC_2D_MEDIUM_STEP_LOG2  2
+// Maximum number of chunks of a medium arena; The number with the least waste is used
+#define MALLOC_2D_MEDIUM_ARENA_MAX_CHUNK 4
+// Bytes at the start of an arena in the slab taken by its header. With MALLOC_2D_ARENA_SIDE_TABLE 
+// headers are kept in a table of the slab region instead, such that they do not all map to the 
+// same cache sets, and the arena starts with objects
+#ifdef MALLOC_2D_ARENA_SIDE_TABLE
+#define MALLOC_2D_ARENA_HEADER_SIZE 0UL
+#else
+#define MALLOC_2D_ARENA_HEADER_SIZE sizeof(malloc_2d_arena_t)
+#endif
 // Alignment of varlen block
 #define MALLOC_2D_VARLEN_ALIGNMENT  8
 // Maximum size of single varlen object (including varlen header)
-#define MALLOC_2D_VARLEN_MAX_SIZE   ((MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE) - sizeof(malloc_2d_arena_t))
+#define MALLOC_2D_VARLEN_MAX_SIZE   ((MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE) - MALLOC_2D_ARENA_HEADER_SIZE)
 // Minimum size of single varlen object (including varlen header)
 #define MALLOC_2D_VARLEN_MIN_SIZE   (MALLOC_2D_OBJ_MAX_SIZE + MALLOC_2D_VARLEN_ALIGNMENT + sizeof(malloc_2d_arena_varlen_header_t))
+// Free varlen blocks are indexed by the power of two of their size (first level), starting from 
+// 2^MALLOC_2D_VARLEN_FL_SHIFT, and then by MALLOC_2D_VARLEN_SL_COUNT equal ranges within it (second level)
+#define MALLOC_2D_VARLEN_FL_SHIFT   9
+// A block of a whole arena needs one more level if the header is not in the arena
+#ifdef MALLOC_2D_ARENA_SIDE_TABLE
+#define MALLOC_2D_VARLEN_FL_COUNT   8
+#else
+#define MALLOC_2D_VARLEN_FL_COUNT   7
+#endif
+#define MALLOC_2D_VARLEN_SL_LOG2    3
+#define MALLOC_2D_VARLEN_SL_COUNT   (1 << MALLOC_2D_VARLEN_SL_LOG2)
 // Size class increment
 #define MALLOC_2D_SC_INCREMENT 8
-// Size class count
-#define MALLOC_2D_SC_COUNT     (MALLOC_2D_OBJ_MAX_SIZE / MALLOC_2D_SC_INCREMENT)
-// Size class hash table init size
-#define MALLOC_2D_SC_HT_INIT_SIZE    4096
+// Size class count; Small classes come first, followed by medium classes
+#define MALLOC_2D_SC_SMALL_COUNT  (MALLOC_2D_OBJ_MAX_SIZE / MALLOC_2D_SC_INCREMENT)
+#define MALLOC_2D_SC_MEDIUM_COUNT \
+  ((__builtin_ctz(MALLOC_2D_MEDIUM_MAX_SIZE) - __builtin_ctz(MALLOC_2D_OBJ_MAX_SIZE)) << MALLOC_2D_MEDIUM_STEP_LOG2)
+#define MALLOC_2D_SC_COUNT     (MALLOC_2D_SC_SMALL_COUNT + MALLOC_2D_SC_MEDIUM_COUNT)
+// Size class hash table init size (number of buckets); Must be a power of 2
+#define MALLOC_2D_SC_HT_INIT_SIZE    256
+// Number of sc per hash table bucket, such that a bucket fits into a cache line
+#define MALLOC_2D_SC_HT_BUCKET_SIZE  3
+// The hash table is resized when it is fuller than this percentage
+#define MALLOC_2D_SC_HT_MAX_LOAD     75
+// Number of buckets migrated to the new table on each insertion during a resize
+#define MALLOC_2D_SC_HT_MIGRATE_STEP 8
+// Number of buckets checked for idle sc on each insertion
+#define MALLOC_2D_SC_HT_RECLAIM_STEP 8
+// Typed sc without live objects are kept for this many nanoseconds before they are reclaimed
+#ifndef MALLOC_2D_SC_IDLE_NS
+#define MALLOC_2D_SC_IDLE_NS         1000000000UL
+#endif
+// Object arenas with free slots are binned by the fraction of slots in use, and allocation moves on 
+// to an arena of the fullest non-empty bin; 1 means a single list in LIFO order
+#ifndef MALLOC_2D_SC_BIN_COUNT
+#define MALLOC_2D_SC_BIN_COUNT       4
+#endif
+// Number of objects a per-thread magazine can hold (thread-safe mode only)
+#define MALLOC_2D_TCACHE_MAG_SIZE    32
+// Number of objects moved between a magazine and the central sc on refill and flush
+#define MALLOC_2D_TCACHE_BATCH_SIZE  16
+// Number of typed magazines per thread; Must be a power of 2
+#define MALLOC_2D_TCACHE_TYPED_COUNT 256
+// Associativity of typed magazines; Must be a power of 2
+#define MALLOC_2D_TCACHE_TYPED_WAYS  4
+// Number of spins on a contended lock before yielding the CPU
+#define MALLOC_2D_LOCK_SPIN_COUNT    64
+// Per-CPU caches only serve CPUs with a lower ID; Others use the central sc (per-CPU mode only)
+#define MALLOC_2D_PERCPU_MAX_CPU       256
+// Number of objects each per-CPU stack can hold
+#define MALLOC_2D_PERCPU_CAPACITY      32
+// Number of objects moved between a per-CPU stack and the central sc on refill and flush
+#define MALLOC_2D_PERCPU_BATCH_SIZE    16
+// Number of typed sc that can be promoted to per-CPU caching
+#define MALLOC_2D_PERCPU_TYPED_COUNT   256
+// Number of central allocations from a typed sc before it is promoted
+#define MALLOC_2D_PERCPU_HOT_THRESHOLD 1024
+// Number of entries of the hot typed sc lookup table; Must be a power of 2
+#define MALLOC_2D_PERCPU_HOT_HT_SIZE   512
+// Signature preceding rseq abort handlers; Must match the one used on registration
+#define MALLOC_2D_RSEQ_SIG             0x53053053
+// Live objects are prefetched this many slots ahead when iterating over an arena
+#define MALLOC_2D_FOR_EACH_PREFETCH    8
+// Number of arenas of a size class that iteration sorts without allocating memory
+#define MALLOC_2D_FOR_EACH_STACK_COUNT 256
+// Objects from the preloaded malloc() are typed by the hash of this many return addresses, not 
+// counting those in wrappers such as operator new (library with MALLOC_2D_LIB_CALL_SITE only)
+#ifndef MALLOC_2D_CALL_SITE_DEPTH
+#define MALLOC_2D_CALL_SITE_DEPTH      1
+#endif
+// Frames examined at most, including those of wrappers
+#define MALLOC_2D_CALL_SITE_MAX_FRAMES (MALLOC_2D_CALL_SITE_DEPTH + 4)
+// Larger objects from the preloaded malloc() stay untyped
+#define MALLOC_2D_CALL_SITE_MAX_SIZE   MALLOC_2D_OBJ_MAX_SIZE
+// Number of entries of the cache of return addresses known to be in a wrapper or not; Must be a 
+// power of 2
+#define MALLOC_2D_CALL_SITE_CACHE_SIZE 4096
+// Number of entries of the type profile table (MALLOC_2D_TYPE_PROFILE only); Must be a power of 2
+#define MALLOC_2D_PROFILE_TABLE_SIZE   16384
+// The library writes its profile on exit to this path followed by "." and the process ID
+#ifndef MALLOC_2D_PROFILE_PATH
+#define MALLOC_2D_PROFILE_PATH         "malloc_2d.profile"
+#endif
+// The library loads a type map on startup from MALLOC_2D_TYPE_MAP_PATH if it is defined, e.g., with
+// -DMALLOC_2D_TYPE_MAP_PATH=\"x.map\"
 
 inline static void *MALLOC_2D_PTR_ADD(void *ptr, int size) {
   return (void *)((uint8_t *)ptr + size);
@@ -50,13 +188,103 @@ inline static int MALLOC_2D_PTR_IS_GEQ(void *ptr1, void *ptr2) {
   return (((uint64_t)ptr1) >= ((uint64_t)ptr2));
 }
 
+// Nanoseconds of the coarse monotonic clock, which is read from the vDSO without a system call
+inline static uint64_t malloc_2d_get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+// Test-and-test-and-set spin lock protecting shared allocator state. In the single-threaded build 
+// (MALLOC_2D_THREAD_SAFE not defined) all lock operations compile to nothing
+typedef int malloc_2d_lock_t;
+
+inline static void malloc_2d_lock_init(malloc_2d_lock_t *lock) {
+  *lock = 0;
+}
+inline static void malloc_2d_lock(malloc_2d_lock_t *lock) {
+#ifdef MALLOC_2D_THREAD_SAFE
+  int spin = 0;
+  while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+    while(__atomic_load_n(lock, __ATOMIC_RELAXED) != 0) {
+      if(++spin == MALLOC_2D_LOCK_SPIN_COUNT) {
+        spin = 0;
+        sched_yield();
+      }
+    }
+  }
+#else
+  (void)lock;
+#endif
+}
+// Returns 1 if the lock is acquired, 0 if it is held by another thread
+inline static int malloc_2d_trylock(malloc_2d_lock_t *lock) {
+#ifdef MALLOC_2D_THREAD_SAFE
+  return __atomic_load_n(lock, __ATOMIC_RELAXED) == 0 && __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) == 0;
+#else
+  (void)lock;
+  return 1;
+#endif
+}
+inline static void malloc_2d_unlock(malloc_2d_lock_t *lock) {
+#ifdef MALLOC_2D_THREAD_SAFE
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#else
+  (void)lock;
+#endif
+}
+
 // Allocate virtual addresses used as heap memory
 void *malloc_2d_alloc_os_page_unaligned(int count);
-void *malloc_2d_alloc_os_page(int count, void **actual_base);
 
 // Free virtual addresses back to the OS
 void malloc_2d_free_os_page(void *ptr, int count);
 
+//
+//* malloc_2d_slab_t
+//
+
+// Arenas are carved from large reserved regions of virtual addresses in units of chunks, i.e., 
+// MALLOC_2D_ARENA_SIZE pages aligned to their size, such that creating and freeing an arena 
+// does not need a system call. Arenas of medium objects span several chunks, and the arena of 
+// an object is found through the page map. Freed chunks keep their pages and serve as a cache of 
+// empty arenas for any sc. They decay in two steps: Cached chunks are released with MADV_FREE on 
+// the next decay, and with MADV_DONTNEED on the one after. Regions that become entirely free and 
+// released are unmapped, except the first one
+#define MALLOC_2D_SLAB_CHUNK_SIZE  (MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE)
+#define MALLOC_2D_SLAB_CHUNK_COUNT ((int)(MALLOC_2D_SLAB_REGION_SIZE / MALLOC_2D_SLAB_CHUNK_SIZE))
+#define MALLOC_2D_SLAB_WORD_COUNT  (MALLOC_2D_SLAB_CHUNK_COUNT / 64)
+// Regions are looked up by address in a table covering user space addresses
+#define MALLOC_2D_SLAB_VA_BITS     47
+#define MALLOC_2D_SLAB_TABLE_SIZE  ((1UL << MALLOC_2D_SLAB_VA_BITS) / MALLOC_2D_SLAB_REGION_SIZE)
+
+typedef struct {
+  // Aligned to the region size
+  void *base;
+  int free_count;
+  // All words of free_map before this one are zero
+  int hint;
+  // One bit per chunk, set if the chunk is free
+  uint64_t free_map[MALLOC_2D_SLAB_WORD_COUNT];
+  // Set if the chunk is free and has been used since its pages were last released to the OS
+  uint64_t dirty_map[MALLOC_2D_SLAB_WORD_COUNT];
+  // Set if the chunk is free and its pages were released with MADV_FREE, i.e., they may be kept
+  uint64_t aged_map[MALLOC_2D_SLAB_WORD_COUNT];
+#ifdef MALLOC_2D_ARENA_SIDE_TABLE
+  // Headers of arenas indexed by their first chunk; Allocated after the region object
+  struct malloc_2d_arena_struct_t *arenas;
+#endif
+} malloc_2d_slab_region_t;
+
+// Allocate "count" contiguous chunks. *is_zero is set to 1 if none of them has been used since 
+// the pages were (re)mapped, i.e., the memory is zero-initialized
+void *malloc_2d_slab_alloc(int count, int *is_zero);
+void malloc_2d_slab_free(void *ptr, int count);
+// Release pages of all cached chunks to the OS. The caller must hold the slab lock
+void malloc_2d_slab_purge();
+// Age cached chunks by one step. The caller must hold the slab lock
+void malloc_2d_slab_decay();
+
 typedef struct {
   uint64_t malloc_count;
   uint64_t free_count;
@@ -73,15 +301,183 @@ typedef struct {
   uint64_t arena_curr_to_full_count;
   uint64_t arena_full_to_free_count;
   uint64_t arena_free_to_curr_count;
+  // Object arenas moved to a less occupied bin, and those freed after their last object was freed
+  uint64_t arena_bin_move_count;
+  uint64_t arena_drain_count;
+  // Thread cache stats
+  uint64_t tcache_init_count;
+  uint64_t tcache_refill_count;
+  uint64_t tcache_flush_count;
+  // Pushes onto arena remote free lists, and remote lists reclaimed by the sc lock holder
+  uint64_t remote_free_count;
+  uint64_t remote_reclaim_count;
+  // Pages of free arenas released to the OS
+  uint64_t madvise_count;
+  uint64_t madvise_page_count;
+  // Arenas allocated from cached chunks, and decay steps
+  uint64_t slab_reuse_count;
+  uint64_t slab_decay_count;
+  // Hash table resizes, and typed sc lookups that acquired the hash table lock
+  uint64_t sc_ht_resize_count;
+  uint64_t sc_ht_locked_count;
+  // Explicit maintenance passes
+  uint64_t maintain_count;
+  // Per-CPU cache stats
+  uint64_t percpu_refill_count;
+  uint64_t percpu_flush_count;
+  uint64_t percpu_promote_count;
+  // Reallocations that did not move the object, and that did
+  uint64_t realloc_in_place_count;
+  uint64_t realloc_move_count;
+  // Zero-initialized allocations that did not clear memory
+  uint64_t calloc_zero_count;
+  // Huge objects mapped from the cache, and resized with mremap()
+  uint64_t huge_cache_hit_count;
+  uint64_t huge_mremap_count;
+  // Size classes released as a whole, and the live objects freed by them
+  uint64_t sc_release_count;
+  uint64_t sc_release_obj_count;
+  // Pointers passed to free() that were not allocated by malloc_2d (library only)
+  uint64_t foreign_free_count;
+  // Such pointers passed to realloc(), which fails without touching them (library only)
+  uint64_t foreign_realloc_count;
+  // Return addresses classified through the dynamic symbol table (library only)
+  uint64_t call_site_miss_count;
+  // Allocations of types that did not fit into the profile table
+  uint64_t profile_drop_count;
 } malloc_2d_stat_t;
 
+// Stat counters are shared by all threads and therefore updated atomically in thread-safe mode
+inline static void malloc_2d_stat_inc(uint64_t *counter, uint64_t value) {
+#ifdef MALLOC_2D_THREAD_SAFE
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+#else
+  *counter += value;
+#endif
+}
+
 struct malloc_2d_sc_struct_t;
+struct malloc_2d_arena_struct_t;
+
+//
+//* malloc_2d_huge_t
+//
+
+// Huge objects are mapped directly and are page-aligned. Their arena header is kept out of band in 
+// an object of a type-less sc, and is found through the page map. Unmapped objects are cached, such 
+// that a huge object that is freed and allocated again does not pay for the system calls and page 
+// faults. All functions acquire malloc_2d->huge_lock, which is never held while acquiring another lock
+
+typedef struct {
+  void *ptr;
+  int page_count;
+  // Time at which the mapping was cached
+  uint64_t time;
+} malloc_2d_huge_cache_t;
+
+// Map "page_count" pages, reusing the smallest cached mapping that fits. Mappings aligned to more 
+// than a page are never cached. *is_zero is set to 1 if the pages are freshly mapped, i.e., 
+// zero-initialized
+void *malloc_2d_huge_map(int page_count, uint64_t alignment, int *is_zero);
+// Cache the mapping, or unmap it if it is too large
+void malloc_2d_huge_unmap(void *ptr, int page_count);
+// Unmap cached mappings older than MALLOC_2D_SLAB_DECAY_NS, or all of them if "all" is 1
+void malloc_2d_huge_decay(int all);
+
+//
+//* malloc_2d_page_map_t
+//
+
+// Two-level radix map from the page of an address to the header of the arena that owns it, such 
+// that pointers are validated and mapped to their arena in constant time without a lock. All pages 
+// of slab arenas are mapped, those after the first one with MALLOC_2D_PAGE_MAP_INTERIOR set, and 
+// only the first page of huge objects. Leaves are mapped on demand, and only their pages that cover 
+// arenas are touched
+#define MALLOC_2D_PAGE_MAP_LEAF_SIZE (1UL << MALLOC_2D_PAGE_MAP_LEAF_BITS)
+#define MALLOC_2D_PAGE_MAP_ROOT_SIZE \
+  ((1UL << MALLOC_2D_SLAB_VA_BITS) / MALLOC_2D_PAGE_SIZE / MALLOC_2D_PAGE_MAP_LEAF_SIZE)
+#define MALLOC_2D_PAGE_MAP_INTERIOR  0x1UL
+
+// Map "page_count" pages starting at ptr to the arena, or unmap them if arena is NULL. The pages 
+// must not be mapped by another thread meanwhile
+void malloc_2d_page_map_set(void *ptr, int page_count, struct malloc_2d_arena_struct_t *arena);
+typedef void (*malloc_2d_arena_func_t)(struct malloc_2d_arena_struct_t *arena, void *arg);
+// Call func on every arena in address order of their first page, reading only the map. Arenas must 
+// not be created or freed meanwhile. Returns the number of arenas
+uint64_t malloc_2d_page_map_for_each(malloc_2d_arena_func_t func, void *arg);
+
+//
+//* malloc_2d_profile_t
+//
+
+// With MALLOC_2D_TYPE_PROFILE, typed allocations and frees of typed objects are counted per type 
+// ID of the sc, i.e., after implicit type IDs are mapped to their group. Entries are kept in an 
+// open-addressing table protected by malloc_2d->profile_lock, which is never held while acquiring 
+// another lock. Types that do not fit into the table are not recorded
+#define MALLOC_2D_PROFILE_SIZE_BUCKETS 16
+
+typedef struct {
+  // 0 if the entry is empty
+  uint64_t type_id;
+  uint64_t alloc_count;
+  uint64_t free_count;
+  uint64_t max_live_count;
+  uint64_t size_sum;
+  // Integral of the live count over time, such that the mean lifetime is live_ns / alloc_count
+  uint64_t live_ns;
+  uint64_t update_time;
+  // Type most often allocated right after this one by the same thread, by majority vote
+  uint64_t next_type_id;
+  int64_t next_votes;
+  // Allocations by floor(log2(size)); The last bucket also counts all larger ones
+  uint64_t size_hist[MALLOC_2D_PROFILE_SIZE_BUCKETS];
+} malloc_2d_profile_t;
+
+#define MALLOC_2D_PROFILE_PAGE_COUNT \
+  ((int)((sizeof(malloc_2d_profile_t) * MALLOC_2D_PROFILE_TABLE_SIZE + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE))
+
+void malloc_2d_profile_alloc(uint64_t type_id, uint64_t sz, int count);
+void malloc_2d_profile_dealloc(void *ptr);
+void malloc_2d_profile_release(uint64_t type_id, uint64_t count);
+// Write one line per type ID to the file. Type IDs that are code addresses are written as the 
+// file name of the module and the offset, e.g., "[exe]+0x1a2b" or "libfoo.so+0x1a2b", such that 
+// they survive address space randomization. Returns the number of types, or -1 on error
+int malloc_2d_profile_dump(const char *path);
+
+//
+//* malloc_2d_type_map_t
+//
+
+// A type map merges implicit type IDs (those of malloc_2d_typed_alloc_implicit() and preloaded 
+// call sites) into groups, and may split one by object size. Each line of the map file is 
+// "<type ID> <group> [max size]", where the type ID is written as in a profile, and objects of the 
+// type up to the max size (or of any size) go to the group; Lines of a split type are given in 
+// increasing max size. "* <group>" assigns types not in the map; Without it they keep their own. 
+// Group 0 means untyped, and other groups get type IDs from MALLOC_2D_TYPE_GROUP_BASE
+#define MALLOC_2D_TYPE_GROUP_BASE    (0xFFFFUL << 48)
+#define MALLOC_2D_TYPE_MAP_SPLIT_MAX 4
+
+typedef struct {
+  // 0 if the entry is empty
+  uint64_t type_id;
+  int split_count;
+  uint64_t max_size[MALLOC_2D_TYPE_MAP_SPLIT_MAX];
+  uint64_t group_id[MALLOC_2D_TYPE_MAP_SPLIT_MAX];
+} malloc_2d_type_map_entry_t;
+
+// Load the map, resolving module offsets against the modules loaded at this time. Must be called 
+// at most once, before implicit type IDs are allocated. Returns the number of entries, or -1 on error
+int malloc_2d_type_map_load(const char *path);
+// Returns the type ID an implicit type ID is allocated with, 0 meaning untyped
+uint64_t malloc_2d_type_map_get(uint64_t type_id, uint64_t sz);
 
 // Whether the arena is varlen arena
 #define MALLOC_2D_ARENA_FLAGS_OBJ          0x00000000
 #define MALLOC_2D_ARENA_FLAGS_VARLEN       0x00000001
 #define MALLOC_2D_ARENA_FLAGS_HUGE         0x00000002
 #define MALLOC_2D_ARENA_FLAGS_TYPE_MASK    0x00000003
+// Set if memory after the bump pointer (object arena), or the object (huge arena) is zero-initialized
+#define MALLOC_2D_ARENA_FLAGS_ZERO         0x00000004
 
 // Object header for varlen blocks
 typedef struct malloc_2d_arena_varlen_header_struct_t {
@@ -102,8 +498,27 @@ inline static int malloc_2d_arena_varlen_header_is_used(malloc_2d_arena_varlen_h
   return header->next_free == (malloc_2d_arena_varlen_header_t *)1;
 }
 
+// Segregated free lists of all varlen arenas of a size class (two-level segregated fit). A bit is set 
+// in fl_bitmap if any list of that first level is non-empty, and in sl_bitmap if the list is 
+// non-empty, such that a fitting block is found with two bit scans
+typedef struct {
+  uint32_t fl_bitmap;
+  uint32_t sl_bitmap[MALLOC_2D_VARLEN_FL_COUNT];
+  malloc_2d_arena_varlen_header_t *lists[MALLOC_2D_VARLEN_FL_COUNT][MALLOC_2D_VARLEN_SL_COUNT];
+} malloc_2d_varlen_index_t;
+
+void malloc_2d_varlen_index_init(malloc_2d_varlen_index_t *index);
+// Insert and remove a free block; The size of the block must not change while it is indexed
+void malloc_2d_varlen_index_insert(malloc_2d_varlen_index_t *index, malloc_2d_arena_varlen_header_t *header);
+void malloc_2d_varlen_index_remove(malloc_2d_varlen_index_t *index, malloc_2d_arena_varlen_header_t *header);
+// Returns a free block of at least "size" bytes (including the header) in constant time; NULL if 
+// there is none. The block is not removed
+malloc_2d_arena_varlen_header_t *malloc_2d_varlen_index_find(malloc_2d_varlen_index_t *index, int size);
+
 typedef struct malloc_2d_arena_struct_t {
-  // This stores the actual base that should be munmap'ed
+  // This stores the object of a huge arena, whose header is out of band. Other arenas are 
+  // allocated from the slab, and the base is their first chunk. The header is at the base unless 
+  // MALLOC_2D_ARENA_SIDE_TABLE is defined
   void *base; 
   // Points to the size class
   struct malloc_2d_sc_struct_t *sc;
@@ -118,49 +533,142 @@ typedef struct malloc_2d_arena_struct_t {
       int free_size;
       int max_size;
     };
-    // This is used for huge arena
+    // This is used for huge arena, indicating the number of pages mapped for the object
     struct {
-      // Page count of the body. Used for computing data size
       int page_count;
-      // Actual pages mmap'ed. Used for munmap
-      int alloc_page_count;
     };
   };
   int flags;
-  // Points to the next free object in the arena
+  // Size of objects (object arena only)
+  int obj_size;
+  // Points to the next free object in the arena; Not used with MALLOC_2D_ARENA_BITMAP_ALLOC
   void *free_list;
+  // Objects at and after this address have never been allocated, and are carved only when the free 
+  // list is empty, such that pages are touched as objects are handed out (object arena only). With 
+  // bitmap slot allocation, this is the end of the highest slot ever allocated
+  void *bump;
   // Chain arenas into a free list; Full arenas are not in any list
   struct malloc_2d_arena_struct_t *prev;
   struct malloc_2d_arena_struct_t *next;
+#ifdef MALLOC_2D_THREAD_SAFE
+  // Objects freed by threads that could not acquire the sc lock (object arena only). Pushed with 
+  // CAS and taken as a whole by the thread holding the sc lock
+  void *remote_free_list;
+  // Chains arenas with a non-empty remote free list into sc->remote_arenas
+  struct malloc_2d_arena_struct_t *remote_next;
+#endif
+#ifdef MALLOC_2D_ARENA_BITMAP
+  // Offset of the first object, and 2^32 / obj_size rounded up, such that the slot of an object is 
+  // computed with a multiplication (object arena only)
+  int obj_offset;
+  uint32_t obj_recip;
+#endif
+#ifdef MALLOC_2D_ARENA_BITMAP_ALLOC
+  // No bitmap word before this one has a free slot
+  int bitmap_hint;
+#endif
 } malloc_2d_arena_t;
 
+static_assert(MALLOC_2D_VARLEN_MIN_SIZE >= (1UL << MALLOC_2D_VARLEN_FL_SHIFT) && 
+              MALLOC_2D_VARLEN_MAX_SIZE < (1UL << (MALLOC_2D_VARLEN_FL_SHIFT + MALLOC_2D_VARLEN_FL_COUNT)), 
+              "Varlen block sizes must be covered by the first level of the index");
+
 // Initialize an arena, with optional argument specifying the number of pages
 // obj_size may not be multiple of page size
 malloc_2d_arena_t *malloc_2d_arena_obj_init(int obj_size);
+// Number of chunks of an object arena; Arenas of medium objects may have more than one
+int malloc_2d_arena_obj_get_chunk_count(int obj_size);
+// Number of words of the occupancy bitmap of an object arena, which covers the largest arena of the 
+// object size. The bitmap follows the arena header if MALLOC_2D_ARENA_BITMAP is defined, and is 
+// otherwise built from the free list when needed
+inline static int malloc_2d_arena_obj_get_bitmap_size(int obj_size) {
+  int chunk_count = (obj_size > MALLOC_2D_OBJ_MAX_SIZE) ? MALLOC_2D_MEDIUM_ARENA_MAX_CHUNK : 1;
+  return (int)((chunk_count * MALLOC_2D_SLAB_CHUNK_SIZE / obj_size + 63) / 64);
+}
+#define MALLOC_2D_ARENA_BITMAP_MAX_SIZE ((int)(MALLOC_2D_SLAB_CHUNK_SIZE / MALLOC_2D_SC_INCREMENT / 64))
+// Offset of the first object from the arena header. Objects are aligned to the largest power of two 
+// that divides their size, up to a page, which aligned allocation relies on
+inline static int malloc_2d_arena_obj_get_offset(int obj_size) {
+  int alignment = obj_size & -obj_size;
+  if(alignment > (int)MALLOC_2D_PAGE_SIZE) {
+    alignment = (int)MALLOC_2D_PAGE_SIZE;
+  }
+  int header_size = (int)MALLOC_2D_ARENA_HEADER_SIZE;
+#ifdef MALLOC_2D_ARENA_BITMAP
+  header_size += malloc_2d_arena_obj_get_bitmap_size(obj_size) * (int)sizeof(uint64_t);
+#endif
+  return (header_size + alignment - 1) & ~(alignment - 1);
+}
+#ifdef MALLOC_2D_ARENA_BITMAP
+// A bit is set if the slot is allocated. Objects in thread caches and on remote free lists are 
+// allocated as far as the arena is concerned
+inline static uint64_t *malloc_2d_arena_obj_get_bitmap(malloc_2d_arena_t *arena) {
+  return (uint64_t *)MALLOC_2D_PTR_ADD(arena->base, MALLOC_2D_ARENA_HEADER_SIZE);
+}
+// The rounded-up reciprocal is exact for multiples of obj_size below 2^32 / obj_size, which covers 
+// all arenas
+inline static int malloc_2d_arena_obj_get_slot(malloc_2d_arena_t *arena, void *ptr) {
+  uint64_t offset = (uint64_t)ptr - (uint64_t)arena->base - (uint64_t)arena->obj_offset;
+  return (int)((offset * arena->obj_recip) >> 32);
+}
+inline static void malloc_2d_arena_obj_set_used(malloc_2d_arena_t *arena, void *ptr) {
+  int slot = malloc_2d_arena_obj_get_slot(arena, ptr);
+  malloc_2d_arena_obj_get_bitmap(arena)[slot >> 6] |= (1UL << (slot & 63));
+}
+inline static void malloc_2d_arena_obj_set_free(malloc_2d_arena_t *arena, void *ptr) {
+  int slot = malloc_2d_arena_obj_get_slot(arena, ptr);
+  malloc_2d_arena_obj_get_bitmap(arena)[slot >> 6] &= ~(1UL << (slot & 63));
+#ifdef MALLOC_2D_ARENA_BITMAP_ALLOC
+  if((slot >> 6) < arena->bitmap_hint) {
+    arena->bitmap_hint = slot >> 6;
+  }
+#endif
+}
+#endif
 void malloc_2d_arena_free(malloc_2d_arena_t *arena);
 
-// Remove the given header from the free list of the given arena
-// This operation only updates free list and does not update size
-void malloc_2d_arena_varlen_free_list_remove(malloc_2d_arena_t *arena, malloc_2d_arena_varlen_header_t *header);
-void malloc_2d_arena_varlen_free_list_insert_head(malloc_2d_arena_t *arena, malloc_2d_arena_varlen_header_t *header);
 // Remove the arena from the free list of its associated SC object
 void malloc_2d_arena_sc_free_list_remove(malloc_2d_arena_t *arena);
 void malloc_2d_arena_sc_free_list_insert_head(malloc_2d_arena_t *arena);
 
-// Initialize an varlen arena
-malloc_2d_arena_t *malloc_2d_arena_varlen_init();
+// The first block of a varlen arena follows the header, and the last one ends with the chunk
+inline static malloc_2d_arena_varlen_header_t *malloc_2d_arena_varlen_get_first(malloc_2d_arena_t *arena) {
+  return (malloc_2d_arena_varlen_header_t *)MALLOC_2D_PTR_ADD(arena->base, MALLOC_2D_ARENA_HEADER_SIZE);
+}
+inline static void *malloc_2d_arena_varlen_get_end(malloc_2d_arena_t *arena) {
+  return MALLOC_2D_PTR_ADD(arena->base, MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE);
+}
+// Initialize an varlen arena, whose only block is inserted into the index
+malloc_2d_arena_t *malloc_2d_arena_varlen_init(malloc_2d_varlen_index_t *index);
 void malloc_2d_arena_obj_dealloc(malloc_2d_arena_t *arena, void *ptr);
+#ifdef MALLOC_2D_THREAD_SAFE
+// Push a chain of objects (linked through their first word) onto the remote free list without locking
+void malloc_2d_arena_obj_remote_dealloc(malloc_2d_arena_t *arena, void *head, void *tail);
+#endif
+// Free blocks are coalesced with their neighbors and inserted into the index of the arena's sc
 void malloc_2d_arena_varlen_dealloc(malloc_2d_arena_t *arena, void *ptr);
+// Resize a used block in place, taking the free block after it or splitting off the tail. Returns 1 
+// on success, and 0 if the block cannot grow without moving. The caller must hold the sc lock
+int malloc_2d_arena_varlen_realloc(malloc_2d_arena_t *arena, void *ptr, size_t sz);
 void malloc_2d_arena_dealloc(void *ptr);
 
-// Initialize huge arena given the size of the allocated object
-malloc_2d_arena_t *malloc_2d_arena_huge_init(size_t sz);
+// Initialize huge arena given the size and alignment (at least a page) of the allocated object, 
+// which starts at arena->base
+malloc_2d_arena_t *malloc_2d_arena_huge_init(size_t sz, uint64_t alignment);
 void malloc_2d_arena_huge_dealloc(malloc_2d_arena_t *arena);
+// Resize the object with mremap(), which moves page table entries instead of copying. The object 
+// may move, and the new address is returned
+void *malloc_2d_arena_huge_realloc(malloc_2d_arena_t *arena, size_t sz);
 void malloc_2d_arena_huge_print(malloc_2d_arena_t *arena);
 
 // Given a pointer, return allocated size (physical size)
 uint64_t malloc_2d_arena_get_size(void *ptr);
 
+// Called on each live object during iteration
+typedef void (*malloc_2d_for_each_func_t)(void *obj, void *arg);
+// Call func on every live object of the arena in address order; Returns the number of objects
+uint64_t malloc_2d_arena_for_each(malloc_2d_arena_t *arena, malloc_2d_for_each_func_t func, void *arg);
+
 inline static int malloc_2d_arena_is_full(malloc_2d_arena_t *arena) {
   return arena->free_count == 0;
 }
@@ -188,11 +696,18 @@ inline static void malloc_2d_arena_set_varlen(malloc_2d_arena_t *arena) {
 inline static void malloc_2d_arena_set_huge(malloc_2d_arena_t *arena) {
   malloc_2d_arena_set_type(arena, MALLOC_2D_ARENA_FLAGS_HUGE);
 }
+inline static int malloc_2d_arena_is_zero(malloc_2d_arena_t *arena) {
+  return (arena->flags & MALLOC_2D_ARENA_FLAGS_ZERO) != 0;
+}
 
 // Allocate an object from the arena; Returns NULL if fails. 
 void *malloc_2d_arena_obj_alloc(malloc_2d_arena_t *arena);
-// Size can be arbitrary value less than max varlen size; we round it up to 4-byte boundary
-void *malloc_2d_arena_varlen_alloc(malloc_2d_arena_t *arena, int size);
+// Allocate up to "count" objects from the arena; Returns the number of objects allocated
+int malloc_2d_arena_obj_alloc_batch(malloc_2d_arena_t *arena, void **objs, int count);
+// Allocate from a free block of at least actual_size bytes (including the header), which is removed 
+// from the index. The remainder is split into a new free block if it is large enough
+void *malloc_2d_arena_varlen_alloc(malloc_2d_varlen_index_t *index, malloc_2d_arena_varlen_header_t *header, 
+                                   int actual_size);
 
 void malloc_2d_arena_obj_print(malloc_2d_arena_t *arena, int obj_size);
 void malloc_2d_arena_varlen_print(malloc_2d_arena_t *arena);
@@ -205,30 +720,101 @@ void malloc_2d_arena_print(malloc_2d_arena_t *arena, int obj_size);
 #define MALLOC_2D_SC_INDEX_VARLEN     -1
 #define MALLOC_2D_SC_INDEX_HUGE       -2
 
+// Size class of an object of 1 to MALLOC_2D_MEDIUM_MAX_SIZE bytes; Constant for constant sizes
+inline static constexpr int malloc_2d_get_sc_index(uint64_t sz) {
+  if(sz <= MALLOC_2D_OBJ_MAX_SIZE) {
+    return (int)(sz - 1) / MALLOC_2D_SC_INCREMENT;
+  }
+  // sz is in (2^log2, 2^(log2 + 1)], which is split into equal steps
+  int log2 = 63 - __builtin_clzl(sz - 1);
+  int step = (int)((sz - 1 - (1UL << log2)) >> (log2 - MALLOC_2D_MEDIUM_STEP_LOG2));
+  return MALLOC_2D_SC_SMALL_COUNT + ((log2 - __builtin_ctz(MALLOC_2D_OBJ_MAX_SIZE)) << MALLOC_2D_MEDIUM_STEP_LOG2) + step;
+}
+
+// Largest object size of the size class
+inline static constexpr int malloc_2d_get_sc_obj_size(int sc_index) {
+  if(sc_index < MALLOC_2D_SC_SMALL_COUNT) {
+    return (sc_index + 1) * MALLOC_2D_SC_INCREMENT;
+  }
+  int medium_index = sc_index - MALLOC_2D_SC_SMALL_COUNT;
+  int log2 = __builtin_ctz(MALLOC_2D_OBJ_MAX_SIZE) + (medium_index >> MALLOC_2D_MEDIUM_STEP_LOG2);
+  int step = (medium_index & ((1 << MALLOC_2D_MEDIUM_STEP_LOG2) - 1)) + 1;
+  return (1 << log2) + (step << (log2 - MALLOC_2D_MEDIUM_STEP_LOG2));
+}
+
 // Size class object
 typedef struct malloc_2d_sc_struct_t {
   uint64_t type_id;
-  // Size class, 0 means 1--8 bytes, 1 means 9--16 bytes, etc.
+  // Size class, 0 means 1--8 bytes, 1 means 9--16 bytes, etc., followed by medium classes
   int sc_index;
   // Number of live objects; Used to determine whether the sc will be removed
   int count;
-  // Arenas that have at least one free object
+  // Arenas other than the current one (varlen and huge sc only)
   malloc_2d_arena_t *free_list;
   // Current arena that serves allocation
   malloc_2d_arena_t *curr_arena;
-  // Next and prev pointer
-  struct malloc_2d_sc_struct_t *next;
-  struct malloc_2d_sc_struct_t *prev;
+  // Object arenas without free objects other than the current one; Only walked on release
+  malloc_2d_arena_t *full_list;
+  // Object arenas with free objects other than the current one. Bin i holds arenas with 
+  // [i, i + 1) / MALLOC_2D_SC_BIN_COUNT of their objects allocated
+  malloc_2d_arena_t *bins[MALLOC_2D_SC_BIN_COUNT];
+  // Whether the sc is in the hash table; Checked by lock-free lookups after locking the sc
+  int in_ht;
+  // Free blocks of all arenas (varlen sc only)
+  malloc_2d_varlen_index_t *varlen_index;
+  // Time a reclamation pass first found the typed sc without live objects; 0 if it is in use. 
+  // Reset by every allocation
+  uint64_t idle_time;
+  // Protects all fields above and the arenas of this sc (thread-safe mode only). Not reset when 
+  // the sc is reused, since a stale lookup may still be holding it
+  malloc_2d_lock_t lock;
+  // Incremented by every release of the sc, such that thread caches bound to it before drop their 
+  // objects. Not reset when the sc is reused either, since stale caches may still point to it
+  uint64_t release_gen;
+#ifdef MALLOC_2D_THREAD_SAFE
+  // Arenas whose remote free list is non-empty; Lock-free stack linked by remote_next
+  malloc_2d_arena_t *remote_arenas;
+#endif
+#ifdef MALLOC_2D_PERCPU
+  // Per-CPU class of a promoted typed sc; -1 if it is not promoted
+  int percpu_class;
+  // Number of allocations from the central path, used to find hot typed sc
+  int percpu_alloc_count;
+#endif
 } malloc_2d_sc_t;
 
 void malloc_2d_sc_init_in_place(malloc_2d_sc_t *sc, uint64_t type_id, int sc_index);
+// Returns the new sc locked
 malloc_2d_sc_t *malloc_2d_sc_init(uint64_t type_id, int sc_index);
 void malloc_2d_sc_free_in_place(malloc_2d_sc_t *sc);
 void malloc_2d_sc_free(malloc_2d_sc_t *sc);
+// Call func on every live object of the sc, which must be locked by the caller. Arenas are visited 
+// in address order. Objects cached by the calling thread and on per-CPU stacks are returned first
+uint64_t malloc_2d_sc_for_each(malloc_2d_sc_t *sc, malloc_2d_for_each_func_t func, void *arg);
+// Free all objects of the sc, which must be locked by the caller. Returns the number of objects freed,
+// which includes objects in thread caches but not those on per-CPU stacks. Thread caches drop their 
+// objects of the sc when they next use it
+int malloc_2d_sc_release(malloc_2d_sc_t *sc);
+// Allocate allocator metadata from the type-less object sc of the size, bypassing thread caches. 
+// It is freed with malloc_2d_arena_dealloc()
+void *malloc_2d_sc_no_type_alloc(int size);
 
+// The following functions assume that the caller holds the sc lock
 void *malloc_2d_sc_obj_alloc(malloc_2d_sc_t *sc);
+// *is_zero is set to 1 if the object has never been used since its pages were mapped
+void *malloc_2d_sc_obj_alloc_zero(malloc_2d_sc_t *sc, int *is_zero);
+// Allocate/deallocate "count" objects with a single acquisition of the sc
+void malloc_2d_sc_obj_alloc_batch(malloc_2d_sc_t *sc, void **objs, int count);
+void malloc_2d_sc_obj_dealloc_batch(malloc_2d_sc_t *sc, void **objs, int count);
+#ifdef MALLOC_2D_THREAD_SAFE
+// Move objects on the remote free lists of all arenas back to their local free lists
+void malloc_2d_sc_obj_reclaim_remote(malloc_2d_sc_t *sc);
+// Acquires the sc lock or pushes to remote free lists if it is contended
+void malloc_2d_sc_obj_flush(malloc_2d_sc_t *sc, void **objs, int count);
+#endif
 void *malloc_2d_sc_varlen_alloc(malloc_2d_sc_t *sc, size_t sz);
-void *malloc_2d_sc_huge_alloc(malloc_2d_sc_t *sc, size_t sz);
+void *malloc_2d_sc_huge_alloc(malloc_2d_sc_t *sc, size_t sz, uint64_t alignment);
+// Deallocation acquires the sc lock of the arena
 inline static void malloc_2d_sc_dealloc(void *ptr) {
   malloc_2d_arena_dealloc(ptr);
 }
@@ -238,6 +824,88 @@ void malloc_2d_sc_varlen_print(malloc_2d_sc_t *sc);
 void malloc_2d_sc_huge_print(malloc_2d_sc_t *sc);
 void malloc_2d_sc_print(malloc_2d_sc_t *sc);
 
+// Key of an object sc with the sc cached, such that allocations skip the hash table. The sc is only 
+// a hint checked under its lock, since idle sc are reclaimed and reused for other keys. It is also 
+// ignored if the allocator has been initialized again since it was cached (epoch)
+typedef struct {
+  uint64_t type_id;
+  int sc_index;
+  uint64_t epoch;
+  malloc_2d_sc_t *sc;
+} malloc_2d_handle_t;
+
+// Allocate an object of the type and object size class of the handle, updating the cached sc
+void *malloc_2d_handle_alloc(malloc_2d_handle_t *handle);
+
+#ifdef MALLOC_2D_PERCPU
+
+//
+//* malloc_2d_percpu_t
+//
+
+// Per-CPU classes: One for each type-less sc, followed by the promoted typed sc
+#define MALLOC_2D_PERCPU_CLASS_COUNT (MALLOC_2D_SC_COUNT + MALLOC_2D_PERCPU_TYPED_COUNT)
+
+// Stack of free objects of one class on one CPU. It is only accessed in rseq critical sections 
+// by threads running on that CPU, so no atomic operation is needed
+typedef struct {
+  uint64_t count;
+  void *objs[MALLOC_2D_PERCPU_CAPACITY];
+} malloc_2d_percpu_stack_t;
+
+typedef struct {
+  malloc_2d_percpu_stack_t stacks[MALLOC_2D_PERCPU_CLASS_COUNT];
+} malloc_2d_percpu_t;
+
+// Maps a promoted typed sc to its per-CPU class. Entries are written once under the per-CPU lock 
+// and read without locking; percpu_class is written last and 0 means the entry is unused
+typedef struct {
+  uint64_t type_id;
+  int sc_index;
+  int percpu_class;
+} malloc_2d_percpu_hot_t;
+
+// Objects in per-CPU stacks are counted as live in sc->count. Promoted typed sc are never reclaimed
+void *malloc_2d_percpu_alloc(malloc_2d_sc_t *sc, int percpu_class);
+void *malloc_2d_percpu_typed_alloc(uint64_t type_id, int sc_index);
+void *malloc_2d_percpu_handle_alloc(malloc_2d_handle_t *handle);
+void malloc_2d_percpu_dealloc(void *ptr);
+
+#endif
+
+//
+//* malloc_2d_sc_ht_t
+//
+
+// Open-addressing hash table of typed sc with linear probing over cache line-sized buckets. Tables 
+// are modified under malloc_2d->sc_ht_lock, and are read without locking using per-bucket sequence 
+// numbers. Since an sc may be freed after it is found, the reader must lock the sc and check its 
+// key and in_ht. sc memory is never returned to the OS for this reason
+typedef struct {
+  // Odd while the bucket is being modified
+  uint32_t seq;
+  // Number of sc whose probe sequence passes this bucket, i.e., lookups may stop if it is zero
+  uint16_t overflow_count;
+  int16_t sc_index[MALLOC_2D_SC_HT_BUCKET_SIZE];
+  uint64_t type_id[MALLOC_2D_SC_HT_BUCKET_SIZE];
+  // NULL if the entry is empty
+  malloc_2d_sc_t *sc[MALLOC_2D_SC_HT_BUCKET_SIZE];
+} __attribute__((aligned(64))) malloc_2d_sc_ht_bucket_t;
+
+static_assert(sizeof(malloc_2d_sc_ht_bucket_t) == 64, "Hash table bucket must be a cache line");
+
+// Stored in the first cache line of the table's pages. Fields other than next are not changed 
+// after the table is published
+typedef struct malloc_2d_sc_ht_struct_t {
+  uint64_t mask;
+  int bucket_count;
+  // Number of pages of the table including this header
+  int page_count;
+  // Next retired table
+  struct malloc_2d_sc_ht_struct_t *next;
+  malloc_2d_sc_ht_bucket_t *buckets;
+} malloc_2d_sc_ht_t;
+
 typedef struct {
   // Allocation without size class - avoid affecting applications that do not use types
   malloc_2d_sc_t sc_no_type[MALLOC_2D_SC_COUNT];
@@ -245,17 +913,83 @@ typedef struct {
   malloc_2d_sc_t meta_sc;
   // SC for allocation between 512 and arena size (MALLOC_2D_PAGE_SIZE * MALLOC_2D_ARENA_SIZE)
   malloc_2d_sc_t varlen_sc;
+  malloc_2d_varlen_index_t varlen_index;
   // We only use its free list; The curr is always NULL
   malloc_2d_sc_t huge_sc;
-  // Size class hash table pointer
-  malloc_2d_sc_t **sc_ht;
-  // Number of elements in the hash table
+  // Size class hash table; New sc are always inserted here
+  malloc_2d_sc_ht_t *sc_ht;
+  // Table being migrated to sc_ht during a resize, NULL otherwise. Searched before sc_ht
+  malloc_2d_sc_ht_t *sc_ht_old;
+  // Next bucket of sc_ht_old to migrate
+  int sc_ht_migrate_index;
+  // Next bucket of sc_ht to check for idle sc
+  int sc_ht_reclaim_index;
+  // Tables that were migrated. Their buckets are released to the OS, but stale lookups may still 
+  // read them, so they are only unmapped in malloc_2d_free_static()
+  malloc_2d_sc_ht_t *sc_ht_retired;
+  // Number of elements in both tables
   int sc_ht_count;
-  // Number of buckets
-  int sc_ht_bucket_count;
-  // Number of pages for storing all buckets
-  int sc_ht_page_count;
-  uint64_t hash_mask;
+  // Protects the hash table for writing; Must be acquired before any sc lock
+  malloc_2d_lock_t sc_ht_lock;
+  // Leaves of the page map indexed by page / MALLOC_2D_PAGE_MAP_LEAF_SIZE; NULL if not mapped yet
+  uint64_t **page_map;
+  int page_map_leaf_count;
+  // Reserved regions for arenas, in the order of reservation
+  malloc_2d_slab_region_t *slab_regions[MALLOC_2D_SLAB_REGION_MAX];
+  // Regions indexed by address / MALLOC_2D_SLAB_REGION_SIZE; NULL for addresses outside the slab
+  malloc_2d_slab_region_t **slab_region_table;
+  int slab_region_count;
+  // Number of cached (dirty or aged) chunks in all regions
+  int slab_dirty_count;
+  // Arena allocations and frees, and the time of the last decay
+  int slab_op_count;
+  uint64_t slab_decay_time;
+  // Protects the slab; Acquired after sc locks and never held while acquiring another lock
+  malloc_2d_lock_t slab_lock;
+  // Number of live huge objects, and freed huge mappings in no particular order
+  int huge_count;
+  malloc_2d_huge_cache_t huge_cache[MALLOC_2D_HUGE_CACHE_COUNT];
+  int huge_cache_count;
+  int huge_cache_page_count;
+  malloc_2d_lock_t huge_lock;
+#ifdef MALLOC_2D_THREAD_SAFE
+  // Thread caches of exited threads, reused by new threads
+  struct malloc_2d_tcache_struct_t *tcache_free_list;
+  // All thread caches, including retired ones; Protected by tcache_lock
+  struct malloc_2d_tcache_struct_t *tcache_list;
+  malloc_2d_lock_t tcache_lock;
+  // Incremented by every sc release, such that thread caches only check their sc after a release
+  uint64_t release_gen;
+  // Flushes the thread cache on thread exit
+  pthread_key_t tcache_key;
+#endif
+#ifdef MALLOC_2D_PERCPU
+  // MALLOC_2D_PERCPU_MAX_CPU caches, each populated on first use of the CPU
+  malloc_2d_percpu_t *percpu;
+  // Promoted typed sc, indexed by (per-CPU class - MALLOC_2D_SC_COUNT)
+  malloc_2d_sc_t *percpu_typed[MALLOC_2D_PERCPU_TYPED_COUNT];
+  int percpu_typed_count;
+  // Open-addressing table on (type_id, sc_index) of promoted typed sc
+  malloc_2d_percpu_hot_t percpu_hot[MALLOC_2D_PERCPU_HOT_HT_SIZE];
+  malloc_2d_lock_t percpu_lock;
+#endif
+#ifdef MALLOC_2D_LIB_CALL_SITE
+  // Direct-mapped cache of return addresses, with MALLOC_2D_CALL_SITE_WRAPPER set for those in 
+  // wrappers; 0 if the entry is empty
+  uint64_t *call_site_cache;
+#endif
+#ifdef MALLOC_2D_TYPE_PROFILE
+  malloc_2d_profile_t *profile;
+  int profile_count;
+  malloc_2d_lock_t profile_lock;
+#endif
+  // Loaded type map of type_map_capacity entries (a power of 2); NULL if none is loaded
+  malloc_2d_type_map_entry_t *type_map;
+  int type_map_capacity;
+  int type_map_count;
+  // Group of implicit type IDs not in the map if type_map_has_default is 1
+  int type_map_has_default;
+  uint64_t type_map_default;
   malloc_2d_stat_t _stat;
   malloc_2d_stat_t *stat;
 } malloc_2d_t;
@@ -264,16 +998,116 @@ typedef struct {
 void malloc_2d_init_static();
 void malloc_2d_free_static();
 
-malloc_2d_sc_t *malloc_2d_add_new_sc(int ht_index, uint64_t type_id, int sz_index);
-malloc_2d_sc_t *malloc_2d_find_sc(int ht_index, uint64_t type_id, int sc_index);
+// Both functions must be called with the hash table lock held. The new sc is returned locked
+malloc_2d_sc_t *malloc_2d_add_new_sc(uint64_t type_id, int sc_index);
+malloc_2d_sc_t *malloc_2d_find_sc(uint64_t type_id, int sc_index);
+// Returns the sc of the given type and sc index, creating it if necessary. The sc is returned locked
+malloc_2d_sc_t *malloc_2d_get_sc_locked(uint64_t type_id, int sc_index);
+// Reclaims all typed sc that have been idle for MALLOC_2D_SC_IDLE_NS and ages cached arenas. 
+// Insertions into the hash table also reclaim a few buckets at a time. Must not hold any lock
+void malloc_2d_maintain();
+
+#ifdef MALLOC_2D_THREAD_SAFE
+
+//
+//* malloc_2d_tcache_t
+//
+
+// Per-thread stack of free objects belonging to a single sc. A typed magazine pins its sc while 
+// it holds at least one object (the objects are counted as live in sc->count), and it is unbound 
+// (sc == NULL) when it becomes empty
+typedef struct {
+  malloc_2d_sc_t *sc;
+  // Copied from the sc such that lookups do not touch the shared sc
+  uint64_t type_id;
+  int sc_index;
+  int count;
+  // Release generation of the sc when the magazine was bound, and the global release generation 
+  // when it was last checked against the sc
+  uint64_t sc_gen;
+  uint64_t checked_gen;
+  void *objs[MALLOC_2D_TCACHE_MAG_SIZE];
+} malloc_2d_tcache_mag_t;
+
+// Per-thread cache in front of the shared size classes. Allocation and deallocation only touch 
+// this object unless a magazine runs empty or full, in which case MALLOC_2D_TCACHE_BATCH_SIZE 
+// objects are moved from/to the central sc under its lock
+typedef struct malloc_2d_tcache_struct_t {
+  malloc_2d_tcache_mag_t no_type[MALLOC_2D_SC_COUNT];
+  // Set-associative on the hash of (type_id, sc_index)
+  malloc_2d_tcache_mag_t typed[MALLOC_2D_TCACHE_TYPED_COUNT];
+  // Round-robin victim way when all ways of a set are in use
+  int typed_victim;
+  // Links retired thread caches
+  struct malloc_2d_tcache_struct_t *next;
+  // Links all thread caches, which are never freed
+  struct malloc_2d_tcache_struct_t *all_next;
+} malloc_2d_tcache_t;
+
+// Returns NULL if the calling thread has already exited (i.e., the cache was destroyed)
+malloc_2d_tcache_t *malloc_2d_tcache_get();
+void *malloc_2d_tcache_alloc(malloc_2d_tcache_t *tcache, int sc_index);
+void *malloc_2d_tcache_typed_alloc(malloc_2d_tcache_t *tcache, uint64_t type_id, int sc_index);
+void *malloc_2d_tcache_handle_alloc(malloc_2d_tcache_t *tcache, malloc_2d_handle_t *handle);
+void malloc_2d_tcache_dealloc(void *ptr);
+// Return all cached objects of the calling thread to the central size classes
+void malloc_2d_tcache_flush();
+// Returns the number of objects of the sc cached by all threads. The caller must hold the sc lock, 
+// and other threads must not use the sc meanwhile
+int malloc_2d_tcache_count(malloc_2d_sc_t *sc);
+// Return objects of the sc cached by the calling thread; The caller must hold the sc lock
+void malloc_2d_tcache_return(malloc_2d_sc_t *sc);
+
+#endif
 
 void *malloc_2d_alloc(uint64_t sz);
 void *malloc_2d_typed_alloc_implicit(uint64_t sz);
 void *malloc_2d_typed_alloc(uint64_t type_id, uint64_t sz);
+#ifdef MALLOC_2D_LIB_CALL_SITE
+#define MALLOC_2D_CALL_SITE_WRAPPER (1UL << 63)
+#define MALLOC_2D_CALL_SITE_CACHE_PAGE_COUNT \
+  ((int)((MALLOC_2D_CALL_SITE_CACHE_SIZE * sizeof(uint64_t) + MALLOC_2D_PAGE_SIZE - 1) / MALLOC_2D_PAGE_SIZE))
+// Returns the type ID of an object allocated by the caller of malloc(), given the return address 
+// and frame of malloc(), or 0 if the thread is already computing one. Frames past the first are 
+// found through saved frame pointers, and only those within the stack of the thread are followed
+uint64_t malloc_2d_call_site_get_type(void *ret_addr, void *frame);
+#endif
+// Returns the resized object, which may have moved; ptr may be NULL. Huge objects are not copied
+void *malloc_2d_realloc(void *ptr, uint64_t sz);
+// Allocate "count" objects of the type and size with a single size class lookup
+void malloc_2d_typed_alloc_batch(uint64_t type_id, uint64_t sz, int count, void **objs);
+// Free "count" objects of any type and size; NULL entries are ignored. Objects allocated together 
+// should be freed together, such that they share arenas
+void malloc_2d_dealloc_batch(void **objs, int count);
+// Free all objects of the type at once, or those of the size class that "sz" maps to. Objects must 
+// not be accessed or freed afterwards, and other threads must not allocate or free objects of the 
+// type during the call. Objects cached by threads are dropped, which per-CPU stacks of other CPUs 
+// only allow since no thread uses them meanwhile. Returns the number of live objects freed
+uint64_t malloc_2d_type_release(uint64_t type_id);
+uint64_t malloc_2d_type_release_sc(uint64_t type_id, uint64_t sz);
+// Call func on every live object of the type, one size class after another. The size class is 
+// locked during the calls, so func must not allocate or free objects of the type. Objects freed by 
+// other threads may still be cached by them and are visited, unless they called 
+// malloc_2d_tcache_flush(). Per-CPU stacks are drained, so other threads must not use the type 
+// meanwhile in per-CPU mode. Returns the number of objects visited
+uint64_t malloc_2d_type_for_each(uint64_t type_id, malloc_2d_for_each_func_t func, void *arg);
+// Returns a zero-initialized object, or NULL if count * sz overflows
+void *malloc_2d_calloc(uint64_t count, uint64_t sz);
+// Returns an object aligned to "alignment", or NULL if it is not a power of two
+void *malloc_2d_aligned_alloc(uint64_t alignment, uint64_t sz);
 inline static void malloc_2d_dealloc(void *ptr) {
   //fprintf(stderr, "malloc_2d_dealloc ptr %p\n", ptr);
   if(ptr != NULL) {
+#ifdef MALLOC_2D_TYPE_PROFILE
+    malloc_2d_profile_dealloc(ptr);
+#endif
+#if defined(MALLOC_2D_PERCPU)
+    malloc_2d_percpu_dealloc(ptr);
+#elif defined(MALLOC_2D_THREAD_SAFE)
+    malloc_2d_tcache_dealloc(ptr);
+#else
     malloc_2d_sc_dealloc(ptr);
+#endif
   }
   //fprintf(stderr, "  ret\n");
 }
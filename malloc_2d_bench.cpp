@@ -0,0 +1,91 @@
+
+#include "malloc_2d.h"
+#include <pthread.h>
+#include <time.h>
+
+// Number of live objects each thread keeps
+#define MALLOC_2D_BENCH_WINDOW     1024
+// Number of malloc/free pairs per thread
+#define MALLOC_2D_BENCH_OP_COUNT   (4 * 1024 * 1024)
+// Number of distinct type IDs used by typed allocation
+#define MALLOC_2D_BENCH_TYPE_COUNT 8
+
+static uint64_t malloc_2d_bench_get_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+inline static uint64_t malloc_2d_bench_rand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+// Each thread keeps a sliding window of live objects. Every operation frees a random object in the
+// window and replaces it with a new one of random size (8--256 bytes), half of which are typed
+static void *malloc_2d_bench_thread(void *arg) {
+  uint64_t state = (uint64_t)arg * 0x9e3779b97f4a7c15UL + 1;
+  void **window = (void **)malloc_2d_alloc(sizeof(void *) * MALLOC_2D_BENCH_WINDOW);
+  for(int i = 0;i < MALLOC_2D_BENCH_WINDOW;i++) {
+    window[i] = malloc_2d_alloc(8 + malloc_2d_bench_rand(&state) % 249);
+  }
+  for(int i = 0;i < MALLOC_2D_BENCH_OP_COUNT;i++) {
+    uint64_t r = malloc_2d_bench_rand(&state);
+    int index = (int)(r % MALLOC_2D_BENCH_WINDOW);
+    uint64_t sz = 8 + (r >> 16) % 249;
+    malloc_2d_dealloc(window[index]);
+    if((r >> 32) & 0x1) {
+      window[index] = malloc_2d_typed_alloc(1 + ((r >> 40) % MALLOC_2D_BENCH_TYPE_COUNT), sz);
+    } else {
+      window[index] = malloc_2d_alloc(sz);
+    }
+    // Touch the object such that the allocator cannot be measured without its memory traffic
+    *(volatile uint64_t *)window[index] = r;
+  }
+  for(int i = 0;i < MALLOC_2D_BENCH_WINDOW;i++) {
+    malloc_2d_dealloc(window[i]);
+  }
+  malloc_2d_dealloc(window);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(argc > 1) {
+    max_threads = atoi(argv[1]);
+  }
+  if(max_threads <= 0) {
+    max_threads = 1;
+  }
+  malloc_2d_init_static();
+  malloc_2d_conf_print();
+  printf("---------- malloc_2d bench ----------\n");
+  printf("Ops per thread %d window %d types %d\n",
+    MALLOC_2D_BENCH_OP_COUNT, MALLOC_2D_BENCH_WINDOW, MALLOC_2D_BENCH_TYPE_COUNT);
+  pthread_t *threads = (pthread_t *)malloc_2d_alloc(sizeof(pthread_t) * max_threads);
+  double base_mops = 0.0;
+  for(int thread_count = 1;thread_count <= max_threads;thread_count++) {
+    uint64_t begin = malloc_2d_bench_get_ns();
+    for(int i = 0;i < thread_count;i++) {
+      int ret = pthread_create(&threads[i], NULL, malloc_2d_bench_thread, (void *)(uint64_t)(i + 1));
+      SYSEXPECT(ret == 0);
+    }
+    for(int i = 0;i < thread_count;i++) {
+      pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = malloc_2d_bench_get_ns() - begin;
+    double mops = (double)MALLOC_2D_BENCH_OP_COUNT * thread_count * 1000.0 / (double)elapsed;
+    if(thread_count == 1) {
+      base_mops = mops;
+    }
+    printf("Threads %d time %.3lf s throughput %.2lf Mops/s speedup %.2lfx\n",
+      thread_count, (double)elapsed / 1e9, mops, mops / base_mops);
+  }
+  malloc_2d_dealloc(threads);
+  malloc_2d_stat_print();
+  return 0;
+}
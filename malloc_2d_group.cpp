@@ -0,0 +1,269 @@
+
+#include "malloc_2d.h"
+#include <algorithm>
+
+// Types whose peak live bytes fill at least this many arenas are hot and keep their own group
+#define MALLOC_2D_GROUP_HOT_ARENAS  1
+// A hot type is split by size if both sides of a power of two get at least this percentage of its
+// allocations
+#define MALLOC_2D_GROUP_SPLIT_PCT   25
+// Cold types are grouped by lifetime, with classes separated by these nanoseconds
+#define MALLOC_2D_GROUP_SHORT_NS    1000000UL
+#define MALLOC_2D_GROUP_LONG_NS     1000000000UL
+#define MALLOC_2D_GROUP_DEFAULT_MAX 64
+
+typedef struct {
+  // Type IDs are kept as written, i.e., module and offset, or hex
+  char type[256];
+  char next[256];
+  uint64_t alloc_count;
+  uint64_t free_count;
+  uint64_t max_live_count;
+  uint64_t size_sum;
+  uint64_t live_ns;
+  int64_t next_votes;
+  uint64_t size_hist[MALLOC_2D_PROFILE_SIZE_BUCKETS];
+  // Representative of the union of co-allocated cold types; -1 for hot types
+  int parent;
+  // Group, and the group of objects above split_size if it is split (0 if not)
+  int group;
+  int split_group;
+  uint64_t split_size;
+} malloc_2d_group_type_t;
+
+static malloc_2d_group_type_t *types = NULL;
+static int type_count = 0;
+static int type_capacity = 0;
+
+static int malloc_2d_group_cmp_type(const void *a, const void *b) {
+  return strcmp(((const malloc_2d_group_type_t *)a)->type, ((const malloc_2d_group_type_t *)b)->type);
+}
+
+// Types are sorted by type ID after all profiles are read
+static int malloc_2d_group_find(const char *type) {
+  malloc_2d_group_type_t key;
+  memcpy(key.type, type, strlen(type) + 1);
+  malloc_2d_group_type_t *t = (malloc_2d_group_type_t *)bsearch(&key, types, type_count, 
+    sizeof(malloc_2d_group_type_t), malloc_2d_group_cmp_type);
+  return (t == NULL) ? -1 : (int)(t - types);
+}
+
+static void malloc_2d_group_read(const char *path) {
+  FILE *fp = fopen(path, "r");
+  SYSEXPECT_FILE(fp != NULL, path);
+  char line[4096];
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    if(line[0] == '#') {
+      continue;
+    }
+    malloc_2d_group_type_t t;
+    memset(&t, 0x00, sizeof(t));
+    int offset = 0;
+    if(sscanf(line, "%255s %lu %lu %lu %lu %lu %255s %ld%n", t.type, &t.alloc_count, &t.free_count,
+         &t.max_live_count, &t.size_sum, &t.live_ns, t.next, &t.next_votes, &offset) != 8) {
+      continue;
+    }
+    for(int i = 0;i < MALLOC_2D_PROFILE_SIZE_BUCKETS;i++) {
+      int n = 0;
+      if(sscanf(line + offset, "%lu%n", &t.size_hist[i], &n) != 1) {
+        break;
+      }
+      offset += n;
+    }
+    if(type_count == type_capacity) {
+      type_capacity = (type_capacity == 0) ? 1024 : type_capacity * 2;
+      types = (malloc_2d_group_type_t *)realloc(types, sizeof(malloc_2d_group_type_t) * type_capacity);
+      SYSEXPECT(types != NULL);
+    }
+    types[type_count++] = t;
+  }
+  fclose(fp);
+  return;
+}
+
+// Lines of all profiles with the same type ID, e.g., from several processes, are merged
+static void malloc_2d_group_merge() {
+  qsort(types, type_count, sizeof(malloc_2d_group_type_t), malloc_2d_group_cmp_type);
+  int count = 0;
+  for(int i = 0;i < type_count;i++) {
+    if(count == 0 || strcmp(types[count - 1].type, types[i].type) != 0) {
+      types[count++] = types[i];
+      continue;
+    }
+    malloc_2d_group_type_t *u = &types[count - 1];
+    malloc_2d_group_type_t *t = &types[i];
+    u->alloc_count += t->alloc_count;
+    u->free_count += t->free_count;
+    u->max_live_count = std::max(u->max_live_count, t->max_live_count);
+    u->size_sum += t->size_sum;
+    u->live_ns += t->live_ns;
+    if(t->next_votes > u->next_votes) {
+      memcpy(u->next, t->next, sizeof(t->next));
+      u->next_votes = t->next_votes;
+    }
+    for(int j = 0;j < MALLOC_2D_PROFILE_SIZE_BUCKETS;j++) {
+      u->size_hist[j] += t->size_hist[j];
+    }
+  }
+  type_count = count;
+  return;
+}
+
+static uint64_t malloc_2d_group_peak_bytes(malloc_2d_group_type_t *t) {
+  return (t->alloc_count == 0UL) ? 0UL : t->max_live_count * (t->size_sum / t->alloc_count);
+}
+
+static int malloc_2d_group_root(int index) {
+  while(types[index].parent != index) {
+    types[index].parent = types[types[index].parent].parent;
+    index = types[index].parent;
+  }
+  return index;
+}
+
+static int malloc_2d_group_cmp_peak(const void *a, const void *b) {
+  uint64_t pa = malloc_2d_group_peak_bytes(&types[*(const int *)a]);
+  uint64_t pb = malloc_2d_group_peak_bytes(&types[*(const int *)b]);
+  return (pa < pb) - (pa > pb);
+}
+
+// Returns the bucket below which the hot type is split, or -1 if no split is balanced enough
+static int malloc_2d_group_find_split(malloc_2d_group_type_t *t) {
+  uint64_t below = 0UL;
+  for(int i = 0;i < MALLOC_2D_PROFILE_SIZE_BUCKETS - 1;i++) {
+    below += t->size_hist[i];
+    if(below * 100 >= t->alloc_count * MALLOC_2D_GROUP_SPLIT_PCT &&
+       (t->alloc_count - below) * 100 >= t->alloc_count * MALLOC_2D_GROUP_SPLIT_PCT) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Hot types get their own group, split by size if their sizes are bimodal, as long as half of the
+// budget is not used up. Cold types are joined with the type they are mostly allocated before, and
+// the unions are grouped by their dominant size and lifetime. Cold keys beyond the budget share the
+// last group. Types not in the profile go to the largest cold group
+static int malloc_2d_group_plan(int max_groups) {
+  int *order = (int *)malloc(sizeof(int) * (type_count + 1));
+  for(int i = 0;i < type_count;i++) {
+    order[i] = i;
+    types[i].parent = i;
+    types[i].group = types[i].split_group = 0;
+  }
+  qsort(order, type_count, sizeof(int), malloc_2d_group_cmp_peak);
+  int group_count = 0;
+  for(int i = 0;i < type_count;i++) {
+    malloc_2d_group_type_t *t = &types[order[i]];
+    if(malloc_2d_group_peak_bytes(t) < MALLOC_2D_GROUP_HOT_ARENAS * MALLOC_2D_SLAB_CHUNK_SIZE ||
+       group_count >= max_groups / 2) {
+      break;
+    }
+    t->parent = -1;
+    t->group = ++group_count;
+    int split = malloc_2d_group_find_split(t);
+    if(split >= 0 && group_count < max_groups / 2) {
+      t->split_size = (2UL << split) - 1;
+      t->split_group = ++group_count;
+    }
+  }
+  for(int i = 0;i < type_count;i++) {
+    if(types[i].parent < 0 || types[i].next_votes * 2 <= (int64_t)types[i].alloc_count) {
+      continue;
+    }
+    int next = malloc_2d_group_find(types[i].next);
+    if(next >= 0 && types[next].parent >= 0) {
+      types[malloc_2d_group_root(i)].parent = malloc_2d_group_root(next);
+    }
+  }
+  // Sum the size histogram and lifetime of each union at its root
+  uint64_t (*hist)[MALLOC_2D_PROFILE_SIZE_BUCKETS] =
+    (uint64_t (*)[MALLOC_2D_PROFILE_SIZE_BUCKETS])calloc(type_count + 1, sizeof(*hist));
+  uint64_t *alloc = (uint64_t *)calloc(type_count + 1, sizeof(uint64_t));
+  uint64_t *live_ns = (uint64_t *)calloc(type_count + 1, sizeof(uint64_t));
+  for(int i = 0;i < type_count;i++) {
+    if(types[i].parent < 0) {
+      continue;
+    }
+    int root = malloc_2d_group_root(i);
+    for(int j = 0;j < MALLOC_2D_PROFILE_SIZE_BUCKETS;j++) {
+      hist[root][j] += types[i].size_hist[j];
+    }
+    alloc[root] += types[i].alloc_count;
+    live_ns[root] += types[i].live_ns;
+  }
+  // Key of a union: Dominant size bucket times 3 lifetime classes
+  int key_count = MALLOC_2D_PROFILE_SIZE_BUCKETS * 3;
+  int *key_group = (int *)calloc(key_count, sizeof(int));
+  uint64_t *group_alloc = (uint64_t *)calloc(max_groups + 2, sizeof(uint64_t));
+  int default_group = 0;
+  for(int i = 0;i < type_count;i++) {
+    if(types[i].parent < 0) {
+      continue;
+    }
+    int root = malloc_2d_group_root(i);
+    int bucket = 0;
+    for(int j = 1;j < MALLOC_2D_PROFILE_SIZE_BUCKETS;j++) {
+      if(hist[root][j] > hist[root][bucket]) {
+        bucket = j;
+      }
+    }
+    uint64_t lifetime = (alloc[root] == 0UL) ? 0UL : live_ns[root] / alloc[root];
+    int life = (lifetime < MALLOC_2D_GROUP_SHORT_NS) ? 0 : ((lifetime < MALLOC_2D_GROUP_LONG_NS) ? 1 : 2);
+    int key = bucket * 3 + life;
+    if(key_group[key] == 0) {
+      key_group[key] = (group_count < max_groups) ? ++group_count : group_count;
+    }
+    types[i].group = key_group[key];
+    group_alloc[types[i].group] += types[i].alloc_count;
+    if(default_group == 0 || group_alloc[types[i].group] > group_alloc[default_group]) {
+      default_group = types[i].group;
+    }
+  }
+  if(default_group == 0) {
+    default_group = ++group_count;
+  }
+  free(order);
+  free(hist);
+  free(alloc);
+  free(live_ns);
+  free(key_group);
+  free(group_alloc);
+  return default_group;
+}
+
+int main(int argc, char **argv) {
+  int max_groups = MALLOC_2D_GROUP_DEFAULT_MAX;
+  int arg = 1;
+  if(arg + 1 < argc && strcmp(argv[arg], "-g") == 0) {
+    max_groups = atoi(argv[arg + 1]);
+    arg += 2;
+  }
+  if(argc - arg < 2 || max_groups < 1) {
+    fprintf(stderr, "Usage: %s [-g max groups] <output map> <profile>...\n", argv[0]);
+    return 1;
+  }
+  for(int i = arg + 1;i < argc;i++) {
+    malloc_2d_group_read(argv[i]);
+  }
+  malloc_2d_group_merge();
+  int default_group = malloc_2d_group_plan(max_groups);
+  FILE *fp = fopen(argv[arg], "w");
+  SYSEXPECT_FILE(fp != NULL, argv[arg]);
+  fprintf(fp, "# type group [max size]\n");
+  int group_count = default_group;
+  for(int i = 0;i < type_count;i++) {
+    malloc_2d_group_type_t *t = &types[i];
+    if(t->split_group != 0) {
+      fprintf(fp, "%s %d %lu\n", t->type, t->group, t->split_size);
+      fprintf(fp, "%s %d\n", t->type, t->split_group);
+    } else {
+      fprintf(fp, "%s %d\n", t->type, t->group);
+    }
+    group_count = std::max(group_count, std::max(t->group, t->split_group));
+  }
+  fprintf(fp, "* %d\n", default_group);
+  fclose(fp);
+  printf("Types %d groups %d default group %d\n", type_count, group_count, default_group);
+  return 0;
+}
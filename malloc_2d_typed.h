@@ -0,0 +1,101 @@
+
+#ifndef _MALLOC_2D_TYPED
+#define _MALLOC_2D_TYPED
+
+#include "malloc_2d.h"
+#include <new>
+#include <utility>
+
+// C++ interface of typed allocation. The type ID and size class of a type are computed at compile
+// time, and the sc of each type is cached in a static handle, so allocating an object neither
+// hashes nor searches the sc hash table. This header cannot be included in the translation unit of
+// malloc_2d.cpp, whose allocator object is also named malloc_2d
+
+namespace malloc_2d {
+
+// FNV-1a of the signature of this function, which names T and is stable across runs and builds by
+// the same compiler. IDs are never 0 (untyped) and stay below MALLOC_2D_TYPE_GROUP_BASE
+template<typename T>
+constexpr uint64_t type_id() {
+  const char *name = __PRETTY_FUNCTION__;
+  uint64_t h = 0xcbf29ce484222325UL;
+  for(int i = 0;name[i] != '\0';i++) {
+    h = (h ^ (uint8_t)name[i]) * 0x100000001b3UL;
+  }
+  return (h >> 17) + 1;
+}
+
+template<typename T>
+struct type_handle {
+  static constexpr uint64_t id = type_id<T>();
+  // Single objects come from the object sc of sizeof(T) if it fits and its objects are aligned for
+  // T, i.e., the class size is a multiple of alignof(T)
+  static constexpr bool use_handle = sizeof(T) <= MALLOC_2D_MEDIUM_MAX_SIZE &&
+    alignof(T) <= MALLOC_2D_PAGE_SIZE &&
+    malloc_2d_get_sc_obj_size(malloc_2d_get_sc_index(sizeof(T))) % alignof(T) == 0;
+  static constexpr int sc_index = use_handle ? malloc_2d_get_sc_index(sizeof(T)) : 0;
+  static inline malloc_2d_handle_t handle = {id, sc_index, 0UL, NULL};
+};
+
+// Arrays and objects without a handle are allocated by size. Arrays of over-aligned types are
+// untyped, since only object size classes guarantee more than 8-byte alignment
+template<typename T>
+inline T *alloc(uint64_t count) {
+  if(type_handle<T>::use_handle && count == 1UL) {
+    return (T *)malloc_2d_handle_alloc(&type_handle<T>::handle);
+  }
+  uint64_t sz;
+  if(__builtin_mul_overflow(count, sizeof(T), &sz)) {
+    error_exit("Array of %lu objects of %lu bytes is too large\n", count, sizeof(T));
+  } else if(alignof(T) <= MALLOC_2D_SC_INCREMENT) {
+    return (T *)malloc_2d_typed_alloc(type_handle<T>::id, sz);
+  }
+  return (T *)malloc_2d_aligned_alloc(alignof(T), sz);
+}
+
+// Returns a new object of T constructed from the arguments
+template<typename T, typename... Args>
+inline T *make(Args&&... args) {
+  return new (alloc<T>(1UL)) T(std::forward<Args>(args)...);
+}
+
+// Destructs and frees an object from make(); ptr may be NULL
+template<typename T>
+inline void destroy(T *ptr) {
+  if(ptr != NULL) {
+    ptr->~T();
+    malloc_2d_dealloc(ptr);
+  }
+  return;
+}
+
+// STL allocator. Containers rebind it to their node types, e.g., the nodes of std::map and
+// std::list, which then get their own type IDs and arenas
+template<typename T>
+class typed_allocator {
+ public:
+  typedef T value_type;
+  typed_allocator() noexcept {}
+  template<typename U>
+  typed_allocator(const typed_allocator<U> &) noexcept {}
+  T *allocate(size_t count) {
+    return alloc<T>((uint64_t)count);
+  }
+  void deallocate(T *ptr, size_t) {
+    malloc_2d_dealloc(ptr);
+  }
+};
+
+// All allocators are interchangeable, since any object can be freed through any of them
+template<typename T, typename U>
+inline bool operator==(const typed_allocator<T> &, const typed_allocator<U> &) {
+  return true;
+}
+template<typename T, typename U>
+inline bool operator!=(const typed_allocator<T> &, const typed_allocator<U> &) {
+  return false;
+}
+
+}
+
+#endif